@@ -1,14 +1,44 @@
 #include <glad/gl.h>
+#ifdef HELLOCUBE_GLTRACE
+#include <glad/gltrace.h>
+#endif
 #include <GLFW/glfw3.h>
 
 #include <glm/mat4x4.hpp>
 #include <glm/gtc/type_ptr.hpp>
 #include <glm/gtc/constants.hpp>
 #include <glm/gtx/transform.hpp>
-
+#include <glm/gtc/random.hpp>
+#include <glm/gtc/quaternion.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <ctype.h>
+#include <errno.h>
+#include <math.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifndef WIN32
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
 
 /****************************************************************************
  * DATA STRUCTURES                                                          *
@@ -16,12 +46,86 @@
 
 #define APP_TITLE "Hello, cube!"
 
-/* Cube: state required for the cube. */
+/* Mesh: a range of vertices and indices inside the buffers of an arena */
+typedef struct {
+	GLint baseVertex;	/* index of the first vertex in the vertex buffer */
+	GLuint vertexCount;	/* number of vertices */
+	GLuint firstIndex;	/* index of the first element in the index buffer */
+	GLsizei indexCount;	/* number of indices (3 per triangle) */
+} Mesh;
+
+/* FreeRange: a contiguous range of free elements */
+typedef struct {
+	GLuint offset;
+	GLuint size;
+} FreeRange;
+
+/* FreeList: a first-fit sub-allocator for the elements [0,capacity).
+ * The free ranges are kept sorted by offset, so that released ranges can
+ * be merged with their neighbors. */
+typedef struct {
+	GLuint capacity;
+	std::vector<FreeRange> ranges;
+} FreeList;
+
+/* BufferArena: a vertex buffer, an index buffer and a VAO shared by all
+ * meshes using the same vertex format. Meshes are sub-allocated from the
+ * buffers and addressed by base vertex and first index, so drawing
+ * different meshes never requires switching the VAO. */
 typedef struct {
 	GLuint vbo[2];		/* vertex and index buffer names */
 	GLuint vao;		/* vertex array object */
-	glm::mat4 model;	/* local model transformation */
-} Cube;
+	FreeList vertices;	/* allocator for the vertex buffer, in vertices */
+	FreeList indices;	/* allocator for the index buffer, in indices */
+	unsigned int generation;	/* incremented whenever vbo is replaced */
+} BufferArena;
+
+/* SceneGraph: a flat transformation hierarchy in structure-of-arrays form.
+ * Nodes are stored in topological order, a parent always has a smaller
+ * index than its children. Thus, a single pass in index order updates
+ * all world matrices, and only nodes whose local transformation or one
+ * of whose ancestors changed since the last update are recomputed. */
+typedef struct {
+	std::vector<int> parent;		/* parent node index, -1 for roots */
+	std::vector<glm::mat4> local;		/* node to parent transformation */
+	std::vector<glm::mat4> world;		/* node to world transformation */
+	std::vector<unsigned char> dirty;	/* local changed since last update */
+	size_t firstDirty;			/* smallest dirty index, size() if none */
+} SceneGraph;
+
+/* SceneObject: an instance of a mesh attached to a scene graph node */
+typedef struct {
+	unsigned int mesh;	/* index into Scene::meshes */
+	unsigned int node;	/* index into the scene graph */
+} SceneObject;
+
+/* DrawItem: everything needed to draw an object, see sceneBuildDrawList() */
+typedef struct {
+	glm::mat4 model;
+	GLsizei indexCount;
+	GLuint firstIndex;
+	GLint baseVertex;
+} DrawItem;
+
+/* SceneProgram: a linked program and the locations of the uniforms
+ * drawScene() sets. Uniform values are program state, so every context
+ * drawing concurrently needs a program of its own. */
+typedef struct {
+	GLuint program;
+	GLint locProjection;
+	GLint locModelView;
+	GLint locTime;
+} SceneProgram;
+
+/* Scene: state required for the things we render. All meshes live in
+ * the same buffer arena. */
+typedef struct {
+	BufferArena arena;
+	std::vector<Mesh> meshes;
+	std::vector<SceneObject> objects;
+	SceneGraph graph;
+	unsigned int root;	/* the root node, rotates everything */
+} Scene;
 
 /* OpenGL debug output error level */
 typedef enum {
@@ -30,6 +134,12 @@ typedef enum {
 	DEBUG_OUTPUT_ALL
 } DebugOutputLevel;
 
+/* log levels, messages above the configured level are dropped */
+typedef enum {
+	LOG_WARN=0,
+	LOG_INFO
+} LogLevel;
+
 /* AppConfig: application configuration, controllable via command line arguments*/
 struct AppConfig {
 	int posx;
@@ -41,6 +151,86 @@ struct AppConfig {
 	unsigned int frameCount;
 	DebugOutputLevel debugOutputLevel;
 	bool debugOutputSynchronous;
+	const char *debugFilter;	/* --gl-debug-filter rules, or NULL */
+
+	/* procedural scene generation */
+	unsigned int gridSize;		/* place gridSize^3 objects in a regular grid */
+	unsigned int sphereTriangles;	/* if not 0, use a sphere with about that many triangles instead of the cube */
+	unsigned int randomObjects;	/* number of additional, randomly placed objects */
+	unsigned int randomSeed;	/* seed for the random placement */
+
+	/* mesh files */
+	std::vector<const char*> meshFiles;	/* mesh files to stream in the background */
+	const char *saveMesh;		/* if set, write the generated mesh to this file */
+
+	/* textures */
+	const char *textureFile;	/* KTX or DDS file, a checkerboard is generated if not set */
+
+	/* threading and simulation */
+	bool threaded;			/* simulate and render in separate threads */
+	double simRate;			/* simulation steps per second */
+
+	/* latency measurement and pacing */
+	bool latency;			/* measure input-to-photon latency */
+	bool jitPacing;			/* sleep before sampling the input, not after the swap */
+	double jitMargin;		/* safety margin for the just-in-time pacing, in ms */
+
+	/* frame pacing */
+	int swapInterval;		/* passed to glfwSwapInterval */
+	double targetFps;		/* limit the frame rate, 0 for no limit */
+	int framesInFlight;		/* max. frames queued on the GPU, 0 for the driver default */
+
+	/* multiple windows */
+	int windows;			/* number of windows showing the scene */
+
+	/* offscreen rendering */
+	bool offscreen;			/* render into an FBO and blit it to the window */
+	int renderScale;		/* size of the render target in percent of the window */
+	int samples;			/* MSAA samples, 0 to disable */
+	const char *colorFormat;	/* name of the color format */
+	const char *depthFormat;	/* name of the depth format */
+	double resolutionBudget;	/* GPU time per frame in ms for dynamic resolution, 0 to disable */
+	int maxRenderScale;		/* upper limit of the dynamic resolution in percent */
+
+	/* performance counters */
+	bool counters;			/* sample performance counters per render pass */
+	const char *counterFilter;	/* comma-separated words to select hardware counters by name */
+	bool drawStats;			/* query the work of every draw call */
+
+	/* heads-up display */
+	bool hud;			/* show the frame time graph and counters in the window */
+
+	/* metrics export */
+	const char *metricsAddress;	/* localhost port or "unix:" socket path, NULL to disable */
+
+	/* GPU memory tracking */
+	unsigned int gpuBudget;		/* in MiB, 0 for no budget */
+
+	/* benchmark mode */
+	const char *benchFile;		/* write a summary of the frame times to this file, NULL to disable */
+	unsigned int benchWarmup;	/* frames excluded from the summary */
+	unsigned int shader;		/* the initial shader slot, as on the number keys */
+
+	/* frame capture */
+	const char *captureFile;	/* .y4m file or printf pattern for PNG files, NULL to disable */
+
+	/* golden image tests */
+	const char *goldenDir;		/* directory of the golden images, NULL to run normally */
+	bool goldenUpdate;		/* write the golden images instead of comparing */
+	double goldenTolerance;		/* max. perceptual difference (CIE76 delta E) per pixel */
+
+	/* deterministic runs */
+	double fixedDt;			/* advance a virtual clock by this per frame, 0 for real time */
+	const char *recordFile;		/* record the keyboard input to this file */
+	const char *replayFile;		/* replay the keyboard input from this file */
+	bool deterministic;		/* set by the above: don't depend on GPU or thread timing */
+
+	/* logging */
+	LogLevel logLevel;		/* the most verbose level to log */
+	bool logSync;			/* write the messages directly, not in a separate thread */
+
+	/* profiling */
+	const char *traceFile;		/* write a Chrome trace of the profiling zones, NULL to disable */
 
 	AppConfig() :
 		posx(100),
@@ -51,10 +241,485 @@ struct AppConfig {
 		fullscreen(false),
 		frameCount(0),
 		debugOutputLevel(DEBUG_OUTPUT_DISABLED),
-		debugOutputSynchronous(false)
+		debugOutputSynchronous(false),
+		debugFilter(NULL),
+		gridSize(1),
+		sphereTriangles(0),
+		randomObjects(0),
+		randomSeed(1),
+		saveMesh(NULL),
+		textureFile(NULL),
+		threaded(false),
+		simRate(120.0),
+		latency(false),
+		jitPacing(false),
+		jitMargin(1.0),
+		swapInterval(1),
+		targetFps(0.0),
+		framesInFlight(0),
+		windows(1),
+		offscreen(false),
+		renderScale(100),
+		samples(0),
+		colorFormat("rgba8"),
+		depthFormat("depth24"),
+		resolutionBudget(0.0),
+		maxRenderScale(200),
+		counters(false),
+		counterFilter("prim,vert,frag,pixel,cycle,busy"),
+		drawStats(false),
+		hud(false),
+		metricsAddress(NULL),
+		gpuBudget(0),
+		benchFile(NULL),
+		benchWarmup(60),
+		shader(1),
+		captureFile(NULL),
+		goldenDir(NULL),
+		goldenUpdate(false),
+		goldenTolerance(2.3),
+		fixedDt(0.0),
+		recordFile(NULL),
+		replayFile(NULL),
+		deterministic(false),
+		logLevel(LOG_INFO),
+		logSync(false),
+		traceFile(NULL)
 	{}
 };
 
+/* StreamMessage: sent from the mesh loader thread to the render thread */
+typedef enum {
+	STREAM_MESH_BEGIN=0,	/* a new mesh: reserve space in the arena */
+	STREAM_MESH_DATA,	/* a chunk of data is ready in the staging ring */
+	STREAM_MESH_END,	/* all chunks of the mesh were sent */
+	STREAM_MESH_FAILED	/* the mesh could not be loaded */
+} StreamMessageType;
+
+typedef struct {
+	StreamMessageType type;
+	unsigned int file;		/* index into AppConfig::meshFiles */
+	GLuint vertexCount;		/* BEGIN: size of the mesh */
+	GLuint indexCount;
+	int buffer;			/* DATA: 0 for vertex data, 1 for index data */
+	GLintptr dstOffset;		/* DATA: byte offset relative to the mesh's first vertex/index */
+	GLintptr srcOffset;		/* DATA: byte offset in the staging ring */
+	GLsizeiptr size;		/* DATA: size of the chunk in bytes */
+	unsigned long long end;		/* DATA: ring position after the chunk */
+} StreamMessage;
+
+/* StreamFence: the staging ring up to "end" may be reused once the fence
+ * is signaled */
+typedef struct {
+	GLsync fence;
+	unsigned long long end;
+	std::vector<unsigned int> completed;	/* files which are complete with this fence */
+} StreamFence;
+
+/* MeshStreamer: loads mesh files in a background thread.
+ * The loader thread reads and decodes the files directly into a staging
+ * ring buffer and sends messages to the render thread, which copies the
+ * data from the staging buffer into the arena. Ring positions are
+ * monotonically increasing byte counts, the actual offset is the position
+ * modulo the ring size. */
+typedef struct {
+	GLuint buffer;			/* staging buffer object, 0 if not persistently mapped */
+	GLubyte *staging;		/* pointer to the staging memory */
+	GLsizeiptr size;		/* size of the staging ring */
+	unsigned long long head;	/* producer position, loader thread only */
+	unsigned long long tail;	/* consumer position, protected by mutex */
+	bool stop;			/* protected by mutex */
+	std::mutex mutex;
+	std::condition_variable cond;
+	std::deque<StreamMessage> messages;	/* protected by mutex */
+	std::vector<const char*> files;
+	std::vector<Mesh> meshes;	/* arena ranges reserved per file */
+	std::vector<StreamFence> fences;	/* copies in flight, render thread only */
+	std::thread thread;
+	bool running;
+	unsigned int finished;		/* files which are ready or failed, render thread only */
+	unsigned int failed;		/* files which failed, render thread only */
+} MeshStreamer;
+
+/* TextureLevel: a single mip level inside Texture::data */
+typedef struct {
+	GLsizei width, height;
+	size_t offset;		/* byte offset in Texture::data */
+	size_t size;		/* size in bytes */
+} TextureLevel;
+
+/* Texture: a 2D texture whose mip levels are made resident on demand.
+ * All levels are kept in client memory, only the levels from
+ * residentBase to the coarsest one are present in the GL texture. */
+typedef struct {
+	GLuint tex;		/* texture object name */
+	GLenum internalFormat;
+	GLenum format, type;	/* client data format, uncompressed textures only */
+	bool compressed;
+	std::vector<GLubyte> data;
+	std::vector<TextureLevel> levels;
+	int residentBase;	/* finest resident level */
+	int targetBase;		/* finest level we want to be resident */
+	size_t residentBytes;	/* size of all resident levels */
+} Texture;
+
+/* PixelUploadRing: pixel buffer objects used round-robin for texture
+ * uploads. A slot is only reused when the fence of its last upload has
+ * been signaled, so we never wait for the GPU, except in deterministic
+ * runs, where the resident levels must not depend on the GPU's speed. */
+#define PIXEL_RING_SLOTS	3
+typedef struct {
+	GLuint pbo[PIXEL_RING_SLOTS];
+	GLsizeiptr size[PIXEL_RING_SLOTS];
+	GLsync fence[PIXEL_RING_SLOTS];
+	unsigned int next;
+	bool wait;			/* wait for the fences instead of skipping */
+} PixelUploadRing;
+
+/* SimState: the state of the simulation after a fixed time step */
+typedef struct {
+	glm::quat rotation;		/* orientation of the scene's root node */
+	double time;			/* simulation time */
+	unsigned long long step;	/* number of steps simulated */
+} SimState;
+
+/* SimFrame: the last two simulation states. State "cur" is due at wall
+ * clock time "due", state "prev" one time step earlier. The renderer
+ * interpolates between them. */
+typedef struct {
+	SimState prev, cur;
+	double due;
+} SimFrame;
+
+/* SimHandoff: lock-free triple buffer to hand the latest SimFrame from
+ * the simulation to the render thread. Each side owns one slot, the third
+ * one is exchanged atomically. The SIM_HANDOFF_NEW bit marks the
+ * exchanged slot as not yet seen by the consumer. */
+#define SIM_HANDOFF_NEW	0x4
+typedef struct {
+	SimFrame slot[3];
+	std::atomic<unsigned int> middle;	/* slot index | SIM_HANDOFF_NEW */
+	unsigned int back;			/* producer only */
+	unsigned int front;			/* consumer only */
+} SimHandoff;
+
+/* LatencyFrame: a frame on its way to the screen */
+#define LATENCY_QUERIES 8	/* timestamp queries, more than frames in flight */
+typedef struct {
+	double sample;		/* time at which the frame sampled its input */
+	double input;		/* time of the earliest key event it shows, 0 if none */
+	double swap;		/* time the buffer swap returned */
+	GLsync fence;		/* signaled when the GPU finished the frame */
+	GLuint query;		/* GL_TIMESTAMP query at the end of the frame, 0 if none */
+} LatencyFrame;
+
+/* LatencyTracker: input-to-photon latency measurement and just-in-time
+ * frame pacing. A frame counts as presented when both the buffer swap
+ * returned and the GPU finished it. */
+typedef struct {
+	bool enabled;
+	std::atomic<double> pendingInput;	/* earliest unconsumed key event, 0 if none */
+	double frameInput;			/* the key event the current frame sampled, 0 if none */
+	std::deque<LatencyFrame> inFlight;
+	std::vector<GLuint> freeQueries;	/* timestamp queries not in flight */
+	std::vector<double> keyLatency;		/* in ms, since the last report */
+	std::vector<double> sampleLatency;	/* in ms, since the last report */
+	bool timerQuery;			/* GL_TIMESTAMP queries are available */
+	double gpuOffset;			/* CPU time minus GPU time, in seconds */
+	/* just-in-time pacing */
+	bool jit;
+	double margin;				/* in seconds */
+	double refresh;				/* refresh interval in seconds */
+	double frameStart;			/* start of the current frame's work */
+	double frameCost;			/* predicted CPU time until the swap */
+	double lastSwap;			/* time the last swap returned */
+} LatencyTracker;
+
+/* FramePacer: limits the frame rate to a target by sleeping, and spinning
+ * only for the last fraction of a millisecond */
+typedef struct {
+	double interval;		/* target frame interval, 0 if disabled */
+	double nextSwap;		/* when the next swap should happen */
+	double frameStart;		/* start of the current frame's work */
+	double frameCost;		/* predicted time from frame start to swap */
+	double lastSwap;		/* time of the last swap */
+	double spin;			/* busy wait for this long after sleeping */
+	std::vector<double> errors;	/* deviation from the target interval in ms, since the last report */
+} FramePacer;
+
+/* FrameQueue: limits the number of frames the CPU may run ahead of the GPU
+ * with a ring of fences, one per frame in flight */
+#define MAX_FRAMES_IN_FLIGHT 3
+typedef struct {
+	int count;			/* frames in flight, 0 if disabled */
+	int slot;			/* the fence of the current frame */
+	GLsync fence[MAX_FRAMES_IN_FLIGHT];
+	double waitTime;		/* time spent waiting, since the last report */
+} FrameQueue;
+
+/* RenderTarget: an offscreen framebuffer for the main window */
+typedef struct {
+	bool enabled;
+	GLuint fbo;			/* the FBO we render into */
+	GLuint rb[2];			/* color and depth renderbuffers */
+	GLuint resolveFbo;		/* single-sampled copy, with MSAA only */
+	GLuint resolveRb;
+	GLenum colorFormat, depthFormat;
+	int samples;			/* 0 if not multisampled */
+	int scale;			/* rendered size in percent of the window */
+	int maxScale;			/* allocated size in percent of the window */
+	int width, height;		/* allocated size */
+	int renderWidth, renderHeight;	/* size of the part we currently render to */
+} RenderTarget;
+
+/* ResolutionController: adjusts the scale of the render target to keep
+ * the GPU time per frame within a budget */
+#define RESOLUTION_QUERIES 4
+typedef struct {
+	bool enabled;
+	double budget;			/* GPU time per frame to hold, in ms */
+	GLuint query[RESOLUTION_QUERIES];	/* GL_TIME_ELAPSED queries */
+	bool pending[RESOLUTION_QUERIES];
+	unsigned int next;		/* the query for the next frame */
+	bool active;			/* a query was started this frame */
+	double gpuTime;			/* smoothed GPU time per frame, in ms */
+	double scale;			/* unrounded scale, in percent */
+} ResolutionController;
+
+/* PerfCounters: hardware or pipeline statistics counters per render pass */
+#define PERF_FRAMES 4
+#define PERF_MAX_COUNTERS 16
+#define PERF_NAME_LEN 64
+
+typedef enum {
+	PERF_PASS_SCENE=0,
+	PERF_PASS_RESOLVE,
+	PERF_PASS_COUNT
+} PerfPass;
+
+typedef enum {
+	PERF_NONE=0,
+	PERF_AMD,			/* GL_AMD_performance_monitor */
+	PERF_INTEL,			/* GL_INTEL_performance_query */
+	PERF_PIPELINE			/* GL_ARB_pipeline_statistics_query */
+} PerfBackend;
+
+typedef struct {
+	char name[PERF_NAME_LEN];
+	GLuint group;			/* AMD: the counter group */
+	GLuint id;			/* AMD: counter, INTEL: data offset, PIPELINE: query target */
+	GLenum type;			/* data type of the result */
+	double sum[PERF_PASS_COUNT];	/* accumulated over the current interval */
+} PerfCounter;
+
+typedef struct {
+	PerfBackend backend;
+	PerfCounter counter[PERF_MAX_COUNTERS];
+	unsigned int counterCount;
+	GLuint intelQuery;		/* INTEL: the query all counters belong to */
+	/* monitors or queries, AMD and INTEL only use the first one per pass */
+	GLuint object[PERF_FRAMES][PERF_PASS_COUNT][PERF_MAX_COUNTERS];
+	bool pending[PERF_FRAMES];
+	unsigned int next;		/* the slot for the next frame */
+	unsigned int samples;		/* frames read back in the current interval */
+	std::vector<unsigned char> data;	/* buffer for the raw results */
+} PerfCounters;
+
+/* DrawStats: per draw queries of the work done in each pipeline stage */
+#define DRAW_STATS_FRAMES 4
+#define DRAW_STATS_MAX_DRAWS 64		/* the last queries cover all remaining draws */
+#define DRAW_STATS_PRINT 8		/* number of draws to print */
+
+typedef enum {
+	DRAW_STAT_SAMPLES=0,		/* GL_SAMPLES_PASSED */
+	DRAW_STAT_PRIMITIVES,		/* GL_PRIMITIVES_GENERATED */
+	DRAW_STAT_VERTICES,		/* GL_VERTEX_SHADER_INVOCATIONS_ARB */
+	DRAW_STAT_FRAGMENTS,		/* GL_FRAGMENT_SHADER_INVOCATIONS_ARB */
+	DRAW_STAT_COUNT
+} DrawStat;
+
+typedef struct {
+	bool enabled;
+	int statCount;			/* DRAW_STAT_VERTICES without pipeline statistics */
+	GLuint query[DRAW_STATS_FRAMES][DRAW_STATS_MAX_DRAWS][DRAW_STAT_COUNT];
+	unsigned int draws[DRAW_STATS_FRAMES];		/* measured draws per frame */
+	unsigned int drawTotal[DRAW_STATS_FRAMES];	/* all draws per frame */
+	bool pending[DRAW_STATS_FRAMES];
+	unsigned int next;		/* the slot for the next frame */
+	double sum[DRAW_STATS_MAX_DRAWS][DRAW_STAT_COUNT];	/* accumulated over the current interval */
+	unsigned int drawCount;		/* draws in the last frame read back */
+	unsigned int samples;		/* frames read back in the current interval */
+	char summary[128];		/* the totals per frame of the last interval */
+} DrawStats;
+
+/* Hud: on-screen statistics, drawn as textured quads in a single
+ * instanced draw call */
+#define HUD_SCALE 2			/* screen pixels per font pixel */
+#define HUD_MAX_QUADS 1024		/* per frame */
+#define HUD_BUFFERS 3			/* buffer segments in flight */
+#define HUD_GRAPH_FRAMES 120
+
+typedef struct {
+	GLfloat pos[4];			/* rectangle on screen: x, y, width, height in pixels, y down */
+	GLfloat tex[4];			/* rectangle in the atlas, in texels */
+	GLubyte clr[4];
+} HudQuad;
+
+typedef struct {
+	bool enabled;
+	GLuint program;
+	GLint locScale;
+	GLuint atlas;			/* R8 texture of the glyphs */
+	GLuint vao;
+	GLuint vbo;			/* HUD_BUFFERS segments of HUD_MAX_QUADS quads */
+	GLsync fence[HUD_BUFFERS];
+	unsigned int next;		/* the segment for the next frame */
+	std::vector<HudQuad> quads;	/* the quads of the current frame */
+	float frameTime[HUD_GRAPH_FRAMES];	/* ring of frame times in ms */
+	unsigned int graphPos;		/* the oldest entry */
+	double lastTime;		/* start of the previous frame */
+} Hud;
+
+/* GpuMemCategory: the categories of GPU memory we track */
+typedef enum {
+	GPU_MEM_BUFFERS=0,
+	GPU_MEM_TEXTURES,
+	GPU_MEM_PROGRAMS,
+	GPU_MEM_FRAMEBUFFERS,		/* the renderbuffers attached to our FBOs */
+	GPU_MEM_CATEGORIES
+} GpuMemCategory;
+
+/* MetricsServer: serves snapshots of the statistics in the Prometheus text
+ * format from a separate thread */
+#define METRICS_FRAMES 256		/* frame times in a snapshot */
+#define METRICS_QUERIES 4
+
+typedef struct {
+	unsigned int frames;		/* frames rendered */
+	double frameTimeSum;		/* of all frames, in seconds */
+	float frameTime[METRICS_FRAMES];	/* of the last frames, in seconds */
+	unsigned int frameTimeCount;	/* valid entries in frameTime */
+	double fps;
+	double gpuTime;			/* of a recent frame in seconds, negative if unknown */
+	unsigned int shaderCompiles;
+	unsigned int objects;
+	uint64_t gpuMemory[GPU_MEM_CATEGORIES];	/* tracked bytes */
+	double gpuAvailable;		/* reported by the driver in bytes, negative if unknown */
+} MetricsSnapshot;
+
+typedef struct {
+	bool enabled;
+	/* triple buffer, back is owned by the render thread, front by the
+	 * server thread, middle is exchanged atomically */
+	MetricsSnapshot snapshot[3];
+	std::atomic<unsigned int> middle;
+	unsigned int back;
+	unsigned int front;
+	/* render thread */
+	float frameTime[METRICS_FRAMES];	/* ring of frame times */
+	unsigned int framePos;
+	unsigned int frameTimeCount;
+	double frameTimeSum;
+	double lastTime;		/* start of the previous frame */
+	bool gpu;			/* timer queries are supported */
+	GLuint query[METRICS_QUERIES][2];	/* GL_TIMESTAMP queries at begin and end */
+	bool pending[METRICS_QUERIES];
+	unsigned int next;
+	double gpuTime;
+	/* server thread */
+	int socket;
+	std::thread thread;
+	std::atomic<bool> stop;
+	unsigned int scrapes;
+} MetricsServer;
+
+/* Benchmark: the frame times of a benchmark run */
+typedef struct {
+	bool enabled;
+	unsigned int warmup;		/* frames to skip */
+	double lastTime;		/* start of the previous frame */
+	std::vector<float> frameTime;	/* in ms */
+} Benchmark;
+
+/* FrameCapture: reads back the frames asynchronously and writes them to
+ * disk in a separate thread */
+#define CAPTURE_SLOTS 4
+#define CAPTURE_FREE	0	/* the slot can be used for the next frame */
+#define CAPTURE_READING	1	/* the GPU is copying the frame into the PBO */
+#define CAPTURE_WRITING	2	/* the writer thread owns the data */
+typedef struct {
+	GLuint pbo;
+	GLsizeiptr size;		/* size of the PBO */
+	GLubyte *ptr;			/* persistent mapping, NULL if unsupported */
+	std::vector<GLubyte> copy;	/* copy of the pixels without a persistent mapping */
+	GLsync fence;
+	int width, height;
+	unsigned int frame;
+	int state;			/* CAPTURE_*, protected by the mutex */
+} CaptureSlot;
+
+typedef struct {
+	bool enabled;
+	const char *file;
+	FILE *video;			/* the Y4M output, NULL for PNG files */
+	int videoWidth, videoHeight;	/* the size in the Y4M header */
+	int fps;
+	CaptureSlot slot[CAPTURE_SLOTS];
+	unsigned int next;		/* slot for the next frame */
+	unsigned int frame;		/* frames captured so far */
+	unsigned int stalls;		/* times we had to wait for a slot, since the last report */
+	unsigned int written;		/* frames written, since the last report */
+	std::mutex mutex;
+	std::condition_variable cond;
+	std::deque<unsigned int> queue;	/* slots to write */
+	bool stop;
+	std::thread thread;
+} FrameCapture;
+
+/* InputEvent: a keyboard event, at the frame it was handled */
+typedef struct {
+	unsigned int frame;
+	int key;
+	int action;
+} InputEvent;
+
+/* InputLog: records or replays the keyboard input */
+typedef struct {
+	FILE *record;			/* the file we record to, NULL if not recording */
+	std::vector<InputEvent> events;	/* the events to replay, in order */
+	size_t next;			/* the next event to replay */
+	bool replaying;
+} InputLog;
+
+/* ViewWindow: an additional window, showing the scene with its own camera.
+ * Its context shares the objects with the main window's context, and it
+ * is rendered by its own thread. */
+#define MAX_VIEW_WINDOWS 8
+typedef struct {
+	GLFWwindow *win;
+	std::atomic<int> width, height;	/* written by the event thread */
+	GLuint vao;			/* VAOs are not shared between contexts */
+	unsigned int arenaGeneration;	/* of the arena buffers the VAO was set up for */
+	SceneProgram prog;		/* our own copy of the main program */
+	unsigned int shaderGeneration;	/* of the shaders prog was built from */
+	GLsync done;			/* signaled when the GPU finished our last frame */
+	std::thread thread;
+} ViewWindow;
+
+/* SharedFrame: the main render loop publishes every frame to the view
+ * windows */
+typedef struct {
+	std::mutex mutex;		/* held while the shared objects are modified, and to copy the frame */
+	std::condition_variable cond;	/* signaled when a frame is published */
+	unsigned int frame;		/* number of published frames */
+	GLsync fence;			/* the shared objects are up to date when this is signaled */
+	double time;			/* the time of the published frame */
+	std::vector<DrawItem> draws;	/* the objects of the published frame */
+	unsigned int arenaGeneration;
+	unsigned int shaderGeneration;
+	const char *vs, *fs;		/* the current shader files */
+} SharedFrame;
+
 /* CubeApp: We encapsulate all of our application state in this struct.
  * We use a single instance of this object (in main), and set a pointer to
  * this as the user-defined pointer for GLFW windows. That way, we have access
@@ -63,27 +728,86 @@ struct AppConfig {
 typedef struct {
 	/* the window and related state */
 	GLFWwindow *win;
-	int width, height;
+	std::atomic<int> width, height;	/* written by the event thread */
 	unsigned int flags;
 
 	/* timing */
-	double timeCur, timeDelta;
+	double timeCur, timeDelta;	/* virtual with a fixed time step */
+	double timeFrame;	/* real time of the start of the current frame */
 	double avg_frametime;
 	double avg_fps;
 	unsigned int frame;
+	double timeStart;	/* start of the main loop */
+	double timeStats;	/* start of the current statistics interval */
+	unsigned int statFrames;	/* frames in the current statistics interval */
+
+	/* the window title is set by the render thread, but GLFW only
+	 * allows changing it on the main thread */
+	std::mutex titleMutex;
+	char title[256];
+	bool titleChanged;
 
 	/* keyboard handling */
 	bool pressedKeys[GLFW_KEY_LAST+1];
 	bool releasedKeys[GLFW_KEY_LAST+1];
-
-	/* the cube we want to render */
-	Cube cube;
+	std::atomic<bool> animate;		/* rotate the scene, toggled by SPACE */
+	std::atomic<int> requestedShader;	/* shader selected by the number keys, -1 if none */
+	InputLog input;
+
+	/* simulation and threads */
+	double simStep;		/* fixed simulation time step */
+	SimFrame sim;		/* owned by the simulation */
+	SimHandoff handoff;	/* simulation -> renderer, threaded mode only */
+	glm::quat renderedRotation;	/* interpolated rotation of the last frame */
+	std::atomic<bool> quit;	/* tells the threads to terminate */
+	std::thread simThread;
+	std::thread renderThread;
+
+	/* the scene we want to render */
+	Scene scene;
+	MeshStreamer streamer;
+
+	/* the texture and the PBOs used to upload it */
+	Texture texture;
+	PixelUploadRing pixelRing;
+
+	/* latency measurement and frame pacing */
+	LatencyTracker latency;
+	FramePacer pacer;
+	FrameQueue frameQueue;
+
+	/* offscreen rendering */
+	RenderTarget target;
+	ResolutionController resolution;
+
+	/* performance counters */
+	PerfCounters perf;
+	DrawStats drawStats;
+
+	/* heads-up display */
+	Hud hud;
+	std::atomic<bool> showHud;		/* toggled by H */
+
+	/* metrics export */
+	MetricsServer metrics;
+
+	/* benchmark mode */
+	Benchmark bench;
+
+	/* frame capture */
+	FrameCapture capture;
+
+	/* additional windows */
+	ViewWindow views[MAX_VIEW_WINDOWS];
+	int viewCount;
+	SharedFrame shared;
 
 	/* the OpenGL state we need for the shaders */
-	GLuint program;		/* shader program */
-	GLint locProjection;
-	GLint locModelView;
-	GLint locTime;
+	SceneProgram prog;
+	const char *shaderVs, *shaderFs;	/* the files prog was built from */
+	unsigned int shaderGeneration;	/* incremented when prog is rebuilt */
+	std::vector<DrawItem> draws;	/* the objects of the current frame */
+	float drawExtent;		/* see sceneBuildDrawList() */
 
 	/*  the gloabal transformation matrices */
 	glm::mat4 projection;
@@ -98,8 +822,281 @@ typedef struct {
 typedef struct {
 	GLfloat pos[3]; /* 3D cartesian coordinates */
 	GLubyte clr[4]; /* RGBA (8bit per channel is typically enough) */
+	GLfloat tex[2]; /* 2D texture coordinates */
 } Vertex;
 
+/****************************************************************************
+ * LOGGING                                                                  *
+ ****************************************************************************/
+
+/* Messages are formatted by the calling thread into a ring buffer of its
+ * own, so logging does no I/O and takes no lock, except for the first
+ * message of a thread, which registers its ring. A background thread
+ * writes the messages out. The messages of each thread stay in order,
+ * messages of different threads are sorted by their sequence numbers
+ * within each flush, so the order across threads is only approximate.
+ * If a ring is full, or a thread logs more than LOG_RATE info messages
+ * per second, messages are dropped, and the number of dropped messages is
+ * reported instead. Warnings are never rate limited.
+ * Before logInit(), after logShutdown() and with --log-sync, messages are
+ * written directly. Like the profiler, the logger is global. */
+
+#define LOG_RING_SIZE	(64*1024)	/* bytes per thread */
+#define LOG_MAX_MESSAGE	4096		/* longer messages are truncated */
+#define LOG_RATE	200.0		/* messages per second and thread */
+#define LOG_BURST	400.0		/* messages a thread may log at once */
+#define LOG_PAD		0xffff		/* marks the unused end of a ring */
+#define LOG_FLUSH_MS	10		/* interval of the writer thread */
+
+/* the header of a message in a ring, followed by the text, the size of a
+ * record is a multiple of the header size */
+typedef struct {
+	uint32_t seq;			/* order of the messages */
+	uint16_t len;			/* of the text, or LOG_PAD */
+	uint8_t level;
+	uint8_t reserved;
+} LogRecord;
+
+typedef struct {
+	/* single producer, single consumer ring, the positions only grow */
+	char ring[LOG_RING_SIZE];
+	std::atomic<size_t> head;	/* written by the owning thread */
+	std::atomic<size_t> tail;	/* written by the writer thread */
+	std::atomic<unsigned int> dropped;
+	std::atomic<unsigned int> droppedWarnings;	/* included in dropped */
+	double tokens;			/* for the rate limit */
+	std::chrono::steady_clock::time_point refill;
+} LogThread;
+
+typedef struct {
+	uint32_t seq;
+	uint8_t level;
+	size_t offset;			/* of the text in the batch */
+	size_t len;
+} LogEntry;
+
+typedef struct {
+	int level=LOG_INFO;		/* log messages up to this level */
+	std::atomic<bool> async;
+	std::atomic<uint32_t> seq;
+	std::mutex mutex;		/* protects threads and stop */
+	std::condition_variable cond;
+	bool stop;
+	std::vector<LogThread*> threads;
+	std::thread writer;
+} Logger;
+
+static Logger logger;
+
+static thread_local LogThread *logThread;
+
+/* Write a message directly */
+static void logWrite(int level, const char *text, size_t len)
+{
+	FILE *f=(level == LOG_WARN)?stderr:stdout;
+	fwrite(text, 1, len, f);
+	fputc('\n', f);
+}
+
+/* Get the ring of the current thread, registering it if necessary */
+static LogThread *logGetThread(void)
+{
+	if (!logThread) {
+		LogThread *lt=new LogThread;
+		lt->head=0;
+		lt->tail=0;
+		lt->dropped=0;
+		lt->droppedWarnings=0;
+		lt->tokens=LOG_BURST;
+		lt->refill=std::chrono::steady_clock::now();
+		std::lock_guard<std::mutex> lock(logger.mutex);
+		logger.threads.push_back(lt);
+		logThread=lt;
+	}
+	return logThread;
+}
+
+/* Put a message into the ring of the current thread, never blocks */
+static void logPush(int level, const char *text, size_t len)
+{
+	LogThread *lt=logGetThread();
+	const size_t hdr=sizeof(LogRecord);
+
+	/* rate limit, but only for info messages */
+	if (level > LOG_WARN) {
+		std::chrono::steady_clock::time_point now=std::chrono::steady_clock::now();
+		lt->tokens += LOG_RATE * std::chrono::duration<double>(now - lt->refill).count();
+		lt->tokens=std::min(lt->tokens, LOG_BURST);
+		lt->refill=now;
+		if (lt->tokens < 1.0) {
+			lt->dropped++;
+			return;
+		}
+		lt->tokens -= 1.0;
+	}
+
+	size_t need=hdr + (len + hdr - 1) / hdr * hdr;
+	size_t head=lt->head.load(std::memory_order_relaxed);
+	size_t tail=lt->tail.load(std::memory_order_acquire);
+	size_t pos=head % LOG_RING_SIZE;
+	size_t contiguous=LOG_RING_SIZE - pos;
+	size_t total=(contiguous < need)?(contiguous + need):need;
+	if (head + total - tail > LOG_RING_SIZE) {
+		if (level == LOG_WARN) {
+			lt->droppedWarnings++;
+		}
+		lt->dropped++;
+		return;
+	}
+
+	LogRecord r;
+	r.seq=logger.seq++;
+	r.len=LOG_PAD;
+	r.level=(uint8_t)level;
+	r.reserved=0;
+	if (contiguous < need) {
+		/* the message doesn't fit at the end, continue at the start */
+		memcpy(lt->ring + pos, &r, hdr);
+		head += contiguous;
+		pos=0;
+	}
+	r.len=(uint16_t)len;
+	memcpy(lt->ring + pos, &r, hdr);
+	memcpy(lt->ring + pos + hdr, text, len);
+	lt->head.store(head + need, std::memory_order_release);
+}
+
+/* Format and log a message */
+static void logMessage(int level, const char *format, va_list args)
+{
+	char text[LOG_MAX_MESSAGE];
+
+	if (level > logger.level) {
+		return;
+	}
+	int len=vsnprintf(text, sizeof(text), format, args);
+	if (len < 0) {
+		return;
+	}
+	len=std::min(len, (int)sizeof(text) - 1);
+	if (logger.async) {
+		logPush(level, text, (size_t)len);
+	} else {
+		logWrite(level, text, (size_t)len);
+	}
+}
+
+/* Move the messages of a ring into the batch */
+static void logDrain(LogThread *lt, std::vector<LogEntry>& entries, std::vector<char>& batch)
+{
+	const size_t hdr=sizeof(LogRecord);
+	size_t tail=lt->tail.load(std::memory_order_relaxed);
+	size_t head=lt->head.load(std::memory_order_acquire);
+
+	while (tail != head) {
+		size_t pos=tail % LOG_RING_SIZE;
+		LogRecord r;
+		memcpy(&r, lt->ring + pos, hdr);
+		if (r.len == LOG_PAD) {
+			tail += LOG_RING_SIZE - pos;
+			continue;
+		}
+		LogEntry e;
+		e.seq=r.seq;
+		e.level=r.level;
+		e.offset=batch.size();
+		e.len=r.len;
+		batch.insert(batch.end(), lt->ring + pos + hdr, lt->ring + pos + hdr + r.len);
+		entries.push_back(e);
+		tail += hdr + (r.len + hdr - 1) / hdr * hdr;
+	}
+	lt->tail.store(tail, std::memory_order_release);
+}
+
+static bool logCompare(const LogEntry& a, const LogEntry& b)
+{
+	/* the sequence numbers may wrap around */
+	return (int32_t)(a.seq - b.seq) < 0;
+}
+
+/* Write out the messages of all threads */
+static void logFlush(void)
+{
+	std::vector<LogEntry> entries;
+	std::vector<char> batch;
+	std::vector<LogThread*> threads;
+	unsigned int dropped=0, droppedWarnings=0;
+	size_t i;
+
+	{
+		std::lock_guard<std::mutex> lock(logger.mutex);
+		threads=logger.threads;
+	}
+	for (i=0; i<threads.size(); i++) {
+		logDrain(threads[i], entries, batch);
+		droppedWarnings += threads[i]->droppedWarnings.exchange(0);
+		dropped += threads[i]->dropped.exchange(0);
+	}
+	std::sort(entries.begin(), entries.end(), logCompare);
+	for (i=0; i<entries.size(); i++) {
+		logWrite(entries[i].level, &batch[entries[i].offset], entries[i].len);
+	}
+	if (dropped) {
+		fprintf(stderr, "log: %u messages dropped, %u of them warnings\n", dropped, droppedWarnings);
+	}
+	if (!entries.empty() || dropped) {
+		fflush(stdout);
+		fflush(stderr);
+	}
+}
+
+static void logWriterThread(void)
+{
+	std::unique_lock<std::mutex> lock(logger.mutex);
+	while (!logger.stop) {
+		logger.cond.wait_for(lock, std::chrono::milliseconds(LOG_FLUSH_MS));
+		lock.unlock();
+		logFlush();
+		lock.lock();
+	}
+}
+
+/* Start the writer thread, unless the messages should be written directly */
+static void logInit(const AppConfig& cfg)
+{
+	logger.level=cfg.logLevel;
+	if (cfg.logSync) {
+		return;
+	}
+	logger.stop=false;
+	logger.writer=std::thread(logWriterThread);
+	logger.async=true;
+}
+
+/* Write out the remaining messages and stop the writer thread, all other
+ * threads must have finished */
+static void logShutdown(void)
+{
+	size_t i;
+
+	if (!logger.async) {
+		return;
+	}
+	{
+		std::lock_guard<std::mutex> lock(logger.mutex);
+		logger.stop=true;
+	}
+	logger.cond.notify_one();
+	logger.writer.join();
+	logger.async=false;
+	logFlush();
+	for (i=0; i<logger.threads.size(); i++) {
+		delete logger.threads[i];
+	}
+	logger.threads.clear();
+	logThread=NULL;
+}
+
 /****************************************************************************
  * UTILITY FUNCTIONS: warning output, gl error checking                     *
  ****************************************************************************/
@@ -109,9 +1106,8 @@ static void info (const char *format, ...)
 {
 	va_list args;
 	va_start(args, format);
-	vfprintf(stdout,format, args);
+	logMessage(LOG_INFO, format, args);
 	va_end(args);
-	fputc('\n', stdout);
 }
 
 /* Print a warning message to stderr, use printf syntax. */
@@ -119,9 +1115,8 @@ static void warn (const char *format, ...)
 {
 	va_list args;
 	va_start(args, format);
-	vfprintf(stderr,format, args);
+	logMessage(LOG_WARN, format, args);
 	va_end(args);
-	fputc('\n', stderr);
 }
 
 /* Check for GL errors. If ignore is not set, print a warning if an error was
@@ -136,10 +1131,9 @@ static GLenum getGLError(const char *action, bool ignore=false, const char *file
 		if ( (e != GL_NO_ERROR) && (!ignore) ) {
 			err=e;
 			if (file)
-				fprintf(stderr,"%s:",file);
-			if (line)
-				fprintf(stderr,"%d:",line);
-			warn("GL error 0x%x at %s",(unsigned)err,action);
+				warn("%s:%d: GL error 0x%x at %s",file,line,(unsigned)err,action);
+			else
+				warn("GL error 0x%x at %s",(unsigned)err,action);
 		}
 	} while (e != GL_NO_ERROR);
 	return err;
@@ -165,6 +1159,334 @@ static GLenum getGLError(const char *action, bool ignore=false, const char *file
 #define mysnprintf snprintf
 #endif
 
+/****************************************************************************
+ * PROFILING                                                                *
+ ****************************************************************************/
+
+/* Profiling zones measure the CPU time of a scope: put PROFILE_ZONE("name")
+ * at its start. Every thread records into its own buffer, so recording
+ * needs no locks; the mutex only protects the list of buffers, which is
+ * touched once per thread. GPU_ZONE("name") additionally measures the GPU
+ * time of a scope with GL_TIMESTAMP queries, on the thread owning the main
+ * context only. The results are read back when available, and converted
+ * to CPU time. At exit, everything is written as a Chrome trace, which
+ * can be opened in chrome://tracing or https://ui.perfetto.dev.
+ * Unlike everything else, the profiler is global, since the zones are
+ * spread all over the code. The names must be string literals. */
+
+#define PROFILE_MAX_EVENTS	(1024*1024)	/* per thread */
+
+typedef struct {
+	const char *name;
+	double begin, end;		/* in seconds, glfwGetTime() */
+} ProfileEvent;
+
+typedef struct {
+	char name[32];
+	unsigned int tid;
+	std::vector<ProfileEvent> events;	/* only touched by its thread until the export */
+	unsigned int dropped;
+} ProfileThread;
+
+typedef struct {
+	const char *name;
+	GLuint query[2];
+} ProfileGpuZone;
+
+typedef struct {
+	bool enabled;
+	const char *file;
+	std::mutex mutex;		/* protects threads */
+	std::vector<ProfileThread*> threads;
+
+	/* GPU zones, main context only */
+	bool gpu;
+	std::vector<GLuint> freeQueries;
+	std::deque<ProfileGpuZone> pending;
+	ProfileThread gpuThread;
+	double gpuOffset;		/* CPU time - GPU time, in seconds */
+	double calibrated;		/* CPU time of the last calibration */
+} Profiler;
+
+static Profiler profiler;
+static thread_local ProfileThread *profileThread=NULL;
+
+/* Get the buffer of the calling thread */
+static ProfileThread *profilerGetThread()
+{
+	if (!profileThread) {
+		std::lock_guard<std::mutex> lock(profiler.mutex);
+		profileThread=new ProfileThread;
+		profileThread->tid=(unsigned int)profiler.threads.size() + 1;
+		mysnprintf(profileThread->name, sizeof(profileThread->name), "thread %u", profileThread->tid);
+		profileThread->dropped=0;
+		profileThread->events.reserve(4096);
+		profiler.threads.push_back(profileThread);
+	}
+	return profileThread;
+}
+
+/* Name the calling thread in the trace */
+static void profilerThreadName(const char *name)
+{
+	if (profiler.enabled) {
+		ProfileThread *t=profilerGetThread();
+		mysnprintf(t->name, sizeof(t->name), "%s", name);
+	}
+}
+
+/* Record an event into the buffer t */
+static void profilerRecord(ProfileThread *t, const char *name, double begin, double end)
+{
+	if (t->events.size() < PROFILE_MAX_EVENTS) {
+		ProfileEvent e={name, begin, end};
+		t->events.push_back(e);
+	} else {
+		t->dropped++;
+	}
+}
+
+/* RAII zones, use the macros below */
+struct ProfileZone {
+	const char *name;
+	double begin;
+	ProfileZone(const char *n) : name(n), begin(0.0)
+	{
+		if (profiler.enabled) {
+			begin=glfwGetTime();
+		}
+	}
+	~ProfileZone()
+	{
+		if (profiler.enabled) {
+			profilerRecord(profilerGetThread(), name, begin, glfwGetTime());
+		}
+	}
+};
+
+struct GpuZone {
+	ProfileGpuZone zone;
+	GpuZone(const char *n)
+	{
+		zone.name=n;
+		zone.query[0]=0;
+		if (profiler.gpu) {
+			if (profiler.freeQueries.size() < 2) {
+				GLuint q[2];
+				glGenQueries(2, q);
+				profiler.freeQueries.push_back(q[0]);
+				profiler.freeQueries.push_back(q[1]);
+			}
+			zone.query[1]=profiler.freeQueries.back();
+			profiler.freeQueries.pop_back();
+			zone.query[0]=profiler.freeQueries.back();
+			profiler.freeQueries.pop_back();
+			glQueryCounter(zone.query[0], GL_TIMESTAMP);
+		}
+	}
+	~GpuZone()
+	{
+		if (zone.query[0]) {
+			glQueryCounter(zone.query[1], GL_TIMESTAMP);
+			profiler.pending.push_back(zone);
+		}
+	}
+};
+
+#define PROFILE_CONCAT2(a,b) a##b
+#define PROFILE_CONCAT(a,b) PROFILE_CONCAT2(a,b)
+#define PROFILE_ZONE(name) ProfileZone PROFILE_CONCAT(profileZone, __LINE__)(name)
+#define GPU_ZONE(name) GpuZone PROFILE_CONCAT(gpuZone, __LINE__)(name)
+
+/* Enable the profiler if a trace file is requested, call this before any
+ * other thread is started */
+static void profilerInit(const char *file)
+{
+	profiler.enabled=(file != NULL);
+	profiler.file=file;
+	profiler.gpu=false;
+	profilerThreadName("main");
+}
+
+/* Measure the offset between the CPU and GPU clocks */
+static void profilerCalibrate()
+{
+	GLint64 gpu;
+	glGetInteger64v(GL_TIMESTAMP, &gpu);
+	profiler.calibrated=glfwGetTime();
+	profiler.gpuOffset=profiler.calibrated - (double)gpu * 1.0e-9;
+}
+
+/* Enable the GPU zones, needs the main context to be current */
+static void profilerInitGL()
+{
+	if (profiler.enabled) {
+		profiler.gpu=(GLAD_GL_VERSION_3_3 || GLAD_GL_ARB_timer_query);
+		if (profiler.gpu) {
+			mysnprintf(profiler.gpuThread.name, sizeof(profiler.gpuThread.name), "GPU");
+			profiler.gpuThread.tid=0;
+			profiler.gpuThread.dropped=0;
+			profilerCalibrate();
+		} else {
+			warn("profiler: no timer queries, GPU zones are disabled");
+		}
+		info("profiler: writing a trace to '%s' at exit", profiler.file);
+	}
+}
+
+/* Read back the GPU zones which are finished, in order. With wait set,
+ * wait for all of them. */
+static void profilerCollectGpu(bool wait=false)
+{
+	if (!profiler.gpu) {
+		return;
+	}
+	/* the clocks drift apart slowly */
+	if (glfwGetTime() - profiler.calibrated > 1.0) {
+		profilerCalibrate();
+	}
+	while (!profiler.pending.empty()) {
+		ProfileGpuZone& z=profiler.pending.front();
+		GLint available=1;
+		GLuint64 t[2];
+		if (!wait) {
+			glGetQueryObjectiv(z.query[1], GL_QUERY_RESULT_AVAILABLE, &available);
+		}
+		if (!available) {
+			break;
+		}
+		glGetQueryObjectui64v(z.query[0], GL_QUERY_RESULT, &t[0]);
+		glGetQueryObjectui64v(z.query[1], GL_QUERY_RESULT, &t[1]);
+		profilerRecord(&profiler.gpuThread, z.name, (double)t[0] * 1.0e-9 + profiler.gpuOffset,
+			(double)t[1] * 1.0e-9 + profiler.gpuOffset);
+		profiler.freeQueries.push_back(z.query[0]);
+		profiler.freeQueries.push_back(z.query[1]);
+		profiler.pending.pop_front();
+	}
+}
+
+/* Read back the remaining GPU zones and delete the queries, needs the
+ * main context to be current */
+static void profilerDestroyGL()
+{
+	if (profiler.gpu) {
+		profilerCollectGpu(true);
+		if (!profiler.freeQueries.empty()) {
+			glDeleteQueries((GLsizei)profiler.freeQueries.size(), profiler.freeQueries.data());
+			profiler.freeQueries.clear();
+		}
+		profiler.gpu=false;
+	}
+}
+
+/* Write the events of thread t to the trace */
+static void profilerWriteThread(FILE *f, const ProfileThread *t, double start, bool *first)
+{
+	size_t i;
+
+	fprintf(f, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"%s\"}}",
+		(*first)?"":",", t->tid, t->name);
+	*first=false;
+	for (i=0; i<t->events.size(); i++) {
+		const ProfileEvent& e=t->events[i];
+		fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}",
+			e.name, t->tid, (e.begin - start) * 1.0e6, (e.end - e.begin) * 1.0e6);
+	}
+	if (t->dropped) {
+		warn("profiler: %u events of thread '%s' were dropped", t->dropped, t->name);
+	}
+}
+
+/* Write the trace and free the buffers. All threads which recorded
+ * anything must have finished. */
+static void profilerWrite()
+{
+	double start=1.0e30;
+	bool first=true;
+	size_t i;
+
+	if (!profiler.enabled) {
+		return;
+	}
+	profiler.enabled=false;
+
+	FILE *f=fopen(profiler.file, "wt");
+	if (!f) {
+		warn("profiler: failed to create '%s'", profiler.file);
+	} else {
+		/* the trace starts with the first event */
+		for (i=0; i<=profiler.threads.size(); i++) {
+			const ProfileThread *t=(i < profiler.threads.size())?profiler.threads[i]:&profiler.gpuThread;
+			for (size_t j=0; j<t->events.size(); j++) {
+				start=std::min(start, t->events[j].begin);
+			}
+		}
+		fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+		for (i=0; i<profiler.threads.size(); i++) {
+			profilerWriteThread(f, profiler.threads[i], start, &first);
+		}
+		if (!profiler.gpuThread.events.empty()) {
+			profilerWriteThread(f, &profiler.gpuThread, start, &first);
+		}
+		fprintf(f, "\n]}\n");
+		fclose(f);
+		info("profiler: wrote '%s'", profiler.file);
+	}
+
+	for (i=0; i<profiler.threads.size(); i++) {
+		delete profiler.threads[i];
+	}
+	profiler.threads.clear();
+	profiler.gpuThread.events.clear();
+}
+
+/****************************************************************************
+ * GL CALL TRACING                                                          *
+ ****************************************************************************/
+
+/* When built with GLTRACE=1, every GL function pointer is wrapped by the
+ * generated layer in glad/src/gltrace.c, which counts the calls and the
+ * CPU time spent in each function. Once per second, we print the functions
+ * with the most CPU time. Note that the calls of all threads are counted,
+ * but normalized to the frames of the main window. */
+
+#define GLTRACE_TOP 10
+
+#ifdef HELLOCUBE_GLTRACE
+static bool glTraceCompare(const GLTraceStat& a, const GLTraceStat& b)
+{
+	return a.nanoseconds > b.nanoseconds;
+}
+#endif
+
+/* Print the GL calls per frame since the last call */
+static void glTraceReport(unsigned int frames)
+{
+#ifdef HELLOCUBE_GLTRACE
+	std::vector<GLTraceStat> stats(gltraceFunctionCount());
+	unsigned long long calls=0;
+	unsigned long long ns=0;
+	size_t i;
+
+	gltraceSnapshot(stats.data());
+	if (!frames) {
+		return;
+	}
+	for (i=0; i<stats.size(); i++) {
+		calls += stats[i].calls;
+		ns += stats[i].nanoseconds;
+	}
+	std::sort(stats.begin(), stats.end(), glTraceCompare);
+	info("GL calls: %.1f calls/frame, %.3fms/frame CPU", (double)calls/(double)frames, 1.0e-6 * (double)ns / (double)frames);
+	for (i=0; i<GLTRACE_TOP && i<stats.size() && stats[i].calls; i++) {
+		info("  %-32s %8.1f calls/frame %8.4fms/frame", stats[i].name,
+			(double)stats[i].calls/(double)frames, 1.0e-6 * (double)stats[i].nanoseconds / (double)frames);
+	}
+#else
+	(void)frames;
+#endif
+}
+
 /****************************************************************************
  * GL DEBUG MESSAGES                                                        *
  ****************************************************************************/
@@ -263,34 +1585,505 @@ translateDebugSeverityEnum(GLenum severity)
 	return s;
 }
 
-/* debug callback of the GL */
-extern void APIENTRY
+/* Messages are aggregated per frame: identical messages (same source, type,
+ * id and severity) are reported only once together with their count when
+ * debugFlush() is called at the end of every frame. The callback may be
+ * called from any of our contexts (and, for asynchronous debug output, from
+ * driver threads), so the table is protected by a mutex. With
+ * --gl-debug-sync, messages are reported immediately so that a breakpoint
+ * on warn() still shows the offending GL call on the stack. */
+#define DEBUG_MAX_MESSAGES 64		/* distinct messages per frame */
+
+typedef struct {
+	GLenum source;
+	GLenum type;
+	GLenum severity;
+	GLuint id;
+	unsigned int count;
+	char message[256];		/* text of the first occurrence */
+} DebugMessage;
+
+typedef struct {
+	std::mutex mutex;
+	DebugMessage messages[DEBUG_MAX_MESSAGES];
+	unsigned int numMessages;
+	unsigned int overflow;		/* messages not fitting into the table */
+} DebugLog;
+
+static DebugLog debugLog;
+
+/* debug callback of the GL */
+extern void APIENTRY
 debugCallback(GLenum source, GLenum type, GLuint id, GLenum severity,
 			  GLsizei length, const GLchar *message, const GLvoid* userParam)
 {
 	/* we pass a pointer to our application config to the callback as userParam */
 	const AppConfig *cfg=(const AppConfig*)userParam;
+	unsigned int i;
+
+	/* which messages reach us is decided by the GL, see debugApplyFilter() */
+	if (cfg->debugOutputSynchronous) {
+		warn("GLDEBUG: %s %s %s [0x%x]: %s",
+			translateDebugSourceEnum(source),
+			translateDebugTypeEnum(type),
+			translateDebugSeverityEnum(severity),
+			id, message);
+		return;
+	}
 
-	switch(type) {
-		case GL_DEBUG_TYPE_ERROR:
-		case GL_DEBUG_TYPE_UNDEFINED_BEHAVIOR:
-			if (cfg->debugOutputLevel >= DEBUG_OUTPUT_ERRORS_ONLY) {
-				warn("GLDEBUG: %s %s %s [0x%x]: %s",
-					translateDebugSourceEnum(source),
-					translateDebugTypeEnum(type),
-					translateDebugSeverityEnum(severity),
-					id, message);
-			}
+	std::lock_guard<std::mutex> lock(debugLog.mutex);
+	for (i=0; i<debugLog.numMessages; i++) {
+		DebugMessage *m=&debugLog.messages[i];
+		if (m->id == id && m->source == source && m->type == type && m->severity == severity) {
+			m->count++;
+			return;
+		}
+	}
+	if (debugLog.numMessages >= DEBUG_MAX_MESSAGES) {
+		debugLog.overflow++;
+		return;
+	}
+	DebugMessage *m=&debugLog.messages[debugLog.numMessages++];
+	m->source=source;
+	m->type=type;
+	m->severity=severity;
+	m->id=id;
+	m->count=1;
+	if (length < 0) {
+		length=(GLsizei)strlen(message);
+	}
+	if ((size_t)length >= sizeof(m->message)) {
+		length=(GLsizei)sizeof(m->message)-1;
+	}
+	memcpy(m->message, message, length);
+	m->message[length]=0;
+}
+
+/* Report the debug messages aggregated since the last call */
+static void debugFlush(unsigned int frame)
+{
+	DebugMessage messages[DEBUG_MAX_MESSAGES];
+	unsigned int i,num,overflow;
+
+	/* copy the table so that we do not log while holding the lock */
+	{
+		std::lock_guard<std::mutex> lock(debugLog.mutex);
+		num=debugLog.numMessages;
+		overflow=debugLog.overflow;
+		if (!num && !overflow) {
+			return;
+		}
+		memcpy(messages, debugLog.messages, num*sizeof(*messages));
+		debugLog.numMessages=0;
+		debugLog.overflow=0;
+	}
+
+	for (i=0; i<num; i++) {
+		const DebugMessage *m=&messages[i];
+		char times[32]="";
+		if (m->count > 1) {
+			mysnprintf(times, sizeof(times), " (x%u)", m->count);
+		}
+		warn("GLDEBUG: frame %u: %s %s %s [0x%x]: %s%s", frame,
+			translateDebugSourceEnum(m->source),
+			translateDebugTypeEnum(m->type),
+			translateDebugSeverityEnum(m->severity),
+			m->id, m->message, times);
+	}
+	if (overflow) {
+		warn("GLDEBUG: frame %u: %u more messages of other kinds", frame, overflow);
+	}
+}
+
+/* Names of the debug message enums for --gl-debug-filter */
+typedef struct {
+	const char *name;
+	GLenum value;
+} DebugName;
+
+static const DebugName debugSourceNames[]={
+	{"api", GL_DEBUG_SOURCE_API},
+	{"window", GL_DEBUG_SOURCE_WINDOW_SYSTEM},
+	{"compiler", GL_DEBUG_SOURCE_SHADER_COMPILER},
+	{"thirdparty", GL_DEBUG_SOURCE_THIRD_PARTY},
+	{"app", GL_DEBUG_SOURCE_APPLICATION},
+	{"other", GL_DEBUG_SOURCE_OTHER},
+};
+
+static const DebugName debugTypeNames[]={
+	{"error", GL_DEBUG_TYPE_ERROR},
+	{"deprecated", GL_DEBUG_TYPE_DEPRECATED_BEHAVIOR},
+	{"undefined", GL_DEBUG_TYPE_UNDEFINED_BEHAVIOR},
+	{"portability", GL_DEBUG_TYPE_PORTABILITY},
+	{"performance", GL_DEBUG_TYPE_PERFORMANCE},
+	{"marker", GL_DEBUG_TYPE_MARKER},
+	{"push", GL_DEBUG_TYPE_PUSH_GROUP},
+	{"pop", GL_DEBUG_TYPE_POP_GROUP},
+	{"other", GL_DEBUG_TYPE_OTHER},
+};
+
+static const DebugName debugSeverityNames[]={
+	{"high", GL_DEBUG_SEVERITY_HIGH},
+	{"medium", GL_DEBUG_SEVERITY_MEDIUM},
+	{"low", GL_DEBUG_SEVERITY_LOW},
+	{"notification", GL_DEBUG_SEVERITY_NOTIFICATION},
+};
+
+/* Look up the first len characters of name in a table, "*" or an empty
+ * field selects GL_DONT_CARE */
+static bool debugLookup(const DebugName *table, size_t count, const char *name, size_t len, GLenum *value)
+{
+	size_t i;
+
+	if (!len || (len == 1 && name[0] == '*')) {
+		*value=GL_DONT_CARE;
+		return true;
+	}
+	for (i=0; i<count; i++) {
+		if (strlen(table[i].name) == len && !strncmp(table[i].name, name, len)) {
+			*value=table[i].value;
+			return true;
+		}
+	}
+	return false;
+}
+
+/* Parse a single filter rule "(+|-)source:type:severity[:id]" and apply it
+ * via glDebugMessageControl */
+static bool debugApplyRule(const char *rule, bool arb)
+{
+	const char *field[4];
+	size_t len[4];
+	GLenum source,type,severity;
+	GLboolean enable;
+	unsigned int n=0;
+	const char *p;
+
+	if (rule[0] == '+') {
+		enable=GL_TRUE;
+	} else if (rule[0] == '-') {
+		enable=GL_FALSE;
+	} else {
+		return false;
+	}
+	p=rule+1;
+	while (n < 4) {
+		field[n]=p;
+		len[n]=strcspn(p, ":");
+		p += len[n++];
+		if (*p != ':') {
 			break;
-		default:
-			if (cfg->debugOutputLevel >= DEBUG_OUTPUT_ALL) {
-				warn("GLDEBUG: %s %s %s [0x%x]: %s",
-					translateDebugSourceEnum(source),
-					translateDebugTypeEnum(type),
-					translateDebugSeverityEnum(severity),
-					id, message);
-			}
+		}
+		p++;
+	}
+	if (*p || n < 3 ||
+	    !debugLookup(debugSourceNames, sizeof(debugSourceNames)/sizeof(debugSourceNames[0]), field[0], len[0], &source) ||
+	    !debugLookup(debugTypeNames, sizeof(debugTypeNames)/sizeof(debugTypeNames[0]), field[1], len[1], &type) ||
+	    !debugLookup(debugSeverityNames, sizeof(debugSeverityNames)/sizeof(debugSeverityNames[0]), field[2], len[2], &severity)) {
+		return false;
+	}
+
+	if (n == 4) {
+		/* the GL only allows message IDs together with a specific source
+		 * and type, and without a severity */
+		char *end;
+		GLuint id=(GLuint)strtoul(field[3], &end, 0);
+		if (end != field[3]+len[3] || !len[3] || source == GL_DONT_CARE ||
+		    type == GL_DONT_CARE || severity != GL_DONT_CARE) {
+			return false;
+		}
+		if (arb) {
+			glDebugMessageControlARB(source, type, GL_DONT_CARE, 1, &id, enable);
+		} else {
+			glDebugMessageControl(source, type, GL_DONT_CARE, 1, &id, enable);
+		}
+	} else {
+		if (arb) {
+			glDebugMessageControlARB(source, type, severity, 0, NULL, enable);
+		} else {
+			glDebugMessageControl(source, type, severity, 0, NULL, enable);
+		}
+	}
+	return true;
+}
+
+/* Select the debug messages the GL generates for the current context. Doing
+ * this in the driver instead of in debugCallback means that the filtered
+ * messages cost (almost) nothing, so error reporting can stay enabled. */
+static void debugApplyFilter(const AppConfig& cfg, bool arb)
+{
+	if (cfg.debugOutputLevel == DEBUG_OUTPUT_ERRORS_ONLY) {
+		debugApplyRule("-*:*:*", arb);
+		debugApplyRule("+*:error:*", arb);
+		debugApplyRule("+*:undefined:*", arb);
+	}
+
+	/* the user rules are applied in order, later rules win */
+	const char *rules=cfg.debugFilter;
+	while (rules && *rules) {
+		char rule[128];
+		size_t len=strcspn(rules, ",");
+		if (len >= sizeof(rule)) {
+			len=sizeof(rule)-1;
+		}
+		memcpy(rule, rules, len);
+		rule[len]=0;
+		rules += strcspn(rules, ",");
+		if (*rules == ',') {
+			rules++;
+		}
+		if (len && !debugApplyRule(rule, arb)) {
+			warn("GL debug filter: invalid rule '%s'", rule);
+		}
+	}
+}
+
+/****************************************************************************
+ * GPU MEMORY TRACKING                                                      *
+ ****************************************************************************/
+
+/* Every GL object which owns GPU memory is registered with gpuMemTrack()
+ * when its storage is (re-)specified and with gpuMemUntrack() when it is
+ * deleted, so we know how much memory each category uses. The sizes are
+ * what we asked for, the driver may need more for alignment, mip tails,
+ * compression metadata and so on. If the driver tells us about the video
+ * memory (GL_NVX_gpu_memory_info or GL_ATI_meminfo), this is reported, too.
+ * Objects may be created by any of our contexts, so the table is protected
+ * by a mutex. The byte counts are atomic as well, so that they can be read
+ * every frame without taking the lock. */
+
+typedef struct {
+	GpuMemCategory category;
+	GLuint name;
+	size_t bytes;
+} GpuMemObject;
+
+typedef struct {
+	std::mutex mutex;
+	std::vector<GpuMemObject> objects;
+	/* only changed with the mutex held, but may be read without it */
+	std::atomic<uint64_t> bytes[GPU_MEM_CATEGORIES];
+	std::atomic<uint64_t> total;
+	unsigned int count[GPU_MEM_CATEGORIES];
+	uint64_t peak;
+	size_t budget;			/* in bytes, 0 if there is none */
+	bool overBudget;		/* the budget was exceeded at some point */
+	uint64_t reported;	/* total at the last report */
+	/* driver readings in KiB, render thread only, negative if unknown */
+	GLint dedicatedKiB;
+	GLint availableKiB;
+	GLint evictions;
+} GpuMemory;
+
+static GpuMemory gpuMem;
+
+static const char *gpuMemCategoryNames[GPU_MEM_CATEGORIES]={
+	"buffers",
+	"textures",
+	"programs",
+	"framebuffers"
+};
+
+/* Set the budget and look for the driver's memory info */
+static void initGpuMemory(const AppConfig& cfg)
+{
+	gpuMem.budget=(size_t)cfg.gpuBudget * 1024 * 1024;
+	gpuMem.dedicatedKiB=-1;
+	gpuMem.availableKiB=-1;
+	gpuMem.evictions=-1;
+	if (GLAD_GL_NVX_gpu_memory_info) {
+		glGetIntegerv(GL_GPU_MEMORY_INFO_DEDICATED_VIDMEM_NVX, &gpuMem.dedicatedKiB);
+		info("GPU memory: %d MiB dedicated video memory [via GL_NVX_gpu_memory_info]", gpuMem.dedicatedKiB / 1024);
+	} else if (GLAD_GL_ATI_meminfo) {
+		info("GPU memory: reading free memory [via GL_ATI_meminfo]");
+	}
+	if (gpuMem.budget) {
+		info("GPU memory: budget %u MiB", cfg.gpuBudget);
+	}
+}
+
+/* Set the size of a GL object, registering it if it is new */
+static void gpuMemTrack(GpuMemCategory category, GLuint name, size_t bytes)
+{
+	std::lock_guard<std::mutex> lock(gpuMem.mutex);
+	GpuMemObject *obj=NULL;
+	size_t i;
+
+	if (!name) {
+		return;
+	}
+	for (i=0; i<gpuMem.objects.size(); i++) {
+		if (gpuMem.objects[i].name == name && gpuMem.objects[i].category == category) {
+			obj=&gpuMem.objects[i];
+			break;
+		}
+	}
+	if (!obj) {
+		GpuMemObject o={category, name, 0};
+		gpuMem.objects.push_back(o);
+		gpuMem.count[category]++;
+		obj=&gpuMem.objects.back();
+	}
+	/* the difference may be negative, unsigned arithmetic wraps around */
+	gpuMem.bytes[category] += (uint64_t)bytes - (uint64_t)obj->bytes;
+	gpuMem.total += (uint64_t)bytes - (uint64_t)obj->bytes;
+	obj->bytes=bytes;
+	if (gpuMem.total > gpuMem.peak) {
+		gpuMem.peak=gpuMem.total;
+	}
+	if (gpuMem.budget && gpuMem.total > gpuMem.budget && !gpuMem.overBudget) {
+		warn("GPU memory: %s object %u (%.1f MiB) exceeds the budget, %.1f of %.1f MiB in use",
+			gpuMemCategoryNames[category], name, (double)bytes / (1024.0 * 1024.0),
+			(double)gpuMem.total / (1024.0 * 1024.0), (double)gpuMem.budget / (1024.0 * 1024.0));
+		gpuMem.overBudget=true;
+	}
+}
+
+/* Forget about a deleted GL object */
+static void gpuMemUntrack(GpuMemCategory category, GLuint name)
+{
+	std::lock_guard<std::mutex> lock(gpuMem.mutex);
+	size_t i;
+
+	for (i=0; i<gpuMem.objects.size(); i++) {
+		GpuMemObject& o=gpuMem.objects[i];
+		if (o.name == name && o.category == category) {
+			gpuMem.bytes[category] -= o.bytes;
+			gpuMem.total -= o.bytes;
+			gpuMem.count[category]--;
+			o=gpuMem.objects.back();
+			gpuMem.objects.pop_back();
+			return;
+		}
+	}
+}
+
+/* Copy the bytes per category, returns the total. This doesn't take the
+ * lock, so the values may be from different points in time. */
+static uint64_t gpuMemBytes(uint64_t bytes[GPU_MEM_CATEGORIES])
+{
+	int i;
+
+	for (i=0; i<GPU_MEM_CATEGORIES; i++) {
+		bytes[i]=gpuMem.bytes[i].load(std::memory_order_relaxed);
+	}
+	return gpuMem.total.load(std::memory_order_relaxed);
+}
+
+/* Returns false if the budget was exceeded */
+static bool gpuMemWithinBudget()
+{
+	std::lock_guard<std::mutex> lock(gpuMem.mutex);
+	return !gpuMem.overBudget;
+}
+
+/* The storage size of the currently bound renderbuffer */
+static size_t gpuMemRenderbufferBytes(int w, int h, int samples)
+{
+	static const GLenum sizes[]={
+		GL_RENDERBUFFER_RED_SIZE, GL_RENDERBUFFER_GREEN_SIZE,
+		GL_RENDERBUFFER_BLUE_SIZE, GL_RENDERBUFFER_ALPHA_SIZE,
+		GL_RENDERBUFFER_DEPTH_SIZE, GL_RENDERBUFFER_STENCIL_SIZE
+	};
+	GLint bits=0;
+	size_t i;
+
+	for (i=0; i<sizeof(sizes)/sizeof(sizes[0]); i++) {
+		GLint b=0;
+		glGetRenderbufferParameteriv(GL_RENDERBUFFER, sizes[i], &b);
+		bits += b;
+	}
+	return (size_t)w * (size_t)h * (size_t)std::max(samples, 1) * (size_t)((bits + 7) / 8);
+}
+
+/* The size of a linked program, we use the size of its binary as estimate */
+static size_t gpuMemProgramBytes(GLuint program)
+{
+	GLint len=0;
+
+	if (GLAD_GL_VERSION_4_1 || GLAD_GL_ARB_get_program_binary) {
+		glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &len);
+	}
+	return (size_t)len;
+}
+
+/* Read the driver's view of the video memory, render thread only */
+static void gpuMemQueryDriver()
+{
+	if (GLAD_GL_NVX_gpu_memory_info) {
+		glGetIntegerv(GL_GPU_MEMORY_INFO_CURRENT_AVAILABLE_VIDMEM_NVX, &gpuMem.availableKiB);
+		glGetIntegerv(GL_GPU_MEMORY_INFO_EVICTION_COUNT_NVX, &gpuMem.evictions);
+	} else if (GLAD_GL_ATI_meminfo) {
+		/* total free, largest free block, total and largest free
+		 * auxiliary memory; we only use the first one */
+		GLint vbo[4]={-1,-1,-1,-1};
+		GLint tex[4]={-1,-1,-1,-1};
+		glGetIntegerv(GL_VBO_FREE_MEMORY_ATI, vbo);
+		glGetIntegerv(GL_TEXTURE_FREE_MEMORY_ATI, tex);
+		/* both pools are usually the same memory */
+		gpuMem.availableKiB=std::max(vbo[0], tex[0]);
+	}
+}
+
+/* Report the memory per category if it changed since the last report.
+ * Call this from the render thread. */
+static void gpuMemReport(bool force)
+{
+	char line[256];
+	uint64_t bytes[GPU_MEM_CATEGORIES];
+	unsigned int count[GPU_MEM_CATEGORIES];
+	uint64_t total, peak;
+	GLint evictions=gpuMem.evictions;
+	int len=0;
+	int i;
+
+	{
+		std::lock_guard<std::mutex> lock(gpuMem.mutex);
+		if (!force && gpuMem.total == gpuMem.reported) {
+			return;
+		}
+		total=gpuMemBytes(bytes);
+		memcpy(count, gpuMem.count, sizeof(count));
+		peak=gpuMem.peak;
+		gpuMem.reported=total;
+	}
+	gpuMemQueryDriver();
+
+	for (i=0; i<GPU_MEM_CATEGORIES && len < (int)sizeof(line); i++) {
+		len += mysnprintf(line + len, sizeof(line) - len, "%s%s %.2f MiB (%u)", (i)?", ":"",
+			gpuMemCategoryNames[i], (double)bytes[i] / (1024.0 * 1024.0), count[i]);
+	}
+	info("GPU memory: %s", line);
+	len=0;
+	if (gpuMem.budget) {
+		len += mysnprintf(line + len, sizeof(line) - len, ", budget %.2f MiB", (double)gpuMem.budget / (1024.0 * 1024.0));
+	}
+	if (gpuMem.availableKiB >= 0 && len < (int)sizeof(line)) {
+		len += mysnprintf(line + len, sizeof(line) - len, ", driver: %.2f MiB available", (double)gpuMem.availableKiB / 1024.0);
+	}
+	if (gpuMem.evictions > evictions && evictions >= 0 && len < (int)sizeof(line)) {
+		len += mysnprintf(line + len, sizeof(line) - len, ", %d new evictions", gpuMem.evictions - evictions);
+	}
+	info("GPU memory: total %.2f MiB, peak %.2f MiB%s",
+		(double)total / (1024.0 * 1024.0), (double)peak / (1024.0 * 1024.0), (len)?line:"");
+}
+
+/* Warn about objects which were not released, call after all GL objects
+ * are deleted */
+static void destroyGpuMemory()
+{
+	std::lock_guard<std::mutex> lock(gpuMem.mutex);
+	size_t i;
+
+	for (i=0; i<gpuMem.objects.size(); i++) {
+		const GpuMemObject& o=gpuMem.objects[i];
+		warn("GPU memory: %s object %u (%.1f MiB) was not released",
+			gpuMemCategoryNames[o.category], o.name, (double)o.bytes / (1024.0 * 1024.0));
+	}
+	if (gpuMem.peak) {
+		info("GPU memory: peak %.2f MiB", (double)gpuMem.peak / (1024.0 * 1024.0));
 	}
+	gpuMem.objects.clear();
 }
 
 /****************************************************************************
@@ -309,9 +2102,12 @@ static void printGLInfo()
 			glGetString(GL_SHADING_LANGUAGE_VERSION));
 }
 
-/* List all supported GL extensions */
+/* List all supported GL extensions, several per line, so that the
+ * hundreds of extensions of some drivers don't use up the log rate limit */
 static void listGLExtensions()
 {
+	char line[128];
+	size_t len=0;
 	GLint num=0;
 	GLuint i;
 	glGetIntegerv(GL_NUM_EXTENSIONS, &num);
@@ -323,27 +2119,37 @@ static void listGLExtensions()
 	for (i=0; i<(GLuint)num; i++) {
 		const GLubyte *ext=glGetStringi(GL_EXTENSIONS,i);
 		if (ext) {
-			info("  %s",ext);
+			size_t extLen=strlen((const char*)ext);
+			if (len && len + 1 + extLen >= sizeof(line)) {
+				info(" %s", line);
+				len=0;
+			}
+			/* a single overlong name is truncated */
+			extLen=std::min(extLen, sizeof(line) - 2 - len);
+			line[len++]=' ';
+			memcpy(line + len, ext, extLen);
+			len += extLen;
+			line[len]=0;
 		}
 	}
+	if (len) {
+		info(" %s", line);
+	}
 }
 
 /****************************************************************************
  * SETTING UP THE GL STATE                                                  *
  ****************************************************************************/
 
-/* Initialize the global OpenGL state. This is called once after the context
- * is created. */
-static void initGLState(const AppConfig&cfg)
+/* Set up the state of a context, this is needed for every context */
+static void initContextState(const AppConfig&cfg)
 {
-	printGLInfo();
-	listGLExtensions();
-
 	if (cfg.debugOutputLevel > DEBUG_OUTPUT_DISABLED) {
 		if (GLAD_GL_VERSION_4_3) {
 			info("enabling GL debug output [via OpenGL >= 4.3]");
 			glDebugMessageCallback(debugCallback,&cfg);
 			glEnable(GL_DEBUG_OUTPUT);
+			debugApplyFilter(cfg, false);
 			if (cfg.debugOutputSynchronous) {
 				glEnable(GL_DEBUG_OUTPUT_SYNCHRONOUS);
 			} else {
@@ -353,6 +2159,7 @@ static void initGLState(const AppConfig&cfg)
 			info("enabling GL debug output [via GL_KHR_debug]");
 			glDebugMessageCallback(debugCallback,&cfg);
 			glEnable(GL_DEBUG_OUTPUT);
+			debugApplyFilter(cfg, false);
 			if (cfg.debugOutputSynchronous) {
 				glEnable(GL_DEBUG_OUTPUT_SYNCHRONOUS);
 			} else {
@@ -361,6 +2168,7 @@ static void initGLState(const AppConfig&cfg)
 		} else if (GLAD_GL_ARB_debug_output) {
 			info("enabling GL debug output [via GL_ARB_debug_output]");
 			glDebugMessageCallbackARB(debugCallback,&cfg);
+			debugApplyFilter(cfg, true);
 			if (cfg.debugOutputSynchronous) {
 				glEnable(GL_DEBUG_OUTPUT_SYNCHRONOUS_ARB);
 			} else {
@@ -380,6 +2188,15 @@ static void initGLState(const AppConfig&cfg)
 	//glEnable(GL_CULL_FACE);
 }
 
+/* Print information about the GL implementation and set up the state of
+ * the main context */
+static void initGLState(const AppConfig&cfg)
+{
+	printGLInfo();
+	listGLExtensions();
+	initContextState(cfg);
+}
+
 /****************************************************************************
  * SHADER COMPILATION AND LINKING                                           *
  ****************************************************************************/
@@ -401,9 +2218,12 @@ static void printInfoLog(GLuint obj, bool program)
 	 * other code and make sure the string is terminated before running out
 	 * of the buffer. */
 	log[sizeof(log)-1]=0;
-	fprintf(stderr,"%s\n",log);
+	warn("%s",log);
 }
 
+/* the number of shader compilations, for the metrics */
+static std::atomic<unsigned int> shaderCompiles(0);
+
 /* Create a new shader object, attach "source" as source string,
  * and compile it.
  * Returns the name of the newly created shader object, or 0 in case of an
@@ -411,6 +2231,7 @@ static void printInfoLog(GLuint obj, bool program)
  */
 static  GLuint shaderCreateAndCompile(GLenum type, const GLchar *source)
 {
+	PROFILE_ZONE("shader compile");
 	GLuint shader=0;
 	GLint status;
 
@@ -419,6 +2240,7 @@ static  GLuint shaderCreateAndCompile(GLenum type, const GLchar *source)
 	glShaderSource(shader, 1, (const GLchar**)&source, NULL);
 	info("compiling shader object %u",shader);
 	glCompileShader(shader);
+	shaderCompiles++;
 
 	glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
 	if (status != GL_TRUE) {
@@ -468,6 +2290,7 @@ static  GLuint shaderCreateFromFileAndCompile(GLenum type, const char *filename)
  */
 static GLuint programCreate(GLuint vertex_shader, GLuint fragment_shader)
 {
+	PROFILE_ZONE("program link");
 	GLuint program=0;
 	GLint status;
 
@@ -499,6 +2322,7 @@ static GLuint programCreate(GLuint vertex_shader, GLuint fragment_shader)
 		glDeleteProgram(program);
 		return 0;
 	}
+	gpuMemTrack(GPU_MEM_PROGRAMS, program, gpuMemProgramBytes(program));
 	return program;
 }
 
@@ -529,137 +2353,4893 @@ static GLenum programCreateFromFiles(const char *vs, const char *fs)
 /* In this example, we load the shaders from file, and are able to re-load
  * them on keypress. */
 
-/* Destroy all GL objects related to the shaders. */
-static void destroyShaders(CubeApp *app)
+/* The shaders we load on the number keys. We always load a combination of
+ * a vertex and a fragment shader. */
+static const char* shaderFiles[][2]={
+	/* 0 */ {"shaders/minimal.vs.glsl", "shaders/minimal.fs.glsl"},
+	/* 1 */ {"shaders/color.vs.glsl", "shaders/color.fs.glsl"},
+	/* 2 */ {"shaders/cut.vs.glsl", "shaders/cut.fs.glsl"},
+	/* 3 */ {"shaders/wobble.vs.glsl", "shaders/color.fs.glsl"},
+	/* 4 */ {"shaders/experimental.vs.glsl", "shaders/experimental.fs.glsl"},
+	/* 5 */ {"shaders/textured.vs.glsl", "shaders/textured.fs.glsl"},
+	/* placeholders for additional shaders */
+	/* 6 */ {"shaders/yourshader.vs.glsl", "shaders/yourshader.fs.glsl"},
+	/* 7 */ {"shaders/yourshader.vs.glsl", "shaders/yourshader.fs.glsl"},
+	/* 8 */ {"shaders/yourshader.vs.glsl", "shaders/yourshader.fs.glsl"},
+	/* 9 */ {"shaders/yourshader.vs.glsl", "shaders/yourshader.fs.glsl"}
+};
+
+/* Delete the program */
+static void sceneProgramDestroy(SceneProgram *prog)
 {
-	if (app->program) {
-		info("deleting program %u",app->program);
-		glDeleteProgram(app->program);
-		app->program=0;
+	if (prog->program) {
+		info("deleting program %u",prog->program);
+		gpuMemUntrack(GPU_MEM_PROGRAMS, prog->program);
+		glDeleteProgram(prog->program);
+		prog->program=0;
 	}
 }
 
 /* Create and compile the shaders and link them to a program and qeury
  * the locations of the uniforms we use.
  * Returns true if successfull and false in case of an error. */
-static bool initShaders(CubeApp *app, const char *vs, const char *fs)
+static bool sceneProgramCreate(SceneProgram *prog, const char *vs, const char *fs)
 {
-	destroyShaders(app);
-	app->program=programCreateFromFiles(vs, fs);
-	if (app->program == 0)
+	sceneProgramDestroy(prog);
+	prog->program=programCreateFromFiles(vs, fs);
+	if (prog->program == 0)
 		return false;
 
-	app->locProjection=glGetUniformLocation(app->program, "projection");
-	app->locModelView=glGetUniformLocation(app->program, "modelView");
-	app->locTime=glGetUniformLocation(app->program, "time");
-	info("program %u: location for \"projection\" uniform: %d",app->program, app->locProjection);
-	info("program %u: location for \"modelView\" uniform: %d",app->program, app->locModelView);
-	info("program %u: location for \"time\" uniform: %d",app->program, app->locTime);
+	prog->locProjection=glGetUniformLocation(prog->program, "projection");
+	prog->locModelView=glGetUniformLocation(prog->program, "modelView");
+	prog->locTime=glGetUniformLocation(prog->program, "time");
+	/* the sampler always uses texture unit 0 */
+	GLint locDiffuse=glGetUniformLocation(prog->program, "diffuse");
+	if (locDiffuse >= 0) {
+		glUseProgram(prog->program);
+		glUniform1i(locDiffuse, 0);
+	}
+	info("program %u: location for \"projection\" uniform: %d",prog->program, prog->locProjection);
+	info("program %u: location for \"modelView\" uniform: %d",prog->program, prog->locModelView);
+	info("program %u: location for \"time\" uniform: %d",prog->program, prog->locTime);
 
 	return true;
 }
 
+/* Destroy all GL objects related to the shaders. */
+static void destroyShaders(CubeApp *app)
+{
+	sceneProgramDestroy(&app->prog);
+}
+
+/* Build the program of the main context from the given shader files. The
+ * view windows build their own copies when they see the new generation. */
+static bool initShaders(CubeApp *app, const char *vs, const char *fs)
+{
+	app->shaderVs=vs;
+	app->shaderFs=fs;
+	app->shaderGeneration++;
+	return sceneProgramCreate(&app->prog, vs, fs);
+}
+
 /****************************************************************************
- * THE CUBE...                                                              *
+ * BUFFER ARENA                                                             *
  ****************************************************************************/
 
-/* Initialize the OpenGL state for the cube. This will create OpenGL buffer
- * objects for storing the vertex and index arrays and the OpenGL Vertex
- * Array. The buffers will be filled with the data, and the VAO will be
- * initialized so that the vertex array layout and offsets in the buffer
- * will be set.
- *
- * This function is only called once. After it returned, all the data needed
- * for drawing the cube is stored in GL objects, so we do not have to
- * re-specify the vertex data every time the object is drawn. */
-static void initCube(Cube *cube)
+/* upper limit for the size of each arena buffer object, this also keeps
+ * all element offsets well inside the GLuint range */
+#define ARENA_MAX_BYTES		((GLsizeiptr)1024*1024*1024)
+
+/* Initialize a free list managing "capacity" free elements. */
+static void freeListInit(FreeList *fl, GLuint capacity)
 {
-	static const Vertex cubeGeometry[]={
-		/*   X     Y     Z       R    G    B    A */
-		/* front face */
-		{{-1.0, -1.0,  1.0},  {255,   0,   0, 255}},
-		{{ 1.0, -1.0,  1.0},  {192,   0,   0, 255}},
-		{{-1.0,  1.0,  1.0},  {192,   0,   0, 255}},
-		{{ 1.0,  1.0,  1.0},  {128,   0,   0, 255}},
-		/* back face */
-		{{ 1.0, -1.0, -1.0},  {  0, 255, 255, 255}},
-		{{-1.0, -1.0, -1.0},  {  0, 192, 192, 255}},
-		{{ 1.0,  1.0, -1.0},  {  0, 192, 192, 255}},
-		{{-1.0,  1.0, -1.0},  {  0, 128, 128, 255}},
-		/* left  face */
-		{{-1.0, -1.0, -1.0},  {  0, 255,   0, 255}},
-		{{-1.0, -1.0,  1.0},  {  0, 192,   0, 255}},
-		{{-1.0,  1.0, -1.0},  {  0, 192,   0, 255}},
-		{{-1.0,  1.0,  1.0},  {  0, 128,   0, 255}},
-		/* right face */
-		{{ 1.0, -1.0,  1.0},  {255,   0, 255, 255}},
-		{{ 1.0, -1.0, -1.0},  {192,   0, 192, 255}},
-		{{ 1.0,  1.0,  1.0},  {192,   0, 192, 255}},
-		{{ 1.0,  1.0, -1.0},  {128,   0, 128, 255}},
-		/* top face */
-		{{-1.0,  1.0,  1.0},  {  0,   0, 255, 255}},
-		{{ 1.0,  1.0,  1.0},  {  0,   0, 192, 255}},
-		{{-1.0,  1.0, -1.0},  {  0,   0, 192, 255}},
-		{{ 1.0,  1.0, -1.0},  {  0,   0, 128, 255}},
-		/* bottom face */
-		{{ 1.0, -1.0,  1.0},  {255, 255,   0, 255}},
-		{{-1.0, -1.0,  1.0},  {192, 192,   0, 255}},
-		{{ 1.0, -1.0, -1.0},  {192, 192,   0, 255}},
-		{{-1.0, -1.0, -1.0},  {128, 128,   0, 255}},
-	};
+	FreeRange r;
+
+	fl->capacity=capacity;
+	fl->ranges.clear();
+	if (capacity) {
+		r.offset=0;
+		r.size=capacity;
+		fl->ranges.push_back(r);
+	}
+}
 
-	/* use two triangles sharing an edge for each face */
-	static const GLushort cubeConnectivity[]={
-		 0, 1, 2,  2, 1, 3,	/* front */
-		 4, 5, 6,  6, 5, 7,	/* back */
-		 8, 9,10, 10, 9,11,	/* left */
-		12,13,14, 14,13,15,	/* right */
-		16,17,18, 18,17,19,	/* top */
-		20,21,22, 22,21,23	/* bottom */
-	};
+/* Allocate "size" consecutive elements, using the first free range which is
+ * big enough.
+ * Returns true and sets offset if successfull, false if there is no
+ * sufficiently large free range. */
+static bool freeListAlloc(FreeList *fl, GLuint size, GLuint *offset)
+{
+	size_t i;
+
+	for (i=0; i<fl->ranges.size(); i++) {
+		FreeRange& r=fl->ranges[i];
+		if (r.size >= size) {
+			*offset=r.offset;
+			r.offset += size;
+			r.size -= size;
+			if (!r.size) {
+				fl->ranges.erase(fl->ranges.begin() + i);
+			}
+			return true;
+		}
+	}
+	return false;
+}
+
+/* Release a range previously allocated by freeListAlloc, and merge it with
+ * the adjacent free ranges. */
+static void freeListRelease(FreeList *fl, GLuint offset, GLuint size)
+{
+	size_t i=0;
+	FreeRange r;
+
+	if (!size) {
+		return;
+	}
+	while (i < fl->ranges.size() && fl->ranges[i].offset < offset) {
+		i++;
+	}
+	r.offset=offset;
+	r.size=size;
+	fl->ranges.insert(fl->ranges.begin() + i, r);
+
+	/* merge with the successor */
+	if (i+1 < fl->ranges.size() && offset + size == fl->ranges[i+1].offset) {
+		fl->ranges[i].size += fl->ranges[i+1].size;
+		fl->ranges.erase(fl->ranges.begin() + i + 1);
+	}
+	/* merge with the predecessor */
+	if (i > 0 && fl->ranges[i-1].offset + fl->ranges[i-1].size == offset) {
+		fl->ranges[i-1].size += fl->ranges[i].size;
+		fl->ranges.erase(fl->ranges.begin() + i);
+	}
+}
+
+/* Enlarge the managed space to newCapacity elements. The new elements are
+ * appended at the end and are free. */
+static void freeListGrow(FreeList *fl, GLuint newCapacity)
+{
+	if (newCapacity > fl->capacity) {
+		GLuint oldCapacity=fl->capacity;
+		fl->capacity=newCapacity;
+		freeListRelease(fl, oldCapacity, newCapacity - oldCapacity);
+	}
+}
+
+/* Set up the vertex array state of a VAO for the arena. This must be
+ * re-done whenever one of the buffers was replaced. Usually, vao is the
+ * arena's own VAO, but other contexts need VAOs of their own. */
+static void arenaSetupVAO(const BufferArena *arena, GLuint vao)
+{
+	glBindVertexArray(vao);
+	glBindBuffer(GL_ARRAY_BUFFER, arena->vbo[0]);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, arena->vbo[1]);
+
+	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), BUFFER_OFFSET(offsetof(Vertex,pos)));
+	glVertexAttribPointer(2, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(Vertex), BUFFER_OFFSET(offsetof(Vertex,clr)));
+	glVertexAttribPointer(3, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), BUFFER_OFFSET(offsetof(Vertex,tex)));
+
+	glEnableVertexAttribArray(0);
+	glEnableVertexAttribArray(2);
+	glEnableVertexAttribArray(3);
+
+	glBindVertexArray(0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+}
+
+/* Replace the buffer object *buffer of size oldSize by a new one of size
+ * newSize, preserving the old contents. */
+static void arenaResizeBuffer(GLuint *buffer, GLsizeiptr oldSize, GLsizeiptr newSize)
+{
+	GLuint newBuffer;
+
+	glGenBuffers(1, &newBuffer);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, newBuffer);
+	glBufferData(GL_COPY_WRITE_BUFFER, newSize, NULL, GL_STATIC_DRAW);
+	gpuMemTrack(GPU_MEM_BUFFERS, newBuffer, (size_t)newSize);
+	if (*buffer && oldSize) {
+		glBindBuffer(GL_COPY_READ_BUFFER, *buffer);
+		glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, oldSize);
+		glBindBuffer(GL_COPY_READ_BUFFER, 0);
+	}
+	glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+	info("Arena: replaced buffer %u (%u bytes) by buffer %u (%u bytes)",
+		*buffer, (unsigned)oldSize, newBuffer, (unsigned)newSize);
+	if (*buffer) {
+		gpuMemUntrack(GPU_MEM_BUFFERS, *buffer);
+		glDeleteBuffers(1, buffer);
+	}
+	*buffer=newBuffer;
+}
+
+/* Initialize the arena with space for the given number of vertices and
+ * indices. The arena grows automatically if required. */
+static void arenaInit(BufferArena *arena, GLuint vertexCapacity, GLuint indexCapacity)
+{
+	arena->vbo[0]=arena->vbo[1]=0;
+	arena->generation=1;
+	freeListInit(&arena->vertices, 0);
+	freeListInit(&arena->indices, 0);
+
+	glGenVertexArrays(1, &arena->vao);
+	info("Arena: created VAO %u", arena->vao);
+	arenaResizeBuffer(&arena->vbo[0], 0, vertexCapacity * sizeof(Vertex));
+	arenaResizeBuffer(&arena->vbo[1], 0, indexCapacity * sizeof(GLuint));
+	freeListGrow(&arena->vertices, vertexCapacity);
+	freeListGrow(&arena->indices, indexCapacity);
+	arenaSetupVAO(arena, arena->vao);
+}
+
+/* Allocate "size" elements from fl, growing the underlying buffer object
+ * (with "elemSize" bytes per element) if necessary. *replaced is set to
+ * true if the buffer object was replaced.
+ * Returns false if the buffer can't grow big enough. */
+static bool arenaAllocRange(FreeList *fl, GLuint *buffer, GLsizeiptr elemSize, GLuint size, GLuint *offset, bool *replaced)
+{
+	const unsigned long long maxCapacity=(unsigned long long)(ARENA_MAX_BYTES / elemSize);
+	const unsigned long long needed=(unsigned long long)fl->capacity + size;
+	unsigned long long newCapacity;
+
+	if (freeListAlloc(fl, size, offset)) {
+		return true;
+	}
+	/* double the capacity until the request fits at the end, in 64 bit
+	 * so that this can't wrap around */
+	newCapacity=(fl->capacity)?fl->capacity:1024;
+	while (newCapacity < needed) {
+		newCapacity *= 2;
+	}
+	if (newCapacity > maxCapacity) {
+		newCapacity=maxCapacity;
+	}
+	if (newCapacity < needed) {
+		warn("Arena: failed to allocate %u elements, the buffer would exceed %u bytes",
+			size, (unsigned)ARENA_MAX_BYTES);
+		return false;
+	}
+	arenaResizeBuffer(buffer, (GLsizeiptr)fl->capacity * elemSize, (GLsizeiptr)newCapacity * elemSize);
+	freeListGrow(fl, (GLuint)newCapacity);
+	*replaced=true;
+	if (!freeListAlloc(fl, size, offset)) {
+		/* can't happen, the grown free list has a big enough range */
+		warn("Arena: failed to allocate %u elements", size);
+		return false;
+	}
+	return true;
+}
+
+/* Reserve space for a mesh in the arena, without specifying the data.
+ * Returns false if the arena is full, the mesh is empty in that case. */
+static bool arenaReserveMesh(BufferArena *arena, Mesh *mesh, GLuint vertexCount, GLuint indexCount)
+{
+	GLuint vertexOffset, indexOffset;
+	bool changed=false;
+	bool ok;
+
+	ok=arenaAllocRange(&arena->vertices, &arena->vbo[0], sizeof(Vertex), vertexCount, &vertexOffset, &changed);
+	if (ok && !arenaAllocRange(&arena->indices, &arena->vbo[1], sizeof(GLuint), indexCount, &indexOffset, &changed)) {
+		freeListRelease(&arena->vertices, vertexOffset, vertexCount);
+		ok=false;
+	}
+	if (changed) {
+		/* GL may hand out the deleted names again, so the other
+		 * contexts compare the generation, not the names */
+		arena->generation++;
+		arenaSetupVAO(arena, arena->vao);
+	}
+	if (!ok) {
+		memset(mesh, 0, sizeof(*mesh));
+		return false;
+	}
+
+	mesh->baseVertex=(GLint)vertexOffset;
+	mesh->vertexCount=vertexCount;
+	mesh->firstIndex=indexOffset;
+	mesh->indexCount=(GLsizei)indexCount;
+	info("Arena: mesh with %u vertices at %u, %u indices at %u",
+		vertexCount, vertexOffset, indexCount, indexOffset);
+	return true;
+}
+
+/* Allocate space for a mesh in the arena and upload the data.
+ * The indices are relative to the first vertex of the mesh.
+ * Returns false if the arena is full. */
+static bool arenaAllocMesh(BufferArena *arena, Mesh *mesh, const Vertex *vertices, GLuint vertexCount, const GLuint *indices, GLuint indexCount)
+{
+	PROFILE_ZONE("buffer upload");
+	if (!arenaReserveMesh(arena, mesh, vertexCount, indexCount)) {
+		return false;
+	}
+
+	glBindBuffer(GL_ARRAY_BUFFER, arena->vbo[0]);
+	glBufferSubData(GL_ARRAY_BUFFER, mesh->baseVertex * sizeof(Vertex), vertexCount * sizeof(Vertex), vertices);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	/* the element array binding is VAO state, so use the copy write
+	 * binding point to not disturb any VAO */
+	glBindBuffer(GL_COPY_WRITE_BUFFER, arena->vbo[1]);
+	glBufferSubData(GL_COPY_WRITE_BUFFER, mesh->firstIndex * sizeof(GLuint), indexCount * sizeof(GLuint), indices);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+	return true;
+}
+
+/* Return the space of a mesh to the arena. */
+static void arenaFreeMesh(BufferArena *arena, const Mesh *mesh)
+{
+	freeListRelease(&arena->vertices, (GLuint)mesh->baseVertex, mesh->vertexCount);
+	freeListRelease(&arena->indices, mesh->firstIndex, (GLuint)mesh->indexCount);
+}
+
+/* Destroy all GL objects of the arena. */
+static void arenaDestroy(BufferArena *arena)
+{
+	glBindVertexArray(0);
+	if (arena->vao) {
+		info("Arena: deleting VAO %u", arena->vao);
+		glDeleteVertexArrays(1,&arena->vao);
+		arena->vao=0;
+	}
+	if (arena->vbo[0] || arena->vbo[1]) {
+		info("Arena: deleting VBOs %u %u", arena->vbo[0], arena->vbo[1]);
+		gpuMemUntrack(GPU_MEM_BUFFERS, arena->vbo[0]);
+		gpuMemUntrack(GPU_MEM_BUFFERS, arena->vbo[1]);
+		glDeleteBuffers(2,arena->vbo);
+		arena->vbo[0]=0;
+		arena->vbo[1]=0;
+	}
+	freeListInit(&arena->vertices, 0);
+	freeListInit(&arena->indices, 0);
+}
+
+/****************************************************************************
+ * SCENE GRAPH                                                              *
+ ****************************************************************************/
+
+/* Remove all nodes */
+static void sceneGraphClear(SceneGraph *g)
+{
+	g->parent.clear();
+	g->local.clear();
+	g->world.clear();
+	g->dirty.clear();
+	g->firstDirty=0;
+}
+
+/* Add a node below parent (-1 for a new root). Since the parent must
+ * already exist, the nodes are always in topological order.
+ * Returns the index of the new node. */
+static unsigned int sceneGraphAddNode(SceneGraph *g, int parent, const glm::mat4& local)
+{
+	size_t idx=g->parent.size();
+
+	if (parent >= (int)idx) {
+		warn("SceneGraph: invalid parent %d for node %u", parent, (unsigned)idx);
+		parent=-1;
+	}
+	if (g->firstDirty >= idx) {
+		g->firstDirty=idx;
+	}
+	g->parent.push_back(parent);
+	g->local.push_back(local);
+	g->world.push_back(local);
+	g->dirty.push_back(1);
+	return (unsigned int)idx;
+}
+
+/* Change the local transformation of a node, this marks the node and
+ * implicitly its whole subtree for the next update */
+static void sceneGraphSetLocal(SceneGraph *g, unsigned int node, const glm::mat4& local)
+{
+	g->local[node]=local;
+	g->dirty[node]=1;
+	if (node < g->firstDirty) {
+		g->firstDirty=node;
+	}
+}
+
+/* Recompute the world matrices of all dirty subtrees. Nodes before the
+ * first dirty one can't be affected, so we start there; if nothing
+ * changed, this costs nothing.
+ * Returns the number of world matrices recomputed. */
+static size_t sceneGraphUpdate(SceneGraph *g)
+{
+	size_t i, n=g->parent.size();
+	size_t count=0;
+
+	for (i=g->firstDirty; i<n; i++) {
+		int p=g->parent[i];
+		/* the parent was already handled in this pass, so its dirty
+		 * flag tells if its world matrix changed */
+		if (p >= 0 && g->dirty[p]) {
+			g->dirty[i]=1;
+		}
+		if (g->dirty[i]) {
+			g->world[i]=(p >= 0)?(g->world[p] * g->local[i]):g->local[i];
+			count++;
+		}
+	}
+	/* clear the flags only now, children need their parent's flag */
+	for (i=g->firstDirty; i<n; i++) {
+		g->dirty[i]=0;
+	}
+	g->firstDirty=n;
+	return count;
+}
+
+/****************************************************************************
+ * PROCEDURAL GEOMETRY                                                      *
+ ****************************************************************************/
+
+/* MeshData: CPU-side vertex and index arrays of a mesh, before it is
+ * uploaded into the arena */
+typedef struct {
+	std::vector<Vertex> vertices;
+	std::vector<GLuint> indices;
+} MeshData;
+
+/* Generate the cube geometry into data. */
+static void generateCube(MeshData& data)
+{
+	static const Vertex cubeGeometry[]={
+		/*   X     Y     Z       R    G    B    A      S    T */
+		/* front face */
+		{{-1.0, -1.0,  1.0},  {255,   0,   0, 255}, {0.0, 0.0}},
+		{{ 1.0, -1.0,  1.0},  {192,   0,   0, 255}, {1.0, 0.0}},
+		{{-1.0,  1.0,  1.0},  {192,   0,   0, 255}, {0.0, 1.0}},
+		{{ 1.0,  1.0,  1.0},  {128,   0,   0, 255}, {1.0, 1.0}},
+		/* back face */
+		{{ 1.0, -1.0, -1.0},  {  0, 255, 255, 255}, {0.0, 0.0}},
+		{{-1.0, -1.0, -1.0},  {  0, 192, 192, 255}, {1.0, 0.0}},
+		{{ 1.0,  1.0, -1.0},  {  0, 192, 192, 255}, {0.0, 1.0}},
+		{{-1.0,  1.0, -1.0},  {  0, 128, 128, 255}, {1.0, 1.0}},
+		/* left  face */
+		{{-1.0, -1.0, -1.0},  {  0, 255,   0, 255}, {0.0, 0.0}},
+		{{-1.0, -1.0,  1.0},  {  0, 192,   0, 255}, {1.0, 0.0}},
+		{{-1.0,  1.0, -1.0},  {  0, 192,   0, 255}, {0.0, 1.0}},
+		{{-1.0,  1.0,  1.0},  {  0, 128,   0, 255}, {1.0, 1.0}},
+		/* right face */
+		{{ 1.0, -1.0,  1.0},  {255,   0, 255, 255}, {0.0, 0.0}},
+		{{ 1.0, -1.0, -1.0},  {192,   0, 192, 255}, {1.0, 0.0}},
+		{{ 1.0,  1.0,  1.0},  {192,   0, 192, 255}, {0.0, 1.0}},
+		{{ 1.0,  1.0, -1.0},  {128,   0, 128, 255}, {1.0, 1.0}},
+		/* top face */
+		{{-1.0,  1.0,  1.0},  {  0,   0, 255, 255}, {0.0, 0.0}},
+		{{ 1.0,  1.0,  1.0},  {  0,   0, 192, 255}, {1.0, 0.0}},
+		{{-1.0,  1.0, -1.0},  {  0,   0, 192, 255}, {0.0, 1.0}},
+		{{ 1.0,  1.0, -1.0},  {  0,   0, 128, 255}, {1.0, 1.0}},
+		/* bottom face */
+		{{ 1.0, -1.0,  1.0},  {255, 255,   0, 255}, {0.0, 0.0}},
+		{{-1.0, -1.0,  1.0},  {192, 192,   0, 255}, {1.0, 0.0}},
+		{{ 1.0, -1.0, -1.0},  {192, 192,   0, 255}, {0.0, 1.0}},
+		{{-1.0, -1.0, -1.0},  {128, 128,   0, 255}, {1.0, 1.0}},
+	};
+
+	/* use two triangles sharing an edge for each face */
+	static const GLuint cubeConnectivity[]={
+		 0, 1, 2,  2, 1, 3,	/* front */
+		 4, 5, 6,  6, 5, 7,	/* back */
+		 8, 9,10, 10, 9,11,	/* left */
+		12,13,14, 14,13,15,	/* right */
+		16,17,18, 18,17,19,	/* top */
+		20,21,22, 22,21,23	/* bottom */
+	};
+
+	data.vertices.assign(cubeGeometry, cubeGeometry + sizeof(cubeGeometry)/sizeof(cubeGeometry[0]));
+	data.indices.assign(cubeConnectivity, cubeConnectivity + sizeof(cubeConnectivity)/sizeof(cubeConnectivity[0]));
+}
+
+/* Generate a unit sphere with approximately "triangles" triangles into data.
+ * We use a simple latitude/longitude tesselation with "rings" rings
+ * and 2*rings segments, which results in 4*rings*(rings-1) triangles. */
+static void generateSphere(MeshData& data, unsigned int triangles)
+{
+	unsigned int rings=(unsigned int)((1.0 + sqrt(1.0 + (double)triangles)) * 0.5 + 0.5);
+	if (rings < 2) {
+		rings=2;
+	}
+	unsigned int segments=2*rings;
+	unsigned int i,j;
+
+	data.vertices.clear();
+	data.indices.clear();
+
+	/* (rings+1) x (segments+1) vertices, the seam and the poles are
+	 * duplicated so that every quad has its own four vertices */
+	for (i=0; i<=rings; i++) {
+		float theta=glm::pi<float>() * (float)i / (float)rings;
+		for (j=0; j<=segments; j++) {
+			float phi=glm::two_pi<float>() * (float)j / (float)segments;
+			glm::vec3 p(sinf(theta)*cosf(phi), cosf(theta), sinf(theta)*sinf(phi));
+			glm::vec3 c=p * 0.5f + 0.5f;
+			Vertex v;
+			v.pos[0]=p.x;
+			v.pos[1]=p.y;
+			v.pos[2]=p.z;
+			v.clr[0]=(GLubyte)(c.r * 255.0f);
+			v.clr[1]=(GLubyte)(c.g * 255.0f);
+			v.clr[2]=(GLubyte)(c.b * 255.0f);
+			v.clr[3]=255;
+			v.tex[0]=(float)j / (float)segments;
+			v.tex[1]=1.0f - (float)i / (float)rings;
+			data.vertices.push_back(v);
+		}
+	}
+
+	/* the first and last ring only need one triangle per segment */
+	for (i=0; i<rings; i++) {
+		GLuint row0=i*(segments+1);
+		GLuint row1=row0+segments+1;
+		for (j=0; j<segments; j++) {
+			if (i > 0) {
+				data.indices.push_back(row0+j);
+				data.indices.push_back(row0+j+1);
+				data.indices.push_back(row1+j);
+			}
+			if (i+1 < rings) {
+				data.indices.push_back(row1+j);
+				data.indices.push_back(row0+j+1);
+				data.indices.push_back(row1+j+1);
+			}
+		}
+	}
+
+	info("Sphere: %u rings, %u segments, %u triangles", rings, segments, (unsigned)data.indices.size()/3);
+}
+
+/* Fill the scene with objects according to the configuration:
+ * - a regular grid of gridSize^3 objects filling the [-1,1]^3 volume
+ *   (a grid size of 1 results in the classic single cube),
+ * - randomObjects objects with random position, orientation and size.
+ * The random numbers come from glm's gtc/random which uses std::rand(),
+ * so seeding with a fixed randomSeed gives reproducible scenes.
+ * All objects are attached to the scene's root node. */
+static void generateObjects(Scene *scene, const AppConfig& cfg, unsigned int mesh)
+{
+	unsigned int x,y,z,i;
+	SceneObject obj;
+
+	obj.mesh=mesh;
+	if (cfg.gridSize > 0) {
+		float cell=2.0f / (float)cfg.gridSize;
+		/* leave some space between the objects, unless there is only one */
+		float scale=(cfg.gridSize > 1)?(0.4f * cell):1.0f;
+		for (z=0; z<cfg.gridSize; z++) {
+			for (y=0; y<cfg.gridSize; y++) {
+				for (x=0; x<cfg.gridSize; x++) {
+					glm::vec3 center=glm::vec3(-1.0f) + cell * (glm::vec3((float)x, (float)y, (float)z) + 0.5f);
+					obj.node=sceneGraphAddNode(&scene->graph, (int)scene->root, glm::translate(center) * glm::scale(glm::vec3(scale)));
+					scene->objects.push_back(obj);
+				}
+			}
+		}
+	}
+
+	srand(cfg.randomSeed);
+	for (i=0; i<cfg.randomObjects; i++) {
+		glm::vec3 pos=glm::linearRand(glm::vec3(-1.0f), glm::vec3(1.0f));
+		glm::vec3 axis=glm::sphericalRand(1.0f);
+		float angle=glm::linearRand(0.0f, glm::two_pi<float>());
+		float scale=glm::linearRand(0.05f, 0.25f);
+		obj.node=sceneGraphAddNode(&scene->graph, (int)scene->root, glm::translate(pos) * glm::rotate(angle, axis) * glm::scale(glm::vec3(scale)));
+		scene->objects.push_back(obj);
+	}
+}
+
+/****************************************************************************
+ * MESH FILES                                                               *
+ ****************************************************************************/
+
+/* Mesh files consist of a MeshFileHeader, followed by vertexCount Vertex
+ * structs and indexBytes bytes of index data, all in native byte order.
+ * With MESHFILE_INDEX_DELTA, each index is stored as the zig-zag encoded
+ * difference to the previous index in LEB128 variable length encoding,
+ * which shrinks the index data of typical meshes to about a quarter. */
+#define MESHFILE_MAGIC		"HCM2"
+#define MESHFILE_INDEX_DELTA	0x1
+
+typedef struct {
+	char magic[4];
+	GLuint vertexCount;
+	GLuint indexCount;
+	GLuint flags;
+	GLuint indexBytes;
+} MeshFileHeader;
+
+/* Write a mesh to a file, using the delta encoding for the indices.
+ * Returns true if successfull and false in case of an error. */
+static bool meshFileWrite(const char *filename, const MeshData& data)
+{
+	MeshFileHeader hdr;
+	std::vector<GLubyte> encoded;
+	GLuint prev=0;
+	size_t i;
+	bool ok;
+
+	for (i=0; i<data.indices.size(); i++) {
+		GLint delta=(GLint)(data.indices[i] - prev);
+		GLuint zigzag=((GLuint)delta << 1) ^ (GLuint)(delta >> 31);
+		prev=data.indices[i];
+		while (zigzag >= 0x80) {
+			encoded.push_back((GLubyte)(zigzag | 0x80));
+			zigzag >>= 7;
+		}
+		encoded.push_back((GLubyte)zigzag);
+	}
+
+	memcpy(hdr.magic, MESHFILE_MAGIC, sizeof(hdr.magic));
+	hdr.vertexCount=(GLuint)data.vertices.size();
+	hdr.indexCount=(GLuint)data.indices.size();
+	hdr.flags=MESHFILE_INDEX_DELTA;
+	hdr.indexBytes=(GLuint)encoded.size();
+
+	info("writing mesh file '%s'",filename);
+	FILE *file=fopen(filename, "wb");
+	if (!file) {
+		warn("Failed to open mesh file '%s' for writing", filename);
+		return false;
+	}
+	ok=(fwrite(&hdr, sizeof(hdr), 1, file) == 1);
+	if (ok && hdr.vertexCount) {
+		ok=(fwrite(&data.vertices[0], sizeof(Vertex), hdr.vertexCount, file) == hdr.vertexCount);
+	}
+	if (ok && hdr.indexBytes) {
+		ok=(fwrite(&encoded[0], 1, encoded.size(), file) == encoded.size());
+	}
+	if (fclose(file) || !ok) {
+		warn("Failed to write mesh file '%s'", filename);
+		return false;
+	}
+	info("mesh file '%s': %u vertices, %u indices in %u bytes", filename,
+		hdr.vertexCount, hdr.indexCount, hdr.indexBytes);
+	return true;
+}
+
+/* Read and validate the header of a mesh file. The counts are checked
+ * against the file size, so a corrupt header can't make us reserve more
+ * arena space than there is data for.
+ * Returns true if successfull and false in case of an error. */
+static bool meshFileReadHeader(FILE *file, const char *filename, MeshFileHeader *hdr)
+{
+	unsigned long long needed;
+	long fileSize;
+
+	fseek(file, 0, SEEK_END);
+	fileSize=ftell(file);
+	fseek(file, 0, SEEK_SET);
+	if (fread(hdr, sizeof(*hdr), 1, file) != 1) {
+		warn("Failed to read header of mesh file '%s'", filename);
+		return false;
+	}
+	if (memcmp(hdr->magic, MESHFILE_MAGIC, sizeof(hdr->magic))) {
+		warn("'%s' is not a mesh file", filename);
+		return false;
+	}
+	if (hdr->flags & ~(GLuint)MESHFILE_INDEX_DELTA) {
+		warn("mesh file '%s' uses unsupported flags 0x%x", filename, hdr->flags);
+		return false;
+	}
+	/* all products of 32 bit counts fit into 64 bit */
+	if (hdr->flags & MESHFILE_INDEX_DELTA) {
+		/* each encoded index takes between 1 and 5 bytes */
+		if (hdr->indexBytes < hdr->indexCount || (unsigned long long)hdr->indexBytes > 5ULL * hdr->indexCount) {
+			warn("mesh file '%s' has an invalid index data size", filename);
+			return false;
+		}
+	} else if ((unsigned long long)hdr->indexBytes != (unsigned long long)hdr->indexCount * sizeof(GLuint)) {
+		warn("mesh file '%s' has an invalid index data size", filename);
+		return false;
+	}
+	if (!hdr->vertexCount || !hdr->indexCount) {
+		warn("mesh file '%s' is empty", filename);
+		return false;
+	}
+	needed=(unsigned long long)sizeof(*hdr) + (unsigned long long)hdr->vertexCount * sizeof(Vertex) + hdr->indexBytes;
+	if (fileSize < 0 || needed > (unsigned long long)fileSize) {
+		warn("mesh file '%s' is truncated: %llu bytes expected, %ld found", filename, needed, fileSize);
+		return false;
+	}
+	return true;
+}
+
+/****************************************************************************
+ * THE SCENE...                                                             *
+ ****************************************************************************/
+
+/* Upload a mesh into the scene's arena and store the index of the new
+ * mesh in Scene::meshes in *index.
+ * Returns false if the mesh does not fit into the arena. */
+static bool sceneAddMesh(Scene *scene, const MeshData& data, unsigned int *index)
+{
+	Mesh mesh;
+
+	if (!arenaAllocMesh(&scene->arena, &mesh, &data.vertices[0], (GLuint)data.vertices.size(),
+		&data.indices[0], (GLuint)data.indices.size())) {
+		return false;
+	}
+	scene->meshes.push_back(mesh);
+	*index=(unsigned int)scene->meshes.size() - 1;
+	return true;
+}
+
+/* Initialize the OpenGL state for the scene. This will set up the buffer
+ * arena, generate the meshes and upload them into the arena, and place the
+ * objects.
+ *
+ * This function is only called once. After it returned, all the data needed
+ * for drawing the scene is stored in GL objects, so we do not have to
+ * re-specify the vertex data every time an object is drawn. */
+static void initScene(Scene *scene, const AppConfig& cfg)
+{
+	MeshData data;
+	unsigned int mesh;
+
+	/* start with room for the cube, the arena grows if required */
+	arenaInit(&scene->arena, 1024, 4096);
+
+	sceneGraphClear(&scene->graph);
+	scene->root=sceneGraphAddNode(&scene->graph, -1, glm::mat4(1.0f));
+
+	/* the cube is always mesh 0, the sphere is only generated on request,
+	 * the arena was created with enough room for the cube */
+	generateCube(data);
+	sceneAddMesh(scene, data, &mesh);
+	if (cfg.sphereTriangles) {
+		generateSphere(data, cfg.sphereTriangles);
+		if (!sceneAddMesh(scene, data, &mesh)) {
+			warn("Scene: the sphere does not fit into the arena, using the cube");
+		}
+	}
+	if (cfg.saveMesh) {
+		meshFileWrite(cfg.saveMesh, data);
+	}
+	generateObjects(scene, cfg, mesh);
+	info("Scene: %u meshes, %u objects, %u triangles per object",
+		(unsigned)scene->meshes.size(), (unsigned)scene->objects.size(),
+		(unsigned)scene->meshes[mesh].indexCount/3);
+
+	GL_ERROR_DBG("scene initialization");
+}
+
+/* Destroy all GL objects related to the scene. */
+static void destroyScene(Scene *scene)
+{
+	size_t i;
+
+	for (i=0; i<scene->meshes.size(); i++) {
+		arenaFreeMesh(&scene->arena, &scene->meshes[i]);
+	}
+	arenaDestroy(&scene->arena);
+	scene->meshes.clear();
+	scene->objects.clear();
+	sceneGraphClear(&scene->graph);
+}
+
+/****************************************************************************
+ * STREAMING MESH UPLOADS                                                   *
+ ****************************************************************************/
+
+/* Mesh files given on the command line are loaded in a background thread,
+ * so that loading big scenes never blocks the render thread. The objects
+ * are rendered with the generated meshes until the file data arrived. */
+
+#define STREAM_RING_SIZE	(16*1024*1024)	/* size of the staging ring in bytes */
+#define STREAM_CHUNK_SIZE	(1024*1024)	/* max. size of a single chunk */
+#define STREAM_FRAME_BUDGET	(4*1024*1024)	/* max. bytes copied into the arena per frame */
+#define STREAM_FINISH_TIMEOUT	30.0		/* max. seconds streamerFinish() waits */
+
+/* Send a message to the render thread. */
+static void streamerPost(MeshStreamer *st, const StreamMessage& msg)
+{
+	std::lock_guard<std::mutex> lock(st->mutex);
+	st->messages.push_back(msg);
+}
+
+/* Reserve size contiguous bytes in the staging ring. Waits until the render
+ * thread released enough space. Loader thread only.
+ * Returns false if the streamer is shut down. */
+static bool streamerReserve(MeshStreamer *st, GLsizeiptr size, GLintptr *offset)
+{
+	unsigned long long pad=0;
+	GLsizeiptr pos=(GLsizeiptr)(st->head % (unsigned long long)st->size);
+
+	/* chunks never wrap around, skip the rest of the ring instead */
+	if (pos + size > st->size) {
+		pad=(unsigned long long)(st->size - pos);
+	}
+
+	std::unique_lock<std::mutex> lock(st->mutex);
+	while (!st->stop && st->head + pad + size - st->tail > (unsigned long long)st->size) {
+		st->cond.wait(lock);
+	}
+	if (st->stop) {
+		return false;
+	}
+	st->head += pad;
+	*offset=(GLintptr)(st->head % (unsigned long long)st->size);
+	st->head += size;
+	return true;
+}
+
+/* Load a single mesh file into the staging ring. Loader thread only.
+ * Returns true if successfull and false in case of an error. */
+static bool streamerLoadFile(MeshStreamer *st, unsigned int idx, std::vector<GLubyte>& readBuf)
+{
+	PROFILE_ZONE("mesh file load");
+	const char *filename=st->files[idx];
+	MeshFileHeader hdr;
+	StreamMessage msg;
+	GLsizeiptr total, done, n;
+	bool ok=true;
+
+	/* every file ends with exactly one STREAM_MESH_END or
+	 * STREAM_MESH_FAILED, even if it never got to STREAM_MESH_BEGIN */
+	memset(&msg, 0, sizeof(msg));
+	msg.type=STREAM_MESH_FAILED;
+	msg.file=idx;
+
+	info("Streamer: loading mesh file '%s'", filename);
+	FILE *file=fopen(filename, "rb");
+	if (!file) {
+		warn("Failed to open mesh file '%s'", filename);
+		streamerPost(st, msg);
+		return false;
+	}
+	if (!meshFileReadHeader(file, filename, &hdr)) {
+		fclose(file);
+		streamerPost(st, msg);
+		return false;
+	}
+
+	msg.type=STREAM_MESH_BEGIN;
+	msg.file=idx;
+	msg.vertexCount=hdr.vertexCount;
+	msg.indexCount=hdr.indexCount;
+	streamerPost(st, msg);
+
+	/* the vertex data is stored as-is, read it directly into the ring,
+	 * in chunks of whole vertices to keep everything aligned */
+	msg.type=STREAM_MESH_DATA;
+	msg.buffer=0;
+	total=(GLsizeiptr)hdr.vertexCount * (GLsizeiptr)sizeof(Vertex);
+	for (done=0; ok && done<total; done+=n) {
+		const GLsizeiptr chunk=(STREAM_CHUNK_SIZE / sizeof(Vertex)) * sizeof(Vertex);
+		n=(total - done < chunk)?(total - done):chunk;
+		if (!streamerReserve(st, n, &msg.srcOffset)) {
+			ok=false;
+		} else if (fread(st->staging + msg.srcOffset, 1, (size_t)n, file) != (size_t)n) {
+			warn("Failed to read vertex data of mesh file '%s'", filename);
+			ok=false;
+		} else {
+			msg.dstOffset=done;
+			msg.size=n;
+			msg.end=st->head;
+			streamerPost(st, msg);
+		}
+	}
+
+	/* decode the indices into the ring */
+	msg.buffer=1;
+	GLuint remaining=hdr.indexCount;
+	GLuint prev=0;
+	size_t bufPos=0, bufLen=0;
+	done=0;
+	while (ok && remaining) {
+		GLuint count=(remaining < STREAM_CHUNK_SIZE/sizeof(GLuint))?remaining:(GLuint)(STREAM_CHUNK_SIZE/sizeof(GLuint));
+		n=(GLsizeiptr)count * (GLsizeiptr)sizeof(GLuint);
+		if (!streamerReserve(st, n, &msg.srcOffset)) {
+			ok=false;
+			break;
+		}
+		GLuint *dst=(GLuint*)(st->staging + msg.srcOffset);
+		if (hdr.flags & MESHFILE_INDEX_DELTA) {
+			GLuint i;
+			for (i=0; ok && i<count; i++) {
+				GLuint zigzag=0;
+				unsigned int shift=0;
+				GLubyte b;
+				do {
+					if (bufPos >= bufLen) {
+						bufLen=fread(&readBuf[0], 1, readBuf.size(), file);
+						bufPos=0;
+						if (!bufLen) {
+							ok=false;
+							break;
+						}
+					}
+					b=readBuf[bufPos++];
+					zigzag |= (GLuint)(b & 0x7f) << shift;
+					shift += 7;
+				} while ((b & 0x80) && shift < 35);
+				prev += (zigzag >> 1) ^ (GLuint)(-(GLint)(zigzag & 1));
+				dst[i]=prev;
+			}
+		} else {
+			ok=(fread(dst, sizeof(GLuint), count, file) == count);
+		}
+		if (ok) {
+			/* never let a corrupt file make the GPU read outside the mesh */
+			GLuint i;
+			for (i=0; i<count; i++) {
+				if (dst[i] >= hdr.vertexCount) {
+					warn("mesh file '%s': index %u out of range", filename, dst[i]);
+					ok=false;
+					break;
+				}
+			}
+		} else {
+			warn("Failed to read index data of mesh file '%s'", filename);
+		}
+		if (ok) {
+			msg.dstOffset=done;
+			msg.size=n;
+			msg.end=st->head;
+			streamerPost(st, msg);
+			done += n;
+			remaining -= count;
+		}
+	}
+	fclose(file);
+
+	msg.type=(ok)?STREAM_MESH_END:STREAM_MESH_FAILED;
+	streamerPost(st, msg);
+	return ok;
+}
+
+/* The loader thread: load all files, one after the other. */
+static void streamerThread(MeshStreamer *st)
+{
+	std::vector<GLubyte> readBuf(64*1024);
+	unsigned int i;
+
+	profilerThreadName("mesh loader");
+	for (i=0; i<(unsigned int)st->files.size(); i++) {
+		{
+			std::lock_guard<std::mutex> lock(st->mutex);
+			if (st->stop) {
+				break;
+			}
+		}
+		streamerLoadFile(st, i, readBuf);
+	}
+	info("Streamer: loader thread finished");
+}
+
+/* Initialize the streamer and start loading the files in the background. */
+static void initStreamer(MeshStreamer *st, const AppConfig& cfg)
+{
+	st->buffer=0;
+	st->staging=NULL;
+	st->size=STREAM_RING_SIZE;
+	st->head=st->tail=0;
+	st->stop=false;
+	st->running=false;
+	st->finished=0;
+	st->failed=0;
+	st->files=cfg.meshFiles;
+	if (st->files.empty()) {
+		return;
+	}
+	st->meshes.resize(st->files.size());
+
+	if (GLAD_GL_ARB_buffer_storage) {
+		/* the loader thread writes directly into a persistently mapped
+		 * buffer, the GL copies from there into the arena */
+		GLbitfield flags=GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+		glGenBuffers(1, &st->buffer);
+		glBindBuffer(GL_COPY_READ_BUFFER, st->buffer);
+		glBufferStorage(GL_COPY_READ_BUFFER, st->size, NULL, flags);
+		gpuMemTrack(GPU_MEM_BUFFERS, st->buffer, (size_t)st->size);
+		st->staging=(GLubyte*)glMapBufferRange(GL_COPY_READ_BUFFER, 0, st->size, flags);
+		glBindBuffer(GL_COPY_READ_BUFFER, 0);
+		if (st->staging) {
+			info("Streamer: persistently mapped staging buffer %u, %u bytes", st->buffer, (unsigned)st->size);
+		} else {
+			warn("Streamer: failed to map staging buffer");
+			gpuMemUntrack(GPU_MEM_BUFFERS, st->buffer);
+			glDeleteBuffers(1, &st->buffer);
+			st->buffer=0;
+		}
+	}
+	if (!st->staging) {
+		/* fallback: the ring lives in client memory and the render
+		 * thread uploads it with glBufferSubData */
+		st->staging=(GLubyte*)malloc(st->size);
+		if (!st->staging) {
+			warn("Streamer: failed to allocate staging memory");
+			return;
+		}
+		info("Streamer: using client memory staging ring, %u bytes", (unsigned)st->size);
+	}
+
+	st->running=true;
+	st->thread=std::thread(streamerThread, st);
+}
+
+/* Release staging ring space up to position "end" and wake up the loader. */
+static void streamerRelease(MeshStreamer *st, unsigned long long end)
+{
+	std::lock_guard<std::mutex> lock(st->mutex);
+	if (end > st->tail) {
+		st->tail=end;
+		st->cond.notify_all();
+	}
+}
+
+/* A mesh is completely in the arena: use it for every n-th object. */
+static void streamerMeshReady(MeshStreamer *st, Scene *scene, unsigned int file)
+{
+	unsigned int mesh=(unsigned int)scene->meshes.size();
+	size_t i;
+
+	scene->meshes.push_back(st->meshes[file]);
+	for (i=file; i<scene->objects.size(); i+=st->files.size()) {
+		scene->objects[i].mesh=mesh;
+	}
+	st->finished++;
+	info("Streamer: mesh file '%s' is ready: %u vertices, %u triangles",
+		st->files[file], st->meshes[file].vertexCount, (unsigned)st->meshes[file].indexCount/3);
+}
+
+/* Process the messages of the loader thread. This is called once per
+ * frame by the render thread and never blocks: the copies are only
+ * queued in the GL, and fences tell us when the staging memory can be
+ * reused. At most STREAM_FRAME_BUDGET bytes are handled per frame. */
+static void streamerUpdate(MeshStreamer *st, Scene *scene)
+{
+	PROFILE_ZONE("mesh streaming");
+	StreamFence f;
+	GLsizeiptr bytes=0;
+	unsigned long long end=0;
+	size_t i;
+
+	if (!st->running) {
+		return;
+	}
+
+	/* retire the copies the GPU has finished */
+	while (!st->fences.empty()) {
+		StreamFence& front=st->fences.front();
+		GLenum res=glClientWaitSync(front.fence, 0, 0);
+		if (res == GL_TIMEOUT_EXPIRED) {
+			break;
+		}
+		if (res == GL_WAIT_FAILED) {
+			warn("Streamer: waiting for fence failed");
+		}
+		glDeleteSync(front.fence);
+		streamerRelease(st, front.end);
+		for (i=0; i<front.completed.size(); i++) {
+			streamerMeshReady(st, scene, front.completed[i]);
+		}
+		st->fences.erase(st->fences.begin());
+	}
+
+	while (bytes < STREAM_FRAME_BUDGET) {
+		StreamMessage msg;
+		{
+			std::lock_guard<std::mutex> lock(st->mutex);
+			if (st->messages.empty()) {
+				break;
+			}
+			msg=st->messages.front();
+			st->messages.pop_front();
+		}
+
+		Mesh& mesh=st->meshes[msg.file];
+		switch (msg.type) {
+			case STREAM_MESH_BEGIN:
+				/* if this fails, the mesh stays empty and its data
+				 * is dropped, the header guarantees non-empty meshes */
+				arenaReserveMesh(&scene->arena, &mesh, msg.vertexCount, msg.indexCount);
+				break;
+			case STREAM_MESH_DATA:
+				if (!mesh.indexCount) {
+					/* drop the data, but don't release ring space
+					 * still read by earlier copies in flight */
+					if (st->buffer) {
+						end=msg.end;
+					} else {
+						streamerRelease(st, msg.end);
+					}
+				} else {
+					GLintptr base=(msg.buffer)?(mesh.firstIndex * sizeof(GLuint)):(mesh.baseVertex * sizeof(Vertex));
+					glBindBuffer(GL_COPY_WRITE_BUFFER, scene->arena.vbo[msg.buffer]);
+					if (st->buffer) {
+						glBindBuffer(GL_COPY_READ_BUFFER, st->buffer);
+						glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, msg.srcOffset, base + msg.dstOffset, msg.size);
+						glBindBuffer(GL_COPY_READ_BUFFER, 0);
+						end=msg.end;
+					} else {
+						/* glBufferSubData copies the data, the ring space is free again */
+						glBufferSubData(GL_COPY_WRITE_BUFFER, base + msg.dstOffset, msg.size, st->staging + msg.srcOffset);
+						streamerRelease(st, msg.end);
+					}
+					glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+					bytes += msg.size;
+				}
+				break;
+			case STREAM_MESH_END:
+				if (mesh.indexCount) {
+					f.completed.push_back(msg.file);
+					break;
+				}
+				/* there was no room in the arena */
+				/* fall through */
+			default:
+				warn("Streamer: failed to load mesh file '%s'", st->files[msg.file]);
+				st->finished++;
+				st->failed++;
+				if (mesh.vertexCount) {
+					arenaFreeMesh(&scene->arena, &mesh);
+					mesh.vertexCount=0;
+					mesh.indexCount=0;
+				}
+		}
+	}
+
+	if (st->buffer) {
+		if (end || !f.completed.empty()) {
+			f.fence=glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+			f.end=end;
+			st->fences.push_back(f);
+		}
+	} else {
+		for (i=0; i<f.completed.size(); i++) {
+			streamerMeshReady(st, scene, f.completed[i]);
+		}
+	}
+}
+
+/* Check if all mesh files are either in the arena or failed to load */
+static bool streamerDone(const MeshStreamer *st)
+{
+	return !st->running || st->finished >= st->files.size();
+}
+
+/* Block until all mesh files are loaded or failed, for deterministic runs,
+ * where the frame a mesh appears in must not depend on the loader thread.
+ * Returns false if this takes longer than STREAM_FINISH_TIMEOUT. */
+static bool streamerFinish(MeshStreamer *st, Scene *scene)
+{
+	double deadline=glfwGetTime() + STREAM_FINISH_TIMEOUT;
+
+	while (!streamerDone(st)) {
+		if (glfwGetTime() > deadline) {
+			return false;
+		}
+		streamerUpdate(st, scene);
+		glFinish();
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	return true;
+}
+
+/* Stop the loader thread and destroy the staging ring. */
+static void destroyStreamer(MeshStreamer *st)
+{
+	size_t i;
+
+	if (!st->running) {
+		return;
+	}
+	{
+		std::lock_guard<std::mutex> lock(st->mutex);
+		st->stop=true;
+		st->cond.notify_all();
+	}
+	st->thread.join();
+	st->running=false;
+
+	for (i=0; i<st->fences.size(); i++) {
+		glDeleteSync(st->fences[i].fence);
+	}
+	st->fences.clear();
+	st->messages.clear();
+	if (st->buffer) {
+		info("Streamer: deleting staging buffer %u", st->buffer);
+		glBindBuffer(GL_COPY_READ_BUFFER, st->buffer);
+		glUnmapBuffer(GL_COPY_READ_BUFFER);
+		glBindBuffer(GL_COPY_READ_BUFFER, 0);
+		gpuMemUntrack(GPU_MEM_BUFFERS, st->buffer);
+		glDeleteBuffers(1, &st->buffer);
+		st->buffer=0;
+	} else {
+		free(st->staging);
+	}
+	st->staging=NULL;
+}
+
+/****************************************************************************
+ * TEXTURES                                                                 *
+ ****************************************************************************/
+
+/* Textures are loaded from KTX (version 1) or DDS files with pre-built mip
+ * levels. Compressed formats are passed to the GL as-is if supported,
+ * BC1-BC3 are decoded on the CPU otherwise. The levels are uploaded
+ * through a ring of PBOs, coarse levels first, and only as far as the
+ * distance of the closest textured object requires. */
+
+#define TEXTURE_UPLOAD_BUDGET	(2*1024*1024)	/* max. bytes uploaded per frame */
+#define TEXTURE_MAX_SIZE	16384		/* larger files are rejected */
+
+/* Size in bytes of a level of the given dimensions, blockSize is the size
+ * of a 4x4 block for compressed formats and 0 for RGBA8 */
+static size_t textureLevelSize(GLsizei w, GLsizei h, size_t blockSize)
+{
+	if (blockSize) {
+		return (size_t)((w+3)/4) * (size_t)((h+3)/4) * blockSize;
+	}
+	return (size_t)w * (size_t)h * 4;
+}
+
+/* Size of a 4x4 block of a compressed format, 0 if unknown */
+static size_t textureBlockSize(GLenum internalFormat)
+{
+	switch (internalFormat) {
+		case GL_COMPRESSED_RGB_S3TC_DXT1_EXT:
+		case GL_COMPRESSED_RGBA_S3TC_DXT1_EXT:
+		case GL_COMPRESSED_RGB8_ETC2:
+		case GL_COMPRESSED_SRGB8_ETC2:
+			return 8;
+		case GL_COMPRESSED_RGBA_S3TC_DXT3_EXT:
+		case GL_COMPRESSED_RGBA_S3TC_DXT5_EXT:
+		case GL_COMPRESSED_RGBA_BPTC_UNORM:
+		case GL_COMPRESSED_SRGB_ALPHA_BPTC_UNORM:
+		case GL_COMPRESSED_RGBA8_ETC2_EAC:
+			return 16;
+	}
+	return 0;
+}
+
+/* Check if the GL can use a compressed format directly */
+static bool textureFormatSupported(GLenum internalFormat)
+{
+	switch (internalFormat) {
+		case GL_COMPRESSED_RGB_S3TC_DXT1_EXT:
+		case GL_COMPRESSED_RGBA_S3TC_DXT1_EXT:
+		case GL_COMPRESSED_RGBA_S3TC_DXT3_EXT:
+		case GL_COMPRESSED_RGBA_S3TC_DXT5_EXT:
+			return GLAD_GL_EXT_texture_compression_s3tc != 0;
+		case GL_COMPRESSED_RGBA_BPTC_UNORM:
+		case GL_COMPRESSED_SRGB_ALPHA_BPTC_UNORM:
+			return GLAD_GL_VERSION_4_2 || GLAD_GL_ARB_texture_compression_bptc;
+		case GL_COMPRESSED_RGB8_ETC2:
+		case GL_COMPRESSED_SRGB8_ETC2:
+		case GL_COMPRESSED_RGBA8_ETC2_EAC:
+			return GLAD_GL_VERSION_4_3 || GLAD_GL_ARB_ES3_compatibility;
+	}
+	return false;
+}
+
+/* Set up the level table for width x height with "count" levels (0 for a
+ * full mip chain), returns the total size of all levels. */
+static size_t textureSetupLevels(Texture *t, GLsizei width, GLsizei height, unsigned int count, size_t blockSize)
+{
+	size_t offset=0;
+	TextureLevel lvl;
+
+	t->levels.clear();
+	lvl.width=width;
+	lvl.height=height;
+	do {
+		lvl.offset=offset;
+		lvl.size=textureLevelSize(lvl.width, lvl.height, blockSize);
+		offset += lvl.size;
+		t->levels.push_back(lvl);
+		if (lvl.width == 1 && lvl.height == 1) {
+			break;
+		}
+		lvl.width=(lvl.width > 1)?(lvl.width/2):1;
+		lvl.height=(lvl.height > 1)?(lvl.height/2):1;
+	} while (!count || t->levels.size() < count);
+	return offset;
+}
+
+/* Compute all levels of an RGBA8 texture from the first one with a box
+ * filter. Odd sizes repeat the last row or column. */
+static void textureBuildMips(Texture *t)
+{
+	GLsizei x, y;
+	size_t i;
+	int c;
+
+	for (i=1; i<t->levels.size(); i++) {
+		const TextureLevel& src=t->levels[i-1];
+		const TextureLevel& dst=t->levels[i];
+		for (y=0; y<dst.height; y++) {
+			GLsizei y1=std::min(2*y+1, src.height-1);
+			for (x=0; x<dst.width; x++) {
+				GLsizei x1=std::min(2*x+1, src.width-1);
+				const GLubyte *s00=&t->data[src.offset + 4*((size_t)(2*y)*src.width + 2*x)];
+				const GLubyte *s01=&t->data[src.offset + 4*((size_t)(2*y)*src.width + x1)];
+				const GLubyte *s10=&t->data[src.offset + 4*((size_t)y1*src.width + 2*x)];
+				const GLubyte *s11=&t->data[src.offset + 4*((size_t)y1*src.width + x1)];
+				GLubyte *o=&t->data[dst.offset + 4*((size_t)y*dst.width + x)];
+				for (c=0; c<4; c++) {
+					o[c]=(GLubyte)((s00[c] + s01[c] + s10[c] + s11[c] + 2) / 4);
+				}
+			}
+		}
+	}
+}
+
+/* Read a whole file into memory.
+ * Returns true if successfull and false in case of an error. */
+static bool readFile(const char *filename, std::vector<GLubyte>& buf)
+{
+	FILE *file=fopen(filename, "rb");
+	long size;
+	bool ok;
+
+	if (!file) {
+		warn("Failed to open file '%s'", filename);
+		return false;
+	}
+	fseek(file, 0, SEEK_END);
+	size=ftell(file);
+	fseek(file, 0, SEEK_SET);
+	buf.resize((size > 0)?(size_t)size:0);
+	ok=(size > 0) && (fread(&buf[0], 1, buf.size(), file) == buf.size());
+	fclose(file);
+	if (!ok) {
+		warn("Failed to read file '%s'", filename);
+	}
+	return ok;
+}
+
+/* read a little endian 32 bit value */
+static GLuint readU32(const GLubyte *p)
+{
+	return (GLuint)p[0] | ((GLuint)p[1] << 8) | ((GLuint)p[2] << 16) | ((GLuint)p[3] << 24);
+}
+
+/* Parse a KTX (version 1) file. Only 2D textures with a single face and
+ * array layer in little endian byte order are supported.
+ * Returns true if successfull and false in case of an error. */
+static bool textureParseKTX(Texture *t, const std::vector<GLubyte>& file, const char *filename)
+{
+	static const GLubyte identifier[12]={0xAB, 'K', 'T', 'X', ' ', '1', '1', 0xBB, '\r', '\n', 0x1A, '\n'};
+	const GLubyte *hdr=&file[0];
+	size_t pos, blockSize=0, total, fileLevels;
+	unsigned int i, levelCount;
+	bool generate;
+
+	if (file.size() < 64 || memcmp(hdr, identifier, sizeof(identifier)) || readU32(hdr+12) != 0x04030201) {
+		warn("'%s' is not a little endian KTX file", filename);
+		return false;
+	}
+	GLenum glType=readU32(hdr+16);
+	GLenum glFormat=readU32(hdr+24);
+	GLenum glInternalFormat=readU32(hdr+28);
+	GLuint width=readU32(hdr+36);
+	GLuint height=readU32(hdr+40);
+	if (readU32(hdr+44) > 1 || readU32(hdr+48) > 1 || readU32(hdr+52) != 1 || !width || !height) {
+		warn("KTX file '%s': only simple 2D textures are supported", filename);
+		return false;
+	}
+	if (width > TEXTURE_MAX_SIZE || height > TEXTURE_MAX_SIZE) {
+		warn("KTX file '%s': %ux%u is too large", filename, width, height);
+		return false;
+	}
+	levelCount=readU32(hdr+56);
+	pos=64 + readU32(hdr+60);
+
+	if (glType) {
+		if (glType != GL_UNSIGNED_BYTE || (glFormat != GL_RGBA && glFormat != GL_BGRA)) {
+			warn("KTX file '%s': unsupported uncompressed format 0x%x/0x%x", filename, glFormat, glType);
+			return false;
+		}
+		t->compressed=false;
+		t->internalFormat=GL_RGBA8;
+		t->format=glFormat;
+		t->type=glType;
+	} else {
+		blockSize=textureBlockSize(glInternalFormat);
+		if (!blockSize) {
+			warn("KTX file '%s': unsupported compressed format 0x%x", filename, glInternalFormat);
+			return false;
+		}
+		t->compressed=true;
+		t->internalFormat=glInternalFormat;
+	}
+
+	/* no levels means the file only has the base level and the loader
+	 * should generate the others, which we only can for RGBA8 */
+	generate=(levelCount == 0) && !t->compressed;
+	if (!levelCount) {
+		levelCount=(generate)?0:1;
+	}
+	total=textureSetupLevels(t, (GLsizei)width, (GLsizei)height, levelCount, blockSize);
+	fileLevels=(generate)?1:t->levels.size();
+	if (pos > file.size() || ((generate)?t->levels[0].size:total) > file.size() - pos) {
+		warn("KTX file '%s' is truncated", filename);
+		return false;
+	}
+	t->data.resize(total);
+	for (i=0; i<fileLevels; i++) {
+		const TextureLevel& lvl=t->levels[i];
+		if (file.size() - pos < 4 || readU32(&file[pos]) != lvl.size || lvl.size > file.size() - pos - 4) {
+			warn("KTX file '%s': invalid or truncated level %u", filename, i);
+			return false;
+		}
+		memcpy(&t->data[lvl.offset], &file[pos+4], lvl.size);
+		pos += 4 + ((lvl.size + 3) & ~(size_t)3);
+		/* the padding of the last level may be missing */
+		pos=std::min(pos, file.size());
+	}
+	if (generate) {
+		textureBuildMips(t);
+	}
+	return true;
+}
+
+/* Parse a DDS file. Supports DXT1/3/5, BC7 via the DX10 header, and
+ * 32 bit RGBA/BGRA.
+ * Returns true if successfull and false in case of an error. */
+static bool textureParseDDS(Texture *t, const std::vector<GLubyte>& file, const char *filename)
+{
+	const GLubyte *hdr=&file[0];
+	size_t pos=128, blockSize=0, total;
+
+	if (file.size() < 128 || memcmp(hdr, "DDS ", 4) || readU32(hdr+4) != 124) {
+		warn("'%s' is not a DDS file", filename);
+		return false;
+	}
+	GLuint height=readU32(hdr+12);
+	GLuint width=readU32(hdr+16);
+	unsigned int levelCount=(readU32(hdr+8) & 0x20000)?readU32(hdr+28):1;
+	GLuint pfFlags=readU32(hdr+80);
+	const GLubyte *fourCC=hdr+84;
+
+	if (pfFlags & 0x4) {
+		/* DDPF_FOURCC: compressed */
+		t->compressed=true;
+		if (!memcmp(fourCC, "DXT1", 4)) {
+			t->internalFormat=GL_COMPRESSED_RGBA_S3TC_DXT1_EXT;
+		} else if (!memcmp(fourCC, "DXT3", 4)) {
+			t->internalFormat=GL_COMPRESSED_RGBA_S3TC_DXT3_EXT;
+		} else if (!memcmp(fourCC, "DXT5", 4)) {
+			t->internalFormat=GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+		} else if (!memcmp(fourCC, "DX10", 4) && file.size() >= 148) {
+			switch (readU32(hdr+128)) {
+				case 71: t->internalFormat=GL_COMPRESSED_RGBA_S3TC_DXT1_EXT; break;
+				case 74: t->internalFormat=GL_COMPRESSED_RGBA_S3TC_DXT3_EXT; break;
+				case 77: t->internalFormat=GL_COMPRESSED_RGBA_S3TC_DXT5_EXT; break;
+				case 98: t->internalFormat=GL_COMPRESSED_RGBA_BPTC_UNORM; break;
+				case 99: t->internalFormat=GL_COMPRESSED_SRGB_ALPHA_BPTC_UNORM; break;
+				default:
+					warn("DDS file '%s': unsupported DXGI format %u", filename, readU32(hdr+128));
+					return false;
+			}
+			pos=148;
+		} else {
+			warn("DDS file '%s': unsupported format '%.4s'", filename, (const char*)fourCC);
+			return false;
+		}
+		blockSize=textureBlockSize(t->internalFormat);
+	} else if ((pfFlags & 0x40) && readU32(hdr+88) == 32) {
+		/* DDPF_RGB with 32 bits per pixel, check the red mask */
+		t->compressed=false;
+		t->internalFormat=GL_RGBA8;
+		t->type=GL_UNSIGNED_BYTE;
+		t->format=(readU32(hdr+92) == 0x000000ff)?GL_RGBA:GL_BGRA;
+	} else {
+		warn("DDS file '%s': unsupported pixel format", filename);
+		return false;
+	}
+	if (!width || !height || width > TEXTURE_MAX_SIZE || height > TEXTURE_MAX_SIZE) {
+		warn("DDS file '%s': invalid size %ux%u", filename, width, height);
+		return false;
+	}
+
+	total=textureSetupLevels(t, (GLsizei)width, (GLsizei)height, levelCount, blockSize);
+	if (pos > file.size() || total > file.size() - pos) {
+		warn("DDS file '%s' is truncated", filename);
+		return false;
+	}
+	t->data.assign(file.begin() + pos, file.begin() + pos + total);
+	return true;
+}
+
+/* convert a RGB565 color to RGBA8 */
+static void decodeRGB565(GLuint c, GLubyte *rgba)
+{
+	rgba[0]=(GLubyte)(((c >> 11) & 0x1f) * 255 / 31);
+	rgba[1]=(GLubyte)(((c >> 5) & 0x3f) * 255 / 63);
+	rgba[2]=(GLubyte)((c & 0x1f) * 255 / 31);
+	rgba[3]=255;
+}
+
+/* Decode a BC1/BC2/BC3 encoded level to RGBA8 */
+static void decodeBC(const GLubyte *src, GLsizei width, GLsizei height, GLenum internalFormat, GLubyte *dst)
+{
+	bool hasAlphaBlock=(internalFormat != GL_COMPRESSED_RGB_S3TC_DXT1_EXT && internalFormat != GL_COMPRESSED_RGBA_S3TC_DXT1_EXT);
+	GLsizei bx, by;
+	int x, y, i;
+
+	for (by=0; by<height; by+=4) {
+		for (bx=0; bx<width; bx+=4) {
+			GLubyte alpha[16];
+			GLubyte palette[4][4];
+			const GLubyte *color=src + (hasAlphaBlock?8:0);
+
+			if (internalFormat == GL_COMPRESSED_RGBA_S3TC_DXT3_EXT) {
+				/* explicit 4 bit alpha */
+				for (i=0; i<16; i++) {
+					alpha[i]=(GLubyte)(((src[i/2] >> ((i & 1) * 4)) & 0xf) * 17);
+				}
+			} else if (internalFormat == GL_COMPRESSED_RGBA_S3TC_DXT5_EXT) {
+				/* two endpoints and 3 bit indices */
+				GLuint a[8];
+				unsigned long long bits=0;
+				a[0]=src[0];
+				a[1]=src[1];
+				for (i=2; i<8; i++) {
+					if (a[0] > a[1]) {
+						a[i]=((8-i)*a[0] + (i-1)*a[1]) / 7;
+					} else if (i < 6) {
+						a[i]=((6-i)*a[0] + (i-1)*a[1]) / 5;
+					} else {
+						a[i]=(i == 6)?0:255;
+					}
+				}
+				for (i=0; i<6; i++) {
+					bits |= (unsigned long long)src[2+i] << (8*i);
+				}
+				for (i=0; i<16; i++) {
+					alpha[i]=(GLubyte)a[(bits >> (3*i)) & 7];
+				}
+			} else {
+				memset(alpha, 255, sizeof(alpha));
+			}
+
+			GLuint c0=color[0] | (color[1] << 8);
+			GLuint c1=color[2] | (color[3] << 8);
+			decodeRGB565(c0, palette[0]);
+			decodeRGB565(c1, palette[1]);
+			for (i=0; i<3; i++) {
+				if (c0 > c1 || hasAlphaBlock) {
+					palette[2][i]=(GLubyte)((2*palette[0][i] + palette[1][i]) / 3);
+					palette[3][i]=(GLubyte)((palette[0][i] + 2*palette[1][i]) / 3);
+				} else {
+					palette[2][i]=(GLubyte)((palette[0][i] + palette[1][i]) / 2);
+					palette[3][i]=0;
+				}
+			}
+			palette[2][3]=255;
+			palette[3][3]=(c0 > c1 || hasAlphaBlock)?255:0;
+
+			GLuint indices=readU32(color+4);
+			for (y=0; y<4; y++) {
+				for (x=0; x<4; x++) {
+					if (bx+x < width && by+y < height) {
+						const GLubyte *c=palette[(indices >> (2*(4*y+x))) & 3];
+						GLubyte *d=dst + 4*((size_t)(by+y)*width + bx+x);
+						d[0]=c[0];
+						d[1]=c[1];
+						d[2]=c[2];
+						d[3]=(GLubyte)((c[3] * alpha[4*y+x]) / 255);
+					}
+				}
+			}
+			src += (hasAlphaBlock)?16:8;
+		}
+	}
+}
+
+/* Replace the compressed data of t by RGBA8.
+ * Returns true if successfull and false if we can't decode the format. */
+static bool textureDecompress(Texture *t)
+{
+	std::vector<GLubyte> rgba;
+	std::vector<TextureLevel> compressedLevels=t->levels;
+	size_t i;
+
+	switch (t->internalFormat) {
+		case GL_COMPRESSED_RGB_S3TC_DXT1_EXT:
+		case GL_COMPRESSED_RGBA_S3TC_DXT1_EXT:
+		case GL_COMPRESSED_RGBA_S3TC_DXT3_EXT:
+		case GL_COMPRESSED_RGBA_S3TC_DXT5_EXT:
+			break;
+		default:
+			warn("Texture: no CPU decoder for format 0x%x", t->internalFormat);
+			return false;
+	}
+
+	rgba.resize(textureSetupLevels(t, compressedLevels[0].width, compressedLevels[0].height, (unsigned int)compressedLevels.size(), 0));
+	for (i=0; i<t->levels.size(); i++) {
+		decodeBC(&t->data[compressedLevels[i].offset], t->levels[i].width, t->levels[i].height,
+			t->internalFormat, &rgba[t->levels[i].offset]);
+	}
+	info("Texture: decoded format 0x%x on the CPU, %u -> %u bytes", t->internalFormat,
+		(unsigned)t->data.size(), (unsigned)rgba.size());
+	t->data.swap(rgba);
+	t->compressed=false;
+	t->internalFormat=GL_RGBA8;
+	t->format=GL_RGBA;
+	t->type=GL_UNSIGNED_BYTE;
+	return true;
+}
+
+/* Generate a checkerboard texture with a full mip chain, used if no
+ * texture file was given. The mip levels are box filtered. */
+static void textureGenerateCheckerboard(Texture *t, GLsizei size)
+{
+	GLsizei x, y;
+
+	t->compressed=false;
+	t->internalFormat=GL_RGBA8;
+	t->format=GL_RGBA;
+	t->type=GL_UNSIGNED_BYTE;
+	t->data.resize(textureSetupLevels(t, size, size, 0, 0));
+
+	GLubyte *d=&t->data[0];
+	for (y=0; y<size; y++) {
+		for (x=0; x<size; x++) {
+			GLubyte v=(((x / 16) ^ (y / 16)) & 1)?255:64;
+			*(d++)=v;
+			*(d++)=v;
+			*(d++)=v;
+			*(d++)=255;
+		}
+	}
+	textureBuildMips(t);
+}
+
+/* Initialize the PBO ring */
+static void initPixelRing(PixelUploadRing *ring)
+{
+	unsigned int i;
+
+	glGenBuffers(PIXEL_RING_SLOTS, ring->pbo);
+	for (i=0; i<PIXEL_RING_SLOTS; i++) {
+		ring->size[i]=0;
+		ring->fence[i]=0;
+	}
+	ring->next=0;
+	ring->wait=false;
+}
+
+/* Destroy the PBO ring */
+static void destroyPixelRing(PixelUploadRing *ring)
+{
+	unsigned int i;
+
+	for (i=0; i<PIXEL_RING_SLOTS; i++) {
+		if (ring->fence[i]) {
+			glDeleteSync(ring->fence[i]);
+			ring->fence[i]=0;
+		}
+	}
+	if (ring->pbo[0]) {
+		for (i=0; i<PIXEL_RING_SLOTS; i++) {
+			gpuMemUntrack(GPU_MEM_BUFFERS, ring->pbo[i]);
+		}
+		glDeleteBuffers(PIXEL_RING_SLOTS, ring->pbo);
+		ring->pbo[0]=0;
+	}
+}
+
+/* Upload a level of texture t via the next PBO of the ring.
+ * Returns false if the PBO is still in use by the GPU. */
+static bool pixelRingUpload(PixelUploadRing *ring, Texture *t, int level)
+{
+	PROFILE_ZONE("texture upload");
+	const TextureLevel& lvl=t->levels[level];
+	unsigned int slot=ring->next;
+	void *ptr;
+
+	if (ring->fence[slot]) {
+		GLenum res;
+		if (ring->wait) {
+			do {
+				res=glClientWaitSync(ring->fence[slot], GL_SYNC_FLUSH_COMMANDS_BIT, 100000000);
+			} while (res == GL_TIMEOUT_EXPIRED);
+		} else if (glClientWaitSync(ring->fence[slot], 0, 0) == GL_TIMEOUT_EXPIRED) {
+			return false;
+		}
+		glDeleteSync(ring->fence[slot]);
+		ring->fence[slot]=0;
+	}
+
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, ring->pbo[slot]);
+	if (ring->size[slot] < (GLsizeiptr)lvl.size) {
+		glBufferData(GL_PIXEL_UNPACK_BUFFER, lvl.size, NULL, GL_STREAM_DRAW);
+		ring->size[slot]=(GLsizeiptr)lvl.size;
+		gpuMemTrack(GPU_MEM_BUFFERS, ring->pbo[slot], lvl.size);
+	}
+	/* the fence guarantees the GPU is done with this PBO */
+	ptr=glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, lvl.size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+	if (!ptr) {
+		warn("Texture: failed to map PBO %u", ring->pbo[slot]);
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		return false;
+	}
+	memcpy(ptr, &t->data[lvl.offset], lvl.size);
+	glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+
+	glBindTexture(GL_TEXTURE_2D, t->tex);
+	if (t->compressed) {
+		glCompressedTexImage2D(GL_TEXTURE_2D, level, t->internalFormat, lvl.width, lvl.height, 0, (GLsizei)lvl.size, BUFFER_OFFSET(0));
+	} else {
+		glTexImage2D(GL_TEXTURE_2D, level, t->internalFormat, lvl.width, lvl.height, 0, t->format, t->type, BUFFER_OFFSET(0));
+	}
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+	ring->fence[slot]=glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	ring->next=(slot + 1) % PIXEL_RING_SLOTS;
+	t->residentBytes += lvl.size;
+	gpuMemTrack(GPU_MEM_TEXTURES, t->tex, t->residentBytes);
+	return true;
+}
+
+/* Load the texture and make the coarsest level resident.
+ * If the file can't be used, a checkerboard is generated instead. */
+static void initTexture(Texture *t, PixelUploadRing *ring, const AppConfig& cfg)
+{
+	bool ok=false;
+
+	if (cfg.textureFile) {
+		std::vector<GLubyte> file;
+		info("loading texture file '%s'", cfg.textureFile);
+		if (readFile(cfg.textureFile, file)) {
+			if (file.size() >= 4 && !memcmp(&file[0], "DDS ", 4)) {
+				ok=textureParseDDS(t, file, cfg.textureFile);
+			} else {
+				ok=textureParseKTX(t, file, cfg.textureFile);
+			}
+		}
+		if (ok && t->compressed && !textureFormatSupported(t->internalFormat)) {
+			ok=textureDecompress(t);
+		}
+		if (!ok) {
+			warn("Texture: can't use '%s', using a checkerboard", cfg.textureFile);
+		}
+	}
+	if (!ok) {
+		textureGenerateCheckerboard(t, 256);
+	}
+
+	glGenTextures(1, &t->tex);
+	glBindTexture(GL_TEXTURE_2D, t->tex);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, (GLint)t->levels.size()-1);
+	info("Texture: created texture %u, %dx%d, %u levels, format 0x%x, %u bytes", t->tex,
+		t->levels[0].width, t->levels[0].height, (unsigned)t->levels.size(),
+		t->internalFormat, (unsigned)t->data.size());
+
+	initPixelRing(ring);
+	ring->wait=cfg.deterministic;
+	t->residentBytes=0;
+	t->residentBase=(int)t->levels.size()-1;
+	t->targetBase=t->residentBase;
+	pixelRingUpload(ring, t, t->residentBase);
+	glBindTexture(GL_TEXTURE_2D, t->tex);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, t->residentBase);
+	glBindTexture(GL_TEXTURE_2D, 0);
+	GL_ERROR_DBG("texture initialization");
+}
+
+/* Destroy the texture and the PBO ring */
+static void destroyTexture(Texture *t, PixelUploadRing *ring)
+{
+	destroyPixelRing(ring);
+	if (t->tex) {
+		info("Texture: deleting texture %u", t->tex);
+		gpuMemUntrack(GPU_MEM_TEXTURES, t->tex);
+		glDeleteTextures(1, &t->tex);
+		t->tex=0;
+	}
+	t->data.clear();
+	t->levels.clear();
+}
+
+/* Determine the finest mip level needed for the closest object: a level
+ * is fine enough if it has at most as many texels as the object's
+ * (texture-mapped) face covers pixels on screen. extent is the largest
+ * ratio of object size to distance, see sceneBuildDrawList(). */
+static int textureTargetLevel(const Texture *t, float extent, const glm::mat4& projection, int viewportHeight)
+{
+	/* projection[1][1] is cot(fovy/2), so this is pixels per unit at distance 1 */
+	float pixelsPerUnit=0.5f * (float)viewportHeight * projection[1][1];
+	float maxPixels=extent * pixelsPerUnit;
+	int level;
+
+	if (maxPixels < 1.0f) {
+		return (int)t->levels.size()-1;
+	}
+	level=(int)floorf(log2f((float)t->levels[0].width / maxPixels));
+	return glm::clamp(level, 0, (int)t->levels.size()-1);
+}
+
+/* Adjust the resident mip levels, called once per frame. Finer levels are
+ * uploaded one after the other, up to TEXTURE_UPLOAD_BUDGET bytes per
+ * frame. Levels are only dropped if they are more than one level finer
+ * than needed, to avoid thrashing. */
+static void textureUpdate(Texture *t, PixelUploadRing *ring, float extent, const glm::mat4& projection, int viewportHeight)
+{
+	size_t bytes=0;
+	int base=t->residentBase;
+
+	t->targetBase=textureTargetLevel(t, extent, projection, viewportHeight);
+
+	while (t->residentBase > t->targetBase && bytes < TEXTURE_UPLOAD_BUDGET) {
+		if (!pixelRingUpload(ring, t, t->residentBase-1)) {
+			break;
+		}
+		t->residentBase--;
+		bytes += t->levels[t->residentBase].size;
+	}
+
+	glBindTexture(GL_TEXTURE_2D, t->tex);
+	while (t->residentBase < t->targetBase - 1) {
+		/* re-specifying a level with size 0 releases its memory, keep
+		 * the format, so the levels stay consistent */
+		if (t->compressed) {
+			glCompressedTexImage2D(GL_TEXTURE_2D, t->residentBase, t->internalFormat, 0, 0, 0, 0, NULL);
+		} else {
+			glTexImage2D(GL_TEXTURE_2D, t->residentBase, t->internalFormat, 0, 0, 0, t->format, t->type, NULL);
+		}
+		t->residentBytes -= t->levels[t->residentBase].size;
+		t->residentBase++;
+		gpuMemTrack(GPU_MEM_TEXTURES, t->tex, t->residentBytes);
+	}
+	if (base != t->residentBase) {
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, t->residentBase);
+		info("Texture: resident levels %d to %d, %u bytes", t->residentBase,
+			(int)t->levels.size()-1, (unsigned)t->residentBytes);
+	}
+	glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+/****************************************************************************
+ * SIMULATION                                                               *
+ ****************************************************************************/
+
+/* The simulation runs with a fixed time step, independent of the frame
+ * rate. The renderer interpolates between the last two states, so it is
+ * always up to one time step behind. In threaded mode, the simulation has
+ * its own thread and hands its states to the render thread via a lock-free
+ * triple buffer, otherwise the render loop runs the due steps itself. */
+
+#define SIM_MAX_STEPS_BEHIND	8	/* skip time if we are further behind */
+
+/* Advance state s by one time step of dt seconds. */
+static void simStep(SimState *s, double dt, bool animate)
+{
+	if (animate) {
+		/* same as the rotation we always had: 90 degrees per second */
+		s->rotation=s->rotation * glm::angleAxis((float)(glm::half_pi<double>() * dt), glm::normalize(glm::vec3(0.8f, 0.6f, 0.1f)));
+	}
+	s->time += dt;
+	s->step++;
+}
+
+/* Initialize the simulation, the first state is due at time "now". */
+static void simInit(SimFrame *f, double now)
+{
+	f->cur.rotation=glm::quat(1.0f, 0.0f, 0.0f, 0.0f);
+	f->cur.time=0.0;
+	f->cur.step=0;
+	f->prev=f->cur;
+	f->due=now;
+}
+
+/* Simulate the next state, it is due one time step after the current one.
+ * If the simulation fell behind by more than SIM_MAX_STEPS_BEHIND steps
+ * (e.g. because the process was suspended), the lost time is skipped. */
+static void simAdvance(SimFrame *f, double dt, bool animate, double now)
+{
+	if (now - f->due > SIM_MAX_STEPS_BEHIND * dt) {
+		f->due=now;
+	}
+	f->prev=f->cur;
+	simStep(&f->cur, dt, animate);
+	f->due += dt;
+}
+
+/* Interpolate the rotation for wall clock time "now". */
+static glm::quat simInterpolate(const SimFrame& f, double dt, double now)
+{
+	double alpha=(now - (f.due - dt)) / dt;
+	return glm::slerp(f.prev.rotation, f.cur.rotation, (float)glm::clamp(alpha, 0.0, 1.0));
+}
+
+/* Initialize the triple buffer with three copies of f. */
+static void handoffInit(SimHandoff *h, const SimFrame& f)
+{
+	h->slot[0]=h->slot[1]=h->slot[2]=f;
+	h->back=0;
+	h->middle=1;
+	h->front=2;
+}
+
+/* Producer: publish f as the newest frame. */
+static void handoffPublish(SimHandoff *h, const SimFrame& f)
+{
+	h->slot[h->back]=f;
+	h->back=h->middle.exchange(h->back | SIM_HANDOFF_NEW) & ~SIM_HANDOFF_NEW;
+}
+
+/* Consumer: get the newest published frame. */
+static const SimFrame& handoffAcquire(SimHandoff *h)
+{
+	if (h->middle.load() & SIM_HANDOFF_NEW) {
+		h->front=h->middle.exchange(h->front) & ~SIM_HANDOFF_NEW;
+	}
+	return h->slot[h->front];
+}
+
+/* The simulation thread: produce each state one time step before it is
+ * due, then sleep. */
+static void simThreadFunc(CubeApp *app)
+{
+	profilerThreadName("simulation");
+	while (!app->quit) {
+		{
+			PROFILE_ZONE("simulation step");
+			simAdvance(&app->sim, app->simStep, app->animate, glfwGetTime());
+			handoffPublish(&app->handoff, app->sim);
+		}
+		/* the next state is needed when the current one is due */
+		double wait=app->sim.due - glfwGetTime();
+		if (wait > 0.0) {
+			std::this_thread::sleep_for(std::chrono::duration<double>(wait));
+		}
+	}
+}
+
+/* Get the simulation state for the frame rendered at time "now" and
+ * apply it to the scene graph. In single-threaded mode, this runs the
+ * simulation steps which are due. */
+static void simApply(CubeApp *app, const AppConfig& cfg, double now)
+{
+	glm::quat rotation;
+
+	if (cfg.threaded) {
+		rotation=simInterpolate(handoffAcquire(&app->handoff), app->simStep, now);
+	} else {
+		while (app->sim.due <= now) {
+			simAdvance(&app->sim, app->simStep, app->animate, now);
+		}
+		rotation=simInterpolate(app->sim, app->simStep, now);
+	}
+
+	/* only touch the graph if something moved, so that a static scene
+	 * costs nothing */
+	if (rotation != app->renderedRotation) {
+		app->renderedRotation=rotation;
+		sceneGraphSetLocal(&app->scene.graph, app->scene.root, glm::mat4_cast(rotation));
+	}
+}
+
+/****************************************************************************
+ * LATENCY MEASUREMENT AND JUST-IN-TIME PACING                              *
+ ****************************************************************************/
+
+/* Key events are timestamped when GLFW hands them to us. The next frame
+ * is the one which shows their effect, and it counts as presented when
+ * its buffer swap returned and the GPU has finished it (the later of a
+ * GL_TIMESTAMP query converted to CPU time, or the swap). We also track
+ * the latency from the time a frame samples its input to its
+ * presentation, which is the lower bound for any input.
+ *
+ * Just-in-time pacing sleeps after the swap until shortly before the
+ * next vertical blank, minus the predicted frame cost, and only then
+ * samples the input, instead of sampling it right after the swap. */
+
+/* Synchronize the GPU and CPU clocks */
+static void latencyCalibrate(LatencyTracker *lt)
+{
+	GLint64 gpu=0;
+
+	if (lt->timerQuery) {
+		glGetInteger64v(GL_TIMESTAMP, &gpu);
+		lt->gpuOffset=glfwGetTime() - (double)gpu * 1.0e-9;
+	}
+}
+
+/* Initialize the tracker */
+static void initLatency(LatencyTracker *lt, const AppConfig& cfg, GLFWmonitor *monitor)
+{
+	const GLFWvidmode *mode;
+
+	lt->enabled=cfg.latency || cfg.jitPacing;
+	lt->pendingInput=0.0;
+	lt->frameInput=0.0;
+	lt->timerQuery=(GLAD_GL_VERSION_3_3 || GLAD_GL_ARB_timer_query);
+	lt->gpuOffset=0.0;
+	lt->jit=cfg.jitPacing;
+	lt->margin=cfg.jitMargin * 1.0e-3;
+	lt->frameStart=0.0;
+	lt->frameCost=0.0;
+	lt->lastSwap=0.0;
+
+	mode=glfwGetVideoMode((monitor)?monitor:glfwGetPrimaryMonitor());
+	lt->refresh=1.0 / ((mode && mode->refreshRate > 0)?(double)mode->refreshRate:60.0);
+
+	if (lt->enabled) {
+		if (lt->timerQuery) {
+			/* a frame without a free query falls back to the fence */
+			lt->freeQueries.resize(LATENCY_QUERIES);
+			glGenQueries(LATENCY_QUERIES, &lt->freeQueries[0]);
+		}
+		latencyCalibrate(lt);
+		info("latency measurement enabled, %s, refresh interval %.2fms%s",
+			(lt->timerQuery)?"using GL_TIMESTAMP queries":"using fences only",
+			lt->refresh * 1000.0, (lt->jit)?", just-in-time pacing":"");
+	}
+}
+
+/* Destroy the GL objects of frames still in flight */
+static void destroyLatency(LatencyTracker *lt)
+{
+	size_t i;
+
+	for (i=0; i<lt->inFlight.size(); i++) {
+		glDeleteSync(lt->inFlight[i].fence);
+		if (lt->inFlight[i].query) {
+			lt->freeQueries.push_back(lt->inFlight[i].query);
+		}
+	}
+	lt->inFlight.clear();
+	if (!lt->freeQueries.empty()) {
+		glDeleteQueries((GLsizei)lt->freeQueries.size(), &lt->freeQueries[0]);
+		lt->freeQueries.clear();
+	}
+}
+
+/* Record a key event, may be called from any thread */
+static void latencyInput(LatencyTracker *lt, double now)
+{
+	double expected=0.0;
+
+	if (lt->enabled) {
+		/* keep the earliest event not yet picked up by a frame */
+		lt->pendingInput.compare_exchange_strong(expected, now);
+	}
+}
+
+/* Pick up the key events the current frame shows, call this when the frame
+ * samples its input and time, so that later events count for the next
+ * frame */
+static void latencySample(LatencyTracker *lt)
+{
+	if (lt->enabled) {
+		lt->frameInput=lt->pendingInput.exchange(0.0);
+	}
+}
+
+/* Just-in-time pacing: wait until the latest point at which the next
+ * frame can still make the next vertical blank. */
+static void latencyPace(LatencyTracker *lt)
+{
+	if (lt->jit && lt->lastSwap > 0.0) {
+		double now=glfwGetTime();
+		double wait=lt->lastSwap + lt->refresh - lt->frameCost - lt->margin - now;
+		if (wait > 0.0) {
+			std::this_thread::sleep_for(std::chrono::duration<double>(wait));
+		}
+	}
+	lt->frameStart=glfwGetTime();
+}
+
+/* Called at the end of a frame, right after the buffer swap */
+static void latencyFrameEnd(LatencyTracker *lt, double sample)
+{
+	LatencyFrame f;
+	double now=glfwGetTime();
+
+	/* predict the frame cost from the work done before the swap, which
+	 * is everything except waiting for the swap itself */
+	if (lt->frameStart > 0.0) {
+		double cost=now - lt->frameStart;
+		if (cost > lt->refresh) {
+			cost=lt->refresh;
+		}
+		lt->frameCost=(lt->frameCost > 0.0)?(0.9 * lt->frameCost + 0.1 * cost):cost;
+	}
+	lt->lastSwap=now;
+	if (!lt->enabled) {
+		return;
+	}
+
+	f.sample=sample;
+	f.input=lt->frameInput;
+	f.swap=now;
+	f.query=0;
+	if (!lt->freeQueries.empty()) {
+		f.query=lt->freeQueries.back();
+		lt->freeQueries.pop_back();
+		glQueryCounter(f.query, GL_TIMESTAMP);
+	}
+	f.fence=glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	lt->inFlight.push_back(f);
+
+	/* collect the frames the GPU has finished, never blocks */
+	while (!lt->inFlight.empty()) {
+		LatencyFrame& front=lt->inFlight.front();
+		if (glClientWaitSync(front.fence, 0, 0) == GL_TIMEOUT_EXPIRED) {
+			break;
+		}
+		double done=glfwGetTime();
+		if (front.query) {
+			GLuint64 gpu=0;
+			glGetQueryObjectui64v(front.query, GL_QUERY_RESULT, &gpu);
+			done=(double)gpu * 1.0e-9 + lt->gpuOffset;
+			lt->freeQueries.push_back(front.query);
+		}
+		glDeleteSync(front.fence);
+		double presented=(done > front.swap)?done:front.swap;
+		lt->sampleLatency.push_back(1000.0 * (presented - front.sample));
+		if (front.input > 0.0) {
+			lt->keyLatency.push_back(1000.0 * (presented - front.input));
+		}
+		lt->inFlight.pop_front();
+	}
+}
+
+/* Get the p-th percentile (0..1) of sorted samples */
+static double percentile(const std::vector<double>& sorted, double p)
+{
+	size_t idx=(size_t)(p * (double)(sorted.size() - 1) + 0.5);
+	return sorted[idx];
+}
+
+/* Print latency percentiles for one set of samples and reset it */
+static void latencyReportSamples(std::vector<double>& samples, const char *what)
+{
+	if (samples.empty()) {
+		return;
+	}
+	std::sort(samples.begin(), samples.end());
+	info("%s latency: %u samples, p50 %.2fms, p90 %.2fms, p99 %.2fms, max %.2fms", what,
+		(unsigned)samples.size(), percentile(samples, 0.5), percentile(samples, 0.9),
+		percentile(samples, 0.99), samples.back());
+	samples.clear();
+}
+
+/* Print the latency statistics, called along with the fps statistics */
+static void latencyReport(LatencyTracker *lt)
+{
+	if (lt->enabled) {
+		latencyReportSamples(lt->sampleLatency, "sample-to-photon");
+		latencyReportSamples(lt->keyLatency, "input-to-photon");
+		/* the clocks may drift apart */
+		latencyCalibrate(lt);
+	}
+}
+
+/****************************************************************************
+ * FRAME PACING                                                             *
+ ****************************************************************************/
+
+/* With a target frame rate, the pacer aims at evenly spaced buffer swaps:
+ * it waits until the next swap time minus the predicted frame cost before
+ * starting a frame. Waiting is done with an absolute clock_nanosleep for
+ * the bulk of the time, and the last part, which covers the typical
+ * oversleeping of the OS scheduler, is spent busy waiting. */
+
+#define PACER_SPIN_MIN	0.0002	/* min. busy wait time in seconds */
+#define PACER_SPIN_MAX	0.002	/* max. busy wait time in seconds */
+
+/* Initialize the pacer */
+static void initPacer(FramePacer *fp, const AppConfig& cfg)
+{
+	fp->interval=(cfg.targetFps > 0.0)?(1.0 / cfg.targetFps):0.0;
+	fp->nextSwap=0.0;
+	fp->frameStart=0.0;
+	fp->frameCost=0.0;
+	fp->lastSwap=0.0;
+	fp->spin=PACER_SPIN_MAX;
+	if (fp->interval > 0.0) {
+		info("frame pacing: target %.1ffps (%.2fms/frame)", cfg.targetFps, fp->interval * 1000.0);
+	}
+}
+
+/* Sleep for "seconds" without busy waiting */
+static void pacerSleep(double seconds)
+{
+#ifdef WIN32
+	std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	long long ns=(long long)ts.tv_nsec + (long long)(seconds * 1.0e9);
+	ts.tv_sec += (time_t)(ns / 1000000000LL);
+	ts.tv_nsec=(long)(ns % 1000000000LL);
+	/* absolute deadline, so being interrupted by a signal doesn't matter */
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+#endif
+}
+
+/* Wait until the next frame should be started */
+static void pacerWait(FramePacer *fp)
+{
+	if (fp->interval > 0.0 && fp->nextSwap > 0.0) {
+		double start=fp->nextSwap - fp->frameCost;
+		double now=glfwGetTime();
+		double sleep=start - now - fp->spin;
+		if (sleep > 0.0) {
+			pacerSleep(sleep);
+			/* adapt the spin time to how much the sleep overshot */
+			double overshoot=glfwGetTime() - (now + sleep);
+			fp->spin=glm::clamp(0.9 * fp->spin + 0.1 * 2.0 * overshoot, PACER_SPIN_MIN, PACER_SPIN_MAX);
+		}
+		while (glfwGetTime() < start) {
+			/* spin */
+		}
+	}
+	fp->frameStart=glfwGetTime();
+}
+
+/* Called right after the buffer swap */
+static void pacerFrameEnd(FramePacer *fp)
+{
+	double now=glfwGetTime();
+
+	if (fp->interval <= 0.0) {
+		return;
+	}
+	if (fp->lastSwap > 0.0) {
+		fp->errors.push_back(1000.0 * fabs((now - fp->lastSwap) - fp->interval));
+	}
+	double cost=now - fp->frameStart;
+	fp->frameCost=(fp->frameCost > 0.0)?(0.9 * fp->frameCost + 0.1 * cost):cost;
+	if (fp->frameCost > fp->interval) {
+		fp->frameCost=fp->interval;
+	}
+	/* if we missed the deadline, don't try to catch up */
+	fp->nextSwap=(fp->nextSwap > 0.0 && now - fp->nextSwap < fp->interval)?(fp->nextSwap + fp->interval):(now + fp->interval);
+	fp->lastSwap=now;
+}
+
+/* Append the pacing error statistics since the last call to buf, and
+ * reset them */
+static void pacerReport(FramePacer *fp, char *buf, size_t size)
+{
+	double sum=0.0;
+	size_t i;
+
+	buf[0]=0;
+	if (fp->interval <= 0.0 || fp->errors.empty()) {
+		return;
+	}
+	for (i=0; i<fp->errors.size(); i++) {
+		sum += fp->errors[i];
+	}
+	std::sort(fp->errors.begin(), fp->errors.end());
+	mysnprintf(buf, size, ", pacing error: mean %.3fms, p99 %.3fms, max %.3fms",
+		sum / (double)fp->errors.size(), percentile(fp->errors, 0.99), fp->errors.back());
+	fp->errors.clear();
+}
+
+/****************************************************************************
+ * FRAMES IN FLIGHT                                                         *
+ ****************************************************************************/
+
+/* Without any control, the driver decides how many frames it queues up
+ * before glfwSwapBuffers blocks. With frames in flight enabled, we put a
+ * fence after every swap and wait for the fence of the frame count frames
+ * ago before starting a new one. One frame in flight means the CPU and GPU
+ * never overlap (lowest latency), three give the most throughput. */
+
+/* Initialize the frame queue */
+static void initFrameQueue(FrameQueue *fq, const AppConfig& cfg)
+{
+	int i;
+
+	fq->count=glm::clamp(cfg.framesInFlight, 0, MAX_FRAMES_IN_FLIGHT);
+	fq->slot=0;
+	fq->waitTime=0.0;
+	for (i=0; i<MAX_FRAMES_IN_FLIGHT; i++) {
+		fq->fence[i]=0;
+	}
+	if (fq->count) {
+		info("frames in flight: %d", fq->count);
+	}
+}
+
+/* Delete the remaining fences */
+static void destroyFrameQueue(FrameQueue *fq)
+{
+	int i;
+
+	for (i=0; i<MAX_FRAMES_IN_FLIGHT; i++) {
+		if (fq->fence[i]) {
+			glDeleteSync(fq->fence[i]);
+			fq->fence[i]=0;
+		}
+	}
+}
+
+/* Wait until the GPU finished the frame count frames ago. Call this before
+ * the frame polls the events and samples the time, so the wait doesn't
+ * make the frame show older state. */
+static void frameQueueBegin(FrameQueue *fq)
+{
+	GLsync fence=fq->fence[fq->slot];
+
+	if (!fence) {
+		return;
+	}
+	double start=glfwGetTime();
+	GLenum res;
+	/* flush, in case the swap didn't, otherwise we might wait forever */
+	do {
+		res=glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 100000000);
+	} while (res == GL_TIMEOUT_EXPIRED);
+	if (res == GL_WAIT_FAILED) {
+		warn("frames in flight: waiting for the fence failed");
+	}
+	glDeleteSync(fence);
+	fq->fence[fq->slot]=0;
+	fq->waitTime += glfwGetTime() - start;
+}
+
+/* Called right after the buffer swap */
+static void frameQueueEnd(FrameQueue *fq)
+{
+	if (fq->count) {
+		fq->fence[fq->slot]=glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		fq->slot=(fq->slot + 1) % fq->count;
+	}
+}
+
+/* Print the time spent waiting per frame since the last call */
+static void frameQueueReport(FrameQueue *fq, unsigned int frames)
+{
+	if (fq->count && frames) {
+		info("frames in flight: %d, waited %.3fms/frame for the GPU", fq->count, 1000.0 * fq->waitTime / (double)frames);
+	}
+	fq->waitTime=0.0;
+}
+
+/****************************************************************************
+ * RENDER TARGETS                                                           *
+ ****************************************************************************/
+
+/* Instead of the default framebuffer, the main window can render into an
+ * FBO with configurable formats and MSAA. Its size is a percentage of the
+ * window size, so that the fill rate can be tuned independently of the
+ * window. At the end of the frame, a multisampled target is resolved into
+ * a single-sampled one first, because glBlitFramebuffer can't resolve and
+ * scale at the same time, and the result is then scaled to the window. */
+
+#define RENDER_SCALE_MIN 50
+#define RENDER_SCALE_MAX 200
+
+typedef struct {
+	const char *name;
+	GLenum format;
+} FormatName;
+
+static const FormatName colorFormats[]={
+	{"rgba8", GL_RGBA8},
+	{"srgb8_alpha8", GL_SRGB8_ALPHA8},
+	{"rgb10_a2", GL_RGB10_A2},
+	{"r11f_g11f_b10f", GL_R11F_G11F_B10F},
+	{"rgba16f", GL_RGBA16F},
+	{"rgba32f", GL_RGBA32F},
+	{NULL, GL_NONE}
+};
+
+static const FormatName depthFormats[]={
+	{"depth16", GL_DEPTH_COMPONENT16},
+	{"depth24", GL_DEPTH_COMPONENT24},
+	{"depth32f", GL_DEPTH_COMPONENT32F},
+	{"depth24_stencil8", GL_DEPTH24_STENCIL8},
+	{"depth32f_stencil8", GL_DEPTH32F_STENCIL8},
+	{NULL, GL_NONE}
+};
+
+/* Look up a format by name, returns GL_NONE if it is unknown */
+static GLenum findFormat(const FormatName *formats, const char *name)
+{
+	for (; formats->name; formats++) {
+		if (!strcmp(formats->name, name)) {
+			return formats->format;
+		}
+	}
+	warn("unknown format '%s'", name);
+	return GL_NONE;
+}
+
+/* The attachment point for a depth format */
+static GLenum depthAttachment(GLenum format)
+{
+	if (format == GL_DEPTH24_STENCIL8 || format == GL_DEPTH32F_STENCIL8) {
+		return GL_DEPTH_STENCIL_ATTACHMENT;
+	}
+	return GL_DEPTH_ATTACHMENT;
+}
+
+/* Delete the GL objects of the render target */
+static void renderTargetRelease(RenderTarget *rt)
+{
+	if (rt->fbo) {
+		gpuMemUntrack(GPU_MEM_FRAMEBUFFERS, rt->rb[0]);
+		gpuMemUntrack(GPU_MEM_FRAMEBUFFERS, rt->rb[1]);
+		glDeleteFramebuffers(1, &rt->fbo);
+		glDeleteRenderbuffers(2, rt->rb);
+		rt->fbo=rt->rb[0]=rt->rb[1]=0;
+	}
+	if (rt->resolveFbo) {
+		gpuMemUntrack(GPU_MEM_FRAMEBUFFERS, rt->resolveRb);
+		glDeleteFramebuffers(1, &rt->resolveFbo);
+		glDeleteRenderbuffers(1, &rt->resolveRb);
+		rt->resolveFbo=rt->resolveRb=0;
+	}
+	rt->width=rt->height=0;
+}
+
+/* (Re-)create the render target for the given size.
+ * Returns false if the FBO is not complete. */
+static bool renderTargetCreate(RenderTarget *rt, int w, int h)
+{
+	GLenum status;
+
+	renderTargetRelease(rt);
+
+	glGenRenderbuffers(2, rt->rb);
+	glBindRenderbuffer(GL_RENDERBUFFER, rt->rb[0]);
+	glRenderbufferStorageMultisample(GL_RENDERBUFFER, rt->samples, rt->colorFormat, w, h);
+	gpuMemTrack(GPU_MEM_FRAMEBUFFERS, rt->rb[0], gpuMemRenderbufferBytes(w, h, rt->samples));
+	glBindRenderbuffer(GL_RENDERBUFFER, rt->rb[1]);
+	glRenderbufferStorageMultisample(GL_RENDERBUFFER, rt->samples, rt->depthFormat, w, h);
+	gpuMemTrack(GPU_MEM_FRAMEBUFFERS, rt->rb[1], gpuMemRenderbufferBytes(w, h, rt->samples));
+	glGenFramebuffers(1, &rt->fbo);
+	glBindFramebuffer(GL_FRAMEBUFFER, rt->fbo);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, rt->rb[0]);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, depthAttachment(rt->depthFormat), GL_RENDERBUFFER, rt->rb[1]);
+	status=glCheckFramebufferStatus(GL_FRAMEBUFFER);
+
+	if (status == GL_FRAMEBUFFER_COMPLETE && rt->samples) {
+		glGenRenderbuffers(1, &rt->resolveRb);
+		glBindRenderbuffer(GL_RENDERBUFFER, rt->resolveRb);
+		glRenderbufferStorage(GL_RENDERBUFFER, rt->colorFormat, w, h);
+		gpuMemTrack(GPU_MEM_FRAMEBUFFERS, rt->resolveRb, gpuMemRenderbufferBytes(w, h, 0));
+		glGenFramebuffers(1, &rt->resolveFbo);
+		glBindFramebuffer(GL_FRAMEBUFFER, rt->resolveFbo);
+		glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, rt->resolveRb);
+		status=glCheckFramebufferStatus(GL_FRAMEBUFFER);
+	}
+	glBindRenderbuffer(GL_RENDERBUFFER, 0);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+	if (status != GL_FRAMEBUFFER_COMPLETE) {
+		warn("render target %dx%d is incomplete: 0x%x", w, h, (unsigned)status);
+		renderTargetRelease(rt);
+		return false;
+	}
+	rt->width=w;
+	rt->height=h;
+	info("render target: %dx%d, %d samples", w, h, rt->samples);
+	return true;
+}
+
+/* Initialize the render target, it is created for the window size on the
+ * first frame */
+static void initRenderTarget(RenderTarget *rt, const AppConfig& cfg)
+{
+	GLint maxSamples=0;
+
+	rt->enabled=false;
+	rt->fbo=rt->rb[0]=rt->rb[1]=0;
+	rt->resolveFbo=rt->resolveRb=0;
+	rt->width=rt->height=0;
+	rt->renderWidth=rt->renderHeight=0;
+	if (!cfg.offscreen) {
+		return;
+	}
+
+	rt->colorFormat=findFormat(colorFormats, cfg.colorFormat);
+	rt->depthFormat=findFormat(depthFormats, cfg.depthFormat);
+	if (rt->colorFormat == GL_NONE || rt->depthFormat == GL_NONE) {
+		warn("offscreen rendering disabled");
+		return;
+	}
+	glGetIntegerv(GL_MAX_SAMPLES, &maxSamples);
+	rt->samples=glm::clamp(cfg.samples, 0, (int)maxSamples);
+	if (rt->samples != cfg.samples) {
+		warn("MSAA: %d samples requested, using %d", cfg.samples, rt->samples);
+	}
+	rt->scale=glm::clamp(cfg.renderScale, RENDER_SCALE_MIN, RENDER_SCALE_MAX);
+	rt->maxScale=rt->scale;
+	rt->enabled=true;
+	info("offscreen rendering: %s, %s, %d samples, scale %d%%", cfg.colorFormat, cfg.depthFormat, rt->samples, rt->scale);
+}
+
+/* Delete the render target */
+static void destroyRenderTarget(RenderTarget *rt)
+{
+	renderTargetRelease(rt);
+	rt->enabled=false;
+}
+
+/* Bind the render target for drawing, (re-)creating it if the window
+ * size changed. Falls back to the window if that fails.
+ * The target is allocated for the maximum scale, a lower scale only
+ * renders to a part of it, so that it can change every frame.
+ * Returns the size of the area to render to in w and h. */
+static void renderTargetBegin(RenderTarget *rt, int *w, int *h)
+{
+	if (!rt->enabled) {
+		return;
+	}
+	int tw=glm::max(*w * rt->maxScale / 100, 1);
+	int th=glm::max(*h * rt->maxScale / 100, 1);
+	if (tw != rt->width || th != rt->height) {
+		if (!renderTargetCreate(rt, tw, th)) {
+			warn("offscreen rendering disabled");
+			rt->enabled=false;
+			return;
+		}
+	}
+	rt->renderWidth=glm::clamp(*w * rt->scale / 100, 1, tw);
+	rt->renderHeight=glm::clamp(*h * rt->scale / 100, 1, th);
+	glBindFramebuffer(GL_FRAMEBUFFER, rt->fbo);
+	*w=rt->renderWidth;
+	*h=rt->renderHeight;
+}
+
+/* Resolve the render target and scale it to the window of size w x h */
+static void renderTargetEnd(RenderTarget *rt, int w, int h)
+{
+	if (!rt->enabled) {
+		return;
+	}
+	GLuint src=rt->fbo;
+	int rw=rt->renderWidth;
+	int rh=rt->renderHeight;
+	if (rt->samples) {
+		glBindFramebuffer(GL_READ_FRAMEBUFFER, rt->fbo);
+		glBindFramebuffer(GL_DRAW_FRAMEBUFFER, rt->resolveFbo);
+		glBlitFramebuffer(0, 0, rw, rh, 0, 0, rw, rh, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+		src=rt->resolveFbo;
+	}
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, src);
+	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+	glBlitFramebuffer(0, 0, rw, rh, 0, 0, w, h, GL_COLOR_BUFFER_BIT,
+		(rw == w && rh == h)?GL_NEAREST:GL_LINEAR);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+/****************************************************************************
+ * DYNAMIC RESOLUTION                                                       *
+ ****************************************************************************/
+
+/* The controller measures the GPU time of every frame with GL_TIME_ELAPSED
+ * queries, which are read back a few frames later without stalling. Since
+ * the cost of a fill-bound frame is roughly proportional to the number of
+ * pixels, the scale which would meet the budget is the current one times
+ * the square root of budget / GPU time. We only move part of the way there
+ * each frame, because the measurements lag behind. */
+
+#define RESOLUTION_GAIN 0.2	/* fraction of the way to go per frame */
+
+/* Initialize the controller, it needs the render target to be enabled.
+ * The render target is then allocated for the maximum scale, the
+ * --render-scale is only where the controller starts. */
+static void initResolution(ResolutionController *rc, RenderTarget *rt, const AppConfig& cfg)
+{
+	int i;
+
+	rc->enabled=false;
+	if (cfg.resolutionBudget <= 0.0 || !rt->enabled) {
+		return;
+	}
+	if (!GLAD_GL_VERSION_3_3 && !GLAD_GL_ARB_timer_query) {
+		warn("dynamic resolution: timer queries are not supported");
+		return;
+	}
+	glGenQueries(RESOLUTION_QUERIES, rc->query);
+	for (i=0; i<RESOLUTION_QUERIES; i++) {
+		rc->pending[i]=false;
+	}
+	rc->next=0;
+	rc->active=false;
+	rt->maxScale=glm::clamp(cfg.maxRenderScale, RENDER_SCALE_MIN, RENDER_SCALE_MAX);
+	rt->scale=glm::min(rt->scale, rt->maxScale);
+	rc->budget=cfg.resolutionBudget;
+	rc->gpuTime=0.0;
+	rc->scale=(double)rt->scale;
+	rc->enabled=true;
+	info("dynamic resolution: GPU budget %.2fms, scale %d%% to %d%%, starting at %d%%",
+		rc->budget, RENDER_SCALE_MIN, rt->maxScale, rt->scale);
+}
+
+/* Delete the queries */
+static void destroyResolution(ResolutionController *rc)
+{
+	if (rc->enabled) {
+		glDeleteQueries(RESOLUTION_QUERIES, rc->query);
+		rc->enabled=false;
+	}
+}
+
+/* Read back the finished queries and adjust the scale of the render target
+ * for the next frame */
+static void resolutionUpdate(ResolutionController *rc, RenderTarget *rt)
+{
+	unsigned int i;
+	bool updated=false;
+
+	if (!rc->enabled || !rt->enabled) {
+		return;
+	}
+	/* the oldest query is the one we will use next */
+	for (i=0; i<RESOLUTION_QUERIES; i++) {
+		unsigned int q=(rc->next + i) % RESOLUTION_QUERIES;
+		GLint available=0;
+		GLuint64 ns;
+
+		if (!rc->pending[q]) {
+			continue;
+		}
+		glGetQueryObjectiv(rc->query[q], GL_QUERY_RESULT_AVAILABLE, &available);
+		if (!available) {
+			break;
+		}
+		glGetQueryObjectui64v(rc->query[q], GL_QUERY_RESULT, &ns);
+		rc->pending[q]=false;
+		double ms=(double)ns / 1.0e6;
+		rc->gpuTime=(rc->gpuTime > 0.0)?(0.8 * rc->gpuTime + 0.2 * ms):ms;
+		updated=true;
+	}
+
+	if (updated && rc->gpuTime > 0.0) {
+		double target=rc->scale * sqrt(rc->budget / rc->gpuTime);
+		rc->scale += RESOLUTION_GAIN * (target - rc->scale);
+		rc->scale=glm::clamp(rc->scale, (double)RENDER_SCALE_MIN, (double)rt->maxScale);
+		rt->scale=(int)(rc->scale + 0.5);
+	}
+}
+
+/* Start measuring the GPU time of the frame */
+static void resolutionBegin(ResolutionController *rc)
+{
+	rc->active=false;
+	if (rc->enabled && !rc->pending[rc->next]) {
+		glBeginQuery(GL_TIME_ELAPSED, rc->query[rc->next]);
+		rc->active=true;
+	}
+}
+
+/* Stop measuring the GPU time of the frame */
+static void resolutionEnd(ResolutionController *rc)
+{
+	if (rc->active) {
+		glEndQuery(GL_TIME_ELAPSED);
+		rc->pending[rc->next]=true;
+		rc->next=(rc->next + 1) % RESOLUTION_QUERIES;
+		rc->active=false;
+	}
+}
+
+/* Print the current state of the controller */
+static void resolutionReport(const ResolutionController *rc, const RenderTarget& rt)
+{
+	if (rc->enabled) {
+		info("dynamic resolution: GPU %.2fms/frame (budget %.2fms), scale %d%% (%dx%d)",
+			rc->gpuTime, rc->budget, rt.scale, rt.renderWidth, rt.renderHeight);
+	}
+}
+
+/****************************************************************************
+ * PERFORMANCE COUNTERS                                                     *
+ ****************************************************************************/
+
+/* Counters are sampled separately for each render pass. If the driver
+ * exposes GL_AMD_performance_monitor or GL_INTEL_performance_query, we
+ * select the hardware counters whose names contain one of the words of the
+ * filter, e.g. primitives, fragments or shader cycles. Otherwise, we fall
+ * back to the pipeline statistics of GL_ARB_pipeline_statistics_query,
+ * which even llvmpipe has. Comparing the vertex and fragment work tells
+ * whether a shader is vertex- or fragment-bound. Like the timer queries,
+ * the results are read back a few frames later without stalling. */
+
+static const char *perfPassNames[PERF_PASS_COUNT]={"scene", "resolve"};
+
+static const struct {
+	GLenum target;
+	const char *name;
+} perfPipelineCounters[]={
+	{GL_VERTICES_SUBMITTED_ARB, "vertices submitted"},
+	{GL_PRIMITIVES_SUBMITTED_ARB, "primitives submitted"},
+	{GL_VERTEX_SHADER_INVOCATIONS_ARB, "vertex shader invocations"},
+	{GL_CLIPPING_OUTPUT_PRIMITIVES_ARB, "clipping output primitives"},
+	{GL_FRAGMENT_SHADER_INVOCATIONS_ARB, "fragment shader invocations"}
+};
+
+/* Check if name contains one of the comma-separated words in filter,
+ * ignoring the case */
+static bool perfMatch(const char *name, const char *filter)
+{
+	while (*filter) {
+		size_t len=strcspn(filter, ",");
+		const char *s;
+
+		for (s=name; len && *s; s++) {
+			size_t k=0;
+			while (k < len && s[k] && tolower((unsigned char)s[k]) == tolower((unsigned char)filter[k])) {
+				k++;
+			}
+			if (k == len) {
+				return true;
+			}
+		}
+		filter += len;
+		if (*filter == ',') {
+			filter++;
+		}
+	}
+	return false;
+}
+
+static bool perfAddCounter(PerfCounters *pc, const char *name, GLuint group, GLuint id, GLenum type)
+{
+	if (pc->counterCount >= PERF_MAX_COUNTERS) {
+		return false;
+	}
+	PerfCounter& c=pc->counter[pc->counterCount++];
+	mysnprintf(c.name, sizeof(c.name), "%s", name);
+	c.group=group;
+	c.id=id;
+	c.type=type;
+	for (int p=0; p<PERF_PASS_COUNT; p++) {
+		c.sum[p]=0.0;
+	}
+	return true;
+}
+
+/* Select the AMD counters, at most as many per group as can be active */
+static void perfSelectAMD(PerfCounters *pc, const char *filter)
+{
+	GLint groupCount=0;
+	GLint count, maxActive;
+	size_t g, i;
+
+	glGetPerfMonitorGroupsAMD(&groupCount, 0, NULL);
+	if (groupCount <= 0) {
+		return;
+	}
+	std::vector<GLuint> groups(groupCount);
+	glGetPerfMonitorGroupsAMD(&groupCount, groupCount, groups.data());
+	for (g=0; g<groups.size(); g++) {
+		glGetPerfMonitorCountersAMD(groups[g], &count, &maxActive, 0, NULL);
+		if (count <= 0) {
+			continue;
+		}
+		std::vector<GLuint> ids(count);
+		glGetPerfMonitorCountersAMD(groups[g], &count, &maxActive, count, ids.data());
+		GLint active=0;
+		for (i=0; i<ids.size() && active < maxActive; i++) {
+			char name[PERF_NAME_LEN];
+			GLuint type=GL_UNSIGNED_INT;
+
+			name[0]=0;
+			glGetPerfMonitorCounterStringAMD(groups[g], ids[i], sizeof(name), NULL, name);
+			if (!perfMatch(name, filter)) {
+				continue;
+			}
+			glGetPerfMonitorCounterInfoAMD(groups[g], ids[i], GL_COUNTER_TYPE_AMD, &type);
+			if (!perfAddCounter(pc, name, groups[g], ids[i], type)) {
+				return;
+			}
+			active++;
+		}
+	}
+}
+
+/* Count the counters of an INTEL query which match the filter, and add
+ * them if requested */
+static unsigned int perfScanIntel(PerfCounters *pc, GLuint query, const char *filter, bool add)
+{
+	char name[PERF_NAME_LEN];
+	char desc[256];
+	GLuint dataSize=0, counters=0, instances=0, caps=0;
+	unsigned int matches=0;
+	GLuint i;
+
+	glGetPerfQueryInfoINTEL(query, sizeof(name), name, &dataSize, &counters, &instances, &caps);
+	if (add) {
+		pc->data.resize(dataSize);
+	}
+	/* counter ids start at 1 */
+	for (i=1; i<=counters; i++) {
+		GLuint offset=0, size=0, type=0, dataType=0;
+		GLuint64 maxValue=0;
+
+		name[0]=0;
+		glGetPerfCounterInfoINTEL(query, i, sizeof(name), name, sizeof(desc), desc,
+			&offset, &size, &type, &dataType, &maxValue);
+		if (!perfMatch(name, filter) || offset + size > dataSize) {
+			continue;
+		}
+		if (add && !perfAddCounter(pc, name, 0, offset, dataType)) {
+			break;
+		}
+		matches++;
+	}
+	return matches;
+}
+
+/* Use the INTEL query with the most matching counters */
+static void perfSelectIntel(PerfCounters *pc, const char *filter)
+{
+	GLuint query=0;
+	unsigned int bestMatches=0;
+
+	pc->intelQuery=0;
+	glGetFirstPerfQueryIdINTEL(&query);
+	while (query) {
+		unsigned int matches=perfScanIntel(pc, query, filter, false);
+		if (matches > bestMatches) {
+			bestMatches=matches;
+			pc->intelQuery=query;
+		}
+		GLuint next=0;
+		glGetNextPerfQueryIdINTEL(query, &next);
+		query=next;
+	}
+	if (pc->intelQuery) {
+		perfScanIntel(pc, pc->intelQuery, filter, true);
+	}
+}
+
+static const char *perfBackendName(PerfBackend backend)
+{
+	switch (backend) {
+		case PERF_AMD:
+			return "GL_AMD_performance_monitor";
+		case PERF_INTEL:
+			return "GL_INTEL_performance_query";
+		case PERF_PIPELINE:
+			return "GL_ARB_pipeline_statistics_query";
+		default:
+			return "none";
+	}
+}
+
+/* Select the counters and create the monitors or queries */
+static void initPerfCounters(PerfCounters *pc, const AppConfig& cfg)
+{
+	unsigned int f, i;
+	int p;
+
+	pc->backend=PERF_NONE;
+	pc->counterCount=0;
+	pc->next=0;
+	pc->samples=0;
+	if (!cfg.counters) {
+		return;
+	}
+	if (GLAD_GL_AMD_performance_monitor) {
+		perfSelectAMD(pc, cfg.counterFilter);
+		if (pc->counterCount) {
+			pc->backend=PERF_AMD;
+		}
+	}
+	if (!pc->counterCount && GLAD_GL_INTEL_performance_query) {
+		perfSelectIntel(pc, cfg.counterFilter);
+		if (pc->counterCount) {
+			pc->backend=PERF_INTEL;
+		}
+	}
+	if (!pc->counterCount && GLAD_GL_ARB_pipeline_statistics_query) {
+		for (i=0; i<sizeof(perfPipelineCounters)/sizeof(perfPipelineCounters[0]); i++) {
+			perfAddCounter(pc, perfPipelineCounters[i].name, 0, perfPipelineCounters[i].target, GL_UNSIGNED_INT);
+		}
+		pc->backend=PERF_PIPELINE;
+	}
+	if (pc->backend == PERF_NONE) {
+		warn("performance counters: not supported");
+		return;
+	}
+
+	for (f=0; f<PERF_FRAMES; f++) {
+		for (p=0; p<PERF_PASS_COUNT; p++) {
+			GLuint *obj=pc->object[f][p];
+			switch (pc->backend) {
+				case PERF_AMD:
+					glGenPerfMonitorsAMD(1, obj);
+					for (i=0; i<pc->counterCount; i++) {
+						glSelectPerfMonitorCountersAMD(obj[0], GL_TRUE, pc->counter[i].group, 1, &pc->counter[i].id);
+					}
+					break;
+				case PERF_INTEL:
+					glCreatePerfQueryINTEL(pc->intelQuery, obj);
+					break;
+				default:
+					glGenQueries(pc->counterCount, obj);
+			}
+		}
+		pc->pending[f]=false;
+	}
+	info("performance counters: %u counters via %s", pc->counterCount, perfBackendName(pc->backend));
+}
+
+/* Delete the monitors or queries */
+static void destroyPerfCounters(PerfCounters *pc)
+{
+	unsigned int f;
+	int p;
+
+	if (pc->backend == PERF_NONE) {
+		return;
+	}
+	for (f=0; f<PERF_FRAMES; f++) {
+		for (p=0; p<PERF_PASS_COUNT; p++) {
+			GLuint *obj=pc->object[f][p];
+			switch (pc->backend) {
+				case PERF_AMD:
+					glDeletePerfMonitorsAMD(1, obj);
+					break;
+				case PERF_INTEL:
+					glDeletePerfQueryINTEL(obj[0]);
+					break;
+				default:
+					glDeleteQueries(pc->counterCount, obj);
+			}
+		}
+	}
+	pc->backend=PERF_NONE;
+}
+
+/* Decode a single value of a raw AMD or INTEL result, and return its size */
+static size_t perfDecode(const unsigned char *data, GLenum type, double *value)
+{
+	switch (type) {
+		case GL_UNSIGNED_INT64_AMD:
+		case GL_PERFQUERY_COUNTER_DATA_UINT64_INTEL:
+			{
+				uint64_t v;
+				memcpy(&v, data, sizeof(v));
+				*value=(double)v;
+				return sizeof(v);
+			}
+		case GL_FLOAT:
+		case GL_PERCENTAGE_AMD:
+		case GL_PERFQUERY_COUNTER_DATA_FLOAT_INTEL:
+			{
+				float v;
+				memcpy(&v, data, sizeof(v));
+				*value=(double)v;
+				return sizeof(v);
+			}
+		case GL_PERFQUERY_COUNTER_DATA_DOUBLE_INTEL:
+			memcpy(value, data, sizeof(*value));
+			return sizeof(*value);
+		default:
+			{
+				uint32_t v;
+				memcpy(&v, data, sizeof(v));
+				*value=(double)v;
+				return sizeof(v);
+			}
+	}
+}
+
+/* Read the results of one pass, returns false if they aren't available yet */
+static bool perfReadPass(PerfCounters *pc, const GLuint *obj, double *values)
+{
+	unsigned int i;
+
+	for (i=0; i<pc->counterCount; i++) {
+		values[i]=0.0;
+	}
+	if (pc->backend == PERF_AMD) {
+		GLuint available=0;
+		GLuint size=0;
+		GLint written=0;
+		GLint pos=0;
+
+		glGetPerfMonitorCounterDataAMD(obj[0], GL_PERFMON_RESULT_AVAILABLE_AMD, sizeof(available), &available, NULL);
+		if (!available) {
+			return false;
+		}
+		glGetPerfMonitorCounterDataAMD(obj[0], GL_PERFMON_RESULT_SIZE_AMD, sizeof(size), &size, NULL);
+		if (pc->data.size() < size) {
+			pc->data.resize(size);
+		}
+		glGetPerfMonitorCounterDataAMD(obj[0], GL_PERFMON_RESULT_AMD, (GLsizei)size, (GLuint*)pc->data.data(), &written);
+		/* the result is a sequence of group, counter, value */
+		while (pos + 2 * (GLint)sizeof(GLuint) <= written) {
+			GLuint id[2];
+			memcpy(id, &pc->data[pos], sizeof(id));
+			pos += sizeof(id);
+			for (i=0; i<pc->counterCount; i++) {
+				if (pc->counter[i].group == id[0] && pc->counter[i].id == id[1]) {
+					break;
+				}
+			}
+			if (i >= pc->counterCount) {
+				break;
+			}
+			pos += (GLint)perfDecode(&pc->data[pos], pc->counter[i].type, &values[i]);
+		}
+	} else if (pc->backend == PERF_INTEL) {
+		GLuint written=0;
+
+		glGetPerfQueryDataINTEL(obj[0], GL_PERFQUERY_DONOT_FLUSH_INTEL, (GLsizei)pc->data.size(), pc->data.data(), &written);
+		if (!written) {
+			return false;
+		}
+		for (i=0; i<pc->counterCount; i++) {
+			perfDecode(&pc->data[pc->counter[i].id], pc->counter[i].type, &values[i]);
+		}
+	} else {
+		for (i=0; i<pc->counterCount; i++) {
+			GLint available=0;
+			GLuint v=0;
+
+			glGetQueryObjectiv(obj[i], GL_QUERY_RESULT_AVAILABLE, &available);
+			if (!available) {
+				return false;
+			}
+			glGetQueryObjectuiv(obj[i], GL_QUERY_RESULT, &v);
+			values[i]=(double)v;
+		}
+	}
+	return true;
+}
+
+/* Read back the finished frames, call this before perfBegin */
+static void perfFrameBegin(PerfCounters *pc)
+{
+	double values[PERF_PASS_COUNT][PERF_MAX_COUNTERS];
+	unsigned int i, j;
+	int p;
+
+	if (pc->backend == PERF_NONE) {
+		return;
+	}
+	/* the oldest frame is the one we will use next */
+	for (i=0; i<PERF_FRAMES; i++) {
+		unsigned int f=(pc->next + i) % PERF_FRAMES;
+		if (!pc->pending[f]) {
+			continue;
+		}
+		for (p=0; p<PERF_PASS_COUNT; p++) {
+			if (!perfReadPass(pc, pc->object[f][p], values[p])) {
+				break;
+			}
+		}
+		if (p < PERF_PASS_COUNT) {
+			break;
+		}
+		for (j=0; j<pc->counterCount; j++) {
+			for (p=0; p<PERF_PASS_COUNT; p++) {
+				pc->counter[j].sum[p] += values[p][j];
+			}
+		}
+		pc->pending[f]=false;
+		pc->samples++;
+	}
+	/* if the GPU is that far behind, we drop the oldest result */
+	pc->pending[pc->next]=false;
+}
+
+/* Start measuring a render pass */
+static void perfBegin(PerfCounters *pc, PerfPass pass)
+{
+	const GLuint *obj=pc->object[pc->next][pass];
+	unsigned int i;
+
+	switch (pc->backend) {
+		case PERF_AMD:
+			glBeginPerfMonitorAMD(obj[0]);
+			break;
+		case PERF_INTEL:
+			glBeginPerfQueryINTEL(obj[0]);
+			break;
+		case PERF_PIPELINE:
+			for (i=0; i<pc->counterCount; i++) {
+				glBeginQuery(pc->counter[i].id, obj[i]);
+			}
+			break;
+		case PERF_NONE:
+			break;
+	}
+}
+
+/* Stop measuring a render pass */
+static void perfEnd(PerfCounters *pc, PerfPass pass)
+{
+	const GLuint *obj=pc->object[pc->next][pass];
+	unsigned int i;
+
+	switch (pc->backend) {
+		case PERF_AMD:
+			glEndPerfMonitorAMD(obj[0]);
+			break;
+		case PERF_INTEL:
+			glEndPerfQueryINTEL(obj[0]);
+			break;
+		case PERF_PIPELINE:
+			for (i=0; i<pc->counterCount; i++) {
+				glEndQuery(pc->counter[i].id);
+			}
+			break;
+		case PERF_NONE:
+			break;
+	}
+}
+
+/* Called after the last pass of the frame */
+static void perfFrameEnd(PerfCounters *pc)
+{
+	if (pc->backend != PERF_NONE) {
+		pc->pending[pc->next]=true;
+		pc->next=(pc->next + 1) % PERF_FRAMES;
+	}
+}
+
+/* Print the average counter values per frame since the last call */
+static void perfReport(PerfCounters *pc)
+{
+	char line[256];
+	unsigned int i;
+	int p, len;
+
+	if (pc->backend == PERF_NONE || !pc->samples) {
+		return;
+	}
+	len=mysnprintf(line, sizeof(line), "  %-40s", "");
+	for (p=0; p<PERF_PASS_COUNT && len < (int)sizeof(line); p++) {
+		len += mysnprintf(line + len, sizeof(line) - len, " %14s", perfPassNames[p]);
+	}
+	info("performance counters (%s), per frame:", perfBackendName(pc->backend));
+	info("%s", line);
+	for (i=0; i<pc->counterCount; i++) {
+		PerfCounter& c=pc->counter[i];
+		len=mysnprintf(line, sizeof(line), "  %-40s", c.name);
+		for (p=0; p<PERF_PASS_COUNT && len < (int)sizeof(line); p++) {
+			len += mysnprintf(line + len, sizeof(line) - len, " %14.1f", c.sum[p] / (double)pc->samples);
+			c.sum[p]=0.0;
+		}
+		info("%s", line);
+	}
+	pc->samples=0;
+}
+
+/****************************************************************************
+ * DRAW STATISTICS                                                          *
+ ****************************************************************************/
+
+/* Every draw call of the scene in the main window is wrapped in queries
+ * for the samples passed and the primitives generated, and with
+ * GL_ARB_pipeline_statistics_query also for the vertex and fragment shader
+ * invocations. This shows how much work each stage does, e.g. how many
+ * fragments the "cut" shader discards. To bound the number of queries, the
+ * last set of queries covers all remaining draws. The results are read
+ * back a few frames later without stalling. */
+
+static const GLenum drawStatTargets[DRAW_STAT_COUNT]={
+	GL_SAMPLES_PASSED,
+	GL_PRIMITIVES_GENERATED,
+	GL_VERTEX_SHADER_INVOCATIONS_ARB,
+	GL_FRAGMENT_SHADER_INVOCATIONS_ARB
+};
+
+static const char *drawStatNames[DRAW_STAT_COUNT]={"samples", "prims", "VS", "FS"};
+
+/* the order in which we print them, along the pipeline */
+static const int drawStatOrder[DRAW_STAT_COUNT]={
+	DRAW_STAT_VERTICES,
+	DRAW_STAT_PRIMITIVES,
+	DRAW_STAT_FRAGMENTS,
+	DRAW_STAT_SAMPLES
+};
+
+/* Create the queries. The pipeline statistics can't be used if the
+ * performance counters already query them per pass. */
+static void initDrawStats(DrawStats *ds, const AppConfig& cfg, const PerfCounters& pc)
+{
+	unsigned int f, d, s;
+
+	ds->enabled=false;
+	if (!cfg.drawStats) {
+		return;
+	}
+	ds->statCount=DRAW_STAT_COUNT;
+	if (!GLAD_GL_ARB_pipeline_statistics_query) {
+		info("draw statistics: GL_ARB_pipeline_statistics_query not supported");
+		ds->statCount=DRAW_STAT_VERTICES;
+	} else if (pc.backend == PERF_PIPELINE) {
+		info("draw statistics: pipeline statistics are used by the performance counters");
+		ds->statCount=DRAW_STAT_VERTICES;
+	}
+	for (f=0; f<DRAW_STATS_FRAMES; f++) {
+		for (d=0; d<DRAW_STATS_MAX_DRAWS; d++) {
+			glGenQueries(ds->statCount, ds->query[f][d]);
+		}
+		ds->pending[f]=false;
+	}
+	for (d=0; d<DRAW_STATS_MAX_DRAWS; d++) {
+		for (s=0; s<DRAW_STAT_COUNT; s++) {
+			ds->sum[d][s]=0.0;
+		}
+	}
+	ds->next=0;
+	ds->drawCount=0;
+	ds->samples=0;
+	ds->enabled=true;
+}
+
+/* Delete the queries */
+static void destroyDrawStats(DrawStats *ds)
+{
+	unsigned int f, d;
+
+	if (ds->enabled) {
+		for (f=0; f<DRAW_STATS_FRAMES; f++) {
+			for (d=0; d<DRAW_STATS_MAX_DRAWS; d++) {
+				glDeleteQueries(ds->statCount, ds->query[f][d]);
+			}
+		}
+		ds->enabled=false;
+	}
+}
+
+/* Read back the finished frames, call this before the first draw */
+static void drawStatsFrameBegin(DrawStats *ds)
+{
+	unsigned int i, d, s;
+
+	if (!ds->enabled) {
+		return;
+	}
+	/* the oldest frame is the one we will use next */
+	for (i=0; i<DRAW_STATS_FRAMES; i++) {
+		unsigned int f=(ds->next + i) % DRAW_STATS_FRAMES;
+		bool available=true;
+
+		if (!ds->pending[f]) {
+			continue;
+		}
+		for (d=0; d<ds->draws[f] && available; d++) {
+			for (s=0; s<(unsigned)ds->statCount && available; s++) {
+				GLint a=0;
+				glGetQueryObjectiv(ds->query[f][d][s], GL_QUERY_RESULT_AVAILABLE, &a);
+				available=(a != 0);
+			}
+		}
+		if (!available) {
+			break;
+		}
+		for (d=0; d<ds->draws[f]; d++) {
+			for (s=0; s<(unsigned)ds->statCount; s++) {
+				GLuint v=0;
+				glGetQueryObjectuiv(ds->query[f][d][s], GL_QUERY_RESULT, &v);
+				ds->sum[d][s] += (double)v;
+			}
+		}
+		ds->drawCount=ds->drawTotal[f];
+		ds->pending[f]=false;
+		ds->samples++;
+	}
+	/* if the GPU is that far behind, we drop the oldest result */
+	ds->pending[ds->next]=false;
+}
+
+/* Start the queries for a draw call */
+static void drawStatsBegin(DrawStats *ds, size_t draw)
+{
+	int s;
+
+	if (!ds || !ds->enabled || draw >= DRAW_STATS_MAX_DRAWS) {
+		return;
+	}
+	for (s=0; s<ds->statCount; s++) {
+		glBeginQuery(drawStatTargets[s], ds->query[ds->next][draw][s]);
+	}
+}
+
+/* Stop the queries after a draw call, count is the number of draws this
+ * frame */
+static void drawStatsEnd(DrawStats *ds, size_t draw, size_t count)
+{
+	int s;
+
+	if (!ds || !ds->enabled) {
+		return;
+	}
+	/* the last queries cover all remaining draws */
+	if (draw < DRAW_STATS_MAX_DRAWS - 1 || (draw + 1 == count)) {
+		for (s=0; s<ds->statCount; s++) {
+			glEndQuery(drawStatTargets[s]);
+		}
+	}
+}
+
+/* Called after the scene was drawn with count draws */
+static void drawStatsFrameEnd(DrawStats *ds, size_t count)
+{
+	if (ds->enabled) {
+		ds->draws[ds->next]=(unsigned)std::min(count, (size_t)DRAW_STATS_MAX_DRAWS);
+		ds->drawTotal[ds->next]=(unsigned)count;
+		ds->pending[ds->next]=true;
+		ds->next=(ds->next + 1) % DRAW_STATS_FRAMES;
+	}
+}
+
+/* Format the values of one draw, or the total if draw is negative */
+static void drawStatsFormat(const DrawStats *ds, int draw, char *buf, size_t size)
+{
+	double v[DRAW_STAT_COUNT];
+	unsigned int d, s;
+	int i, len=0;
+
+	for (s=0; s<DRAW_STAT_COUNT; s++) {
+		v[s]=0.0;
+		for (d=0; d<DRAW_STATS_MAX_DRAWS; d++) {
+			if (draw < 0 || (unsigned)draw == d) {
+				v[s] += ds->sum[d][s] / (double)ds->samples;
+			}
+		}
+	}
+	buf[0]=0;
+	for (i=0; i<DRAW_STAT_COUNT && len < (int)size; i++) {
+		s=drawStatOrder[i];
+		if ((int)s < ds->statCount) {
+			len += mysnprintf(buf + len, size - len, " %s: %.0f", drawStatNames[s], v[s]);
+		}
+	}
+}
+
+/* Print the statistics per frame since the last call, and keep the totals
+ * for the window title and the HUD in the summary */
+static void drawStatsReport(DrawStats *ds)
+{
+	char line[256];
+	unsigned int d, s;
+	unsigned int draws;
+
+	if (!ds->enabled || !ds->samples) {
+		return;
+	}
+	drawStatsFormat(ds, -1, line, sizeof(line));
+	info("draw statistics per frame: %u draws,%s", ds->drawCount, line);
+	if (ds->statCount > DRAW_STAT_FRAGMENTS) {
+		double fs=0.0, samples=0.0;
+		for (d=0; d<DRAW_STATS_MAX_DRAWS; d++) {
+			fs += ds->sum[d][DRAW_STAT_FRAGMENTS];
+			samples += ds->sum[d][DRAW_STAT_SAMPLES];
+		}
+		if (fs > 0.0) {
+			info("  %.3f samples passed per fragment shader invocation", samples / fs);
+		}
+	}
+	/* only the first few draws, never the combined last queries */
+	draws=std::min(ds->drawCount, (unsigned)DRAW_STATS_PRINT);
+	for (d=0; d<draws; d++) {
+		drawStatsFormat(ds, (int)d, line, sizeof(line));
+		info("  draw %u:%s", d, line);
+	}
+	drawStatsFormat(ds, -1, ds->summary, sizeof(ds->summary));
+	for (d=0; d<DRAW_STATS_MAX_DRAWS; d++) {
+		for (s=0; s<DRAW_STAT_COUNT; s++) {
+			ds->sum[d][s]=0.0;
+		}
+	}
+	ds->samples=0;
+}
+
+/****************************************************************************
+ * HEADS-UP DISPLAY                                                         *
+ ****************************************************************************/
+
+/* The HUD shows the frame time graph and some counters in the main window.
+ * Everything is a textured quad: the glyphs of a baked 5x7 bitmap font,
+ * and rectangles, which use a solid cell of the atlas. The quads are
+ * built on the CPU every frame, streamed into a ring of buffer segments
+ * which are guarded by fences, and drawn with a single instanced draw
+ * call. The HUD is drawn at the window resolution, after the frame was
+ * captured. */
+
+#define HUD_GLYPH_W 5
+#define HUD_GLYPH_H 7
+#define HUD_GLYPHS 95			/* ASCII 32 to 126 */
+#define HUD_CELL 8			/* size of a cell in the atlas */
+#define HUD_ATLAS_COLUMNS 16
+#define HUD_ATLAS_ROWS 6		/* the glyphs and the solid cell */
+#define HUD_ADVANCE ((HUD_GLYPH_W + 1) * HUD_SCALE)
+#define HUD_LINE ((HUD_GLYPH_H + 3) * HUD_SCALE)
+#define HUD_MARGIN 10
+#define HUD_GRAPH_MS 2.0f		/* pixels per ms in the graph */
+#define HUD_GRAPH_MAX 50.0f		/* ms at the top of the graph */
+
+/* one row per glyph, the MSB of the 5 bits is the leftmost pixel */
+static const GLubyte hudFont[HUD_GLYPHS][HUD_GLYPH_H]={
+	{0x00,0x00,0x00,0x00,0x00,0x00,0x00},	/* ' ' */
+	{0x04,0x04,0x04,0x04,0x04,0x00,0x04},	/* '!' */
+	{0x0a,0x0a,0x0a,0x00,0x00,0x00,0x00},	/* '"' */
+	{0x0a,0x0a,0x1f,0x0a,0x1f,0x0a,0x0a},	/* '#' */
+	{0x04,0x0f,0x14,0x0e,0x05,0x1e,0x04},	/* '$' */
+	{0x18,0x19,0x02,0x04,0x08,0x13,0x03},	/* '%' */
+	{0x0c,0x12,0x14,0x08,0x15,0x12,0x0d},	/* '&' */
+	{0x04,0x04,0x08,0x00,0x00,0x00,0x00},	/* ''' */
+	{0x02,0x04,0x08,0x08,0x08,0x04,0x02},	/* '(' */
+	{0x08,0x04,0x02,0x02,0x02,0x04,0x08},	/* ')' */
+	{0x00,0x04,0x15,0x0e,0x15,0x04,0x00},	/* '*' */
+	{0x00,0x04,0x04,0x1f,0x04,0x04,0x00},	/* '+' */
+	{0x00,0x00,0x00,0x00,0x0c,0x04,0x08},	/* ',' */
+	{0x00,0x00,0x00,0x1f,0x00,0x00,0x00},	/* '-' */
+	{0x00,0x00,0x00,0x00,0x00,0x0c,0x0c},	/* '.' */
+	{0x00,0x01,0x02,0x04,0x08,0x10,0x00},	/* '/' */
+	{0x0e,0x11,0x13,0x15,0x19,0x11,0x0e},	/* '0' */
+	{0x04,0x0c,0x04,0x04,0x04,0x04,0x0e},	/* '1' */
+	{0x0e,0x11,0x01,0x02,0x04,0x08,0x1f},	/* '2' */
+	{0x1f,0x02,0x04,0x02,0x01,0x11,0x0e},	/* '3' */
+	{0x02,0x06,0x0a,0x12,0x1f,0x02,0x02},	/* '4' */
+	{0x1f,0x10,0x1e,0x01,0x01,0x11,0x0e},	/* '5' */
+	{0x06,0x08,0x10,0x1e,0x11,0x11,0x0e},	/* '6' */
+	{0x1f,0x01,0x02,0x04,0x08,0x08,0x08},	/* '7' */
+	{0x0e,0x11,0x11,0x0e,0x11,0x11,0x0e},	/* '8' */
+	{0x0e,0x11,0x11,0x0f,0x01,0x02,0x0c},	/* '9' */
+	{0x00,0x0c,0x0c,0x00,0x0c,0x0c,0x00},	/* ':' */
+	{0x00,0x0c,0x0c,0x00,0x0c,0x04,0x08},	/* ';' */
+	{0x02,0x04,0x08,0x10,0x08,0x04,0x02},	/* '<' */
+	{0x00,0x00,0x1f,0x00,0x1f,0x00,0x00},	/* '=' */
+	{0x08,0x04,0x02,0x01,0x02,0x04,0x08},	/* '>' */
+	{0x0e,0x11,0x01,0x02,0x04,0x00,0x04},	/* '?' */
+	{0x0e,0x11,0x01,0x0d,0x15,0x15,0x0e},	/* '@' */
+	{0x0e,0x11,0x11,0x1f,0x11,0x11,0x11},	/* 'A' */
+	{0x1e,0x11,0x11,0x1e,0x11,0x11,0x1e},	/* 'B' */
+	{0x0e,0x11,0x10,0x10,0x10,0x11,0x0e},	/* 'C' */
+	{0x1c,0x12,0x11,0x11,0x11,0x12,0x1c},	/* 'D' */
+	{0x1f,0x10,0x10,0x1e,0x10,0x10,0x1f},	/* 'E' */
+	{0x1f,0x10,0x10,0x1e,0x10,0x10,0x10},	/* 'F' */
+	{0x0e,0x11,0x10,0x17,0x11,0x11,0x0f},	/* 'G' */
+	{0x11,0x11,0x11,0x1f,0x11,0x11,0x11},	/* 'H' */
+	{0x0e,0x04,0x04,0x04,0x04,0x04,0x0e},	/* 'I' */
+	{0x07,0x02,0x02,0x02,0x02,0x12,0x0c},	/* 'J' */
+	{0x11,0x12,0x14,0x18,0x14,0x12,0x11},	/* 'K' */
+	{0x10,0x10,0x10,0x10,0x10,0x10,0x1f},	/* 'L' */
+	{0x11,0x1b,0x15,0x15,0x11,0x11,0x11},	/* 'M' */
+	{0x11,0x11,0x19,0x15,0x13,0x11,0x11},	/* 'N' */
+	{0x0e,0x11,0x11,0x11,0x11,0x11,0x0e},	/* 'O' */
+	{0x1e,0x11,0x11,0x1e,0x10,0x10,0x10},	/* 'P' */
+	{0x0e,0x11,0x11,0x11,0x15,0x12,0x0d},	/* 'Q' */
+	{0x1e,0x11,0x11,0x1e,0x14,0x12,0x11},	/* 'R' */
+	{0x0f,0x10,0x10,0x0e,0x01,0x01,0x1e},	/* 'S' */
+	{0x1f,0x04,0x04,0x04,0x04,0x04,0x04},	/* 'T' */
+	{0x11,0x11,0x11,0x11,0x11,0x11,0x0e},	/* 'U' */
+	{0x11,0x11,0x11,0x11,0x11,0x0a,0x04},	/* 'V' */
+	{0x11,0x11,0x11,0x15,0x15,0x15,0x0a},	/* 'W' */
+	{0x11,0x11,0x0a,0x04,0x0a,0x11,0x11},	/* 'X' */
+	{0x11,0x11,0x11,0x0a,0x04,0x04,0x04},	/* 'Y' */
+	{0x1f,0x01,0x02,0x04,0x08,0x10,0x1f},	/* 'Z' */
+	{0x0e,0x08,0x08,0x08,0x08,0x08,0x0e},	/* '[' */
+	{0x00,0x10,0x08,0x04,0x02,0x01,0x00},	/* backslash */
+	{0x0e,0x02,0x02,0x02,0x02,0x02,0x0e},	/* ']' */
+	{0x04,0x0a,0x11,0x00,0x00,0x00,0x00},	/* '^' */
+	{0x00,0x00,0x00,0x00,0x00,0x00,0x1f},	/* '_' */
+	{0x08,0x04,0x02,0x00,0x00,0x00,0x00},	/* '`' */
+	{0x00,0x00,0x0e,0x01,0x0f,0x11,0x0f},	/* 'a' */
+	{0x10,0x10,0x16,0x19,0x11,0x11,0x1e},	/* 'b' */
+	{0x00,0x00,0x0e,0x10,0x10,0x11,0x0e},	/* 'c' */
+	{0x01,0x01,0x0d,0x13,0x11,0x11,0x0f},	/* 'd' */
+	{0x00,0x00,0x0e,0x11,0x1f,0x10,0x0e},	/* 'e' */
+	{0x06,0x09,0x08,0x1c,0x08,0x08,0x08},	/* 'f' */
+	{0x00,0x0f,0x11,0x11,0x0f,0x01,0x0e},	/* 'g' */
+	{0x10,0x10,0x16,0x19,0x11,0x11,0x11},	/* 'h' */
+	{0x04,0x00,0x0c,0x04,0x04,0x04,0x0e},	/* 'i' */
+	{0x02,0x00,0x06,0x02,0x02,0x12,0x0c},	/* 'j' */
+	{0x10,0x10,0x12,0x14,0x18,0x14,0x12},	/* 'k' */
+	{0x0c,0x04,0x04,0x04,0x04,0x04,0x0e},	/* 'l' */
+	{0x00,0x00,0x1a,0x15,0x15,0x11,0x11},	/* 'm' */
+	{0x00,0x00,0x16,0x19,0x11,0x11,0x11},	/* 'n' */
+	{0x00,0x00,0x0e,0x11,0x11,0x11,0x0e},	/* 'o' */
+	{0x00,0x00,0x1e,0x11,0x1e,0x10,0x10},	/* 'p' */
+	{0x00,0x00,0x0d,0x13,0x0f,0x01,0x01},	/* 'q' */
+	{0x00,0x00,0x16,0x19,0x10,0x10,0x10},	/* 'r' */
+	{0x00,0x00,0x0e,0x10,0x0e,0x01,0x1e},	/* 's' */
+	{0x08,0x08,0x1c,0x08,0x08,0x09,0x06},	/* 't' */
+	{0x00,0x00,0x11,0x11,0x11,0x13,0x0d},	/* 'u' */
+	{0x00,0x00,0x11,0x11,0x11,0x0a,0x04},	/* 'v' */
+	{0x00,0x00,0x11,0x11,0x15,0x15,0x0a},	/* 'w' */
+	{0x00,0x00,0x11,0x0a,0x04,0x0a,0x11},	/* 'x' */
+	{0x00,0x00,0x11,0x11,0x0f,0x01,0x0e},	/* 'y' */
+	{0x00,0x00,0x1f,0x02,0x04,0x08,0x1f},	/* 'z' */
+	{0x02,0x04,0x04,0x08,0x04,0x04,0x02},	/* '{' */
+	{0x04,0x04,0x04,0x04,0x04,0x04,0x04},	/* '|' */
+	{0x08,0x04,0x04,0x02,0x04,0x04,0x08},	/* '}' */
+	{0x00,0x00,0x08,0x15,0x02,0x00,0x00},	/* '~' */
+};
+
+static const GLubyte hudWhite[4]={255, 255, 255, 255};
+static const GLubyte hudPanel[4]={0, 0, 0, 160};
+static const GLubyte hudGrid[4]={255, 255, 255, 96};
+static const GLubyte hudGood[4]={80, 220, 80, 255};
+static const GLubyte hudSlow[4]={240, 200, 60, 255};
+static const GLubyte hudBad[4]={240, 70, 60, 255};
+
+/* Build the atlas texture from the font */
+static GLuint hudCreateAtlas(void)
+{
+	static GLubyte pixels[HUD_ATLAS_ROWS * HUD_CELL][HUD_ATLAS_COLUMNS * HUD_CELL];
+	GLuint tex;
+	int c, x, y;
+
+	memset(pixels, 0, sizeof(pixels));
+	for (c=0; c<HUD_GLYPHS; c++) {
+		int x0=(c % HUD_ATLAS_COLUMNS) * HUD_CELL;
+		int y0=(c / HUD_ATLAS_COLUMNS) * HUD_CELL;
+		for (y=0; y<HUD_GLYPH_H; y++) {
+			for (x=0; x<HUD_GLYPH_W; x++) {
+				if (hudFont[c][y] & (1 << (HUD_GLYPH_W - 1 - x))) {
+					pixels[y0 + y][x0 + x]=255;
+				}
+			}
+		}
+	}
+	/* the cell after the last glyph is solid */
+	for (y=0; y<HUD_CELL; y++) {
+		for (x=0; x<HUD_CELL; x++) {
+			pixels[(HUD_GLYPHS / HUD_ATLAS_COLUMNS) * HUD_CELL + y][(HUD_GLYPHS % HUD_ATLAS_COLUMNS) * HUD_CELL + x]=255;
+		}
+	}
+
+	glGenTextures(1, &tex);
+	glBindTexture(GL_TEXTURE_2D, tex);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, HUD_ATLAS_COLUMNS * HUD_CELL, HUD_ATLAS_ROWS * HUD_CELL, 0, GL_RED, GL_UNSIGNED_BYTE, pixels);
+	gpuMemTrack(GPU_MEM_TEXTURES, tex, sizeof(pixels));
+	glBindTexture(GL_TEXTURE_2D, 0);
+	return tex;
+}
+
+/* Point the instanced attributes to the segment at offset */
+static void hudSetupAttribs(GLintptr offset)
+{
+	glVertexAttribPointer(0, 4, GL_FLOAT, GL_FALSE, sizeof(HudQuad), BUFFER_OFFSET(offset + offsetof(HudQuad,pos)));
+	glVertexAttribPointer(2, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(HudQuad), BUFFER_OFFSET(offset + offsetof(HudQuad,clr)));
+	glVertexAttribPointer(3, 4, GL_FLOAT, GL_FALSE, sizeof(HudQuad), BUFFER_OFFSET(offset + offsetof(HudQuad,tex)));
+}
+
+/* Create the program, the atlas and the buffer */
+static void initHud(Hud *hud, const AppConfig& cfg)
+{
+	int i;
+
+	hud->enabled=false;
+	if (!cfg.hud) {
+		return;
+	}
+	if (!GLAD_GL_VERSION_3_3 && !GLAD_GL_ARB_instanced_arrays) {
+		warn("HUD: instanced arrays are not supported");
+		return;
+	}
+	hud->program=programCreateFromFiles("shaders/hud.vs.glsl", "shaders/hud.fs.glsl");
+	if (!hud->program) {
+		warn("HUD: failed to create the program");
+		return;
+	}
+	hud->locScale=glGetUniformLocation(hud->program, "scale");
+	glUseProgram(hud->program);
+	glUniform1i(glGetUniformLocation(hud->program, "atlas"), 0);
+	hud->atlas=hudCreateAtlas();
+
+	glGenBuffers(1, &hud->vbo);
+	glBindBuffer(GL_ARRAY_BUFFER, hud->vbo);
+	glBufferData(GL_ARRAY_BUFFER, HUD_BUFFERS * HUD_MAX_QUADS * sizeof(HudQuad), NULL, GL_STREAM_DRAW);
+	gpuMemTrack(GPU_MEM_BUFFERS, hud->vbo, HUD_BUFFERS * HUD_MAX_QUADS * sizeof(HudQuad));
+	glGenVertexArrays(1, &hud->vao);
+	glBindVertexArray(hud->vao);
+	hudSetupAttribs(0);
+	glEnableVertexAttribArray(0);
+	glEnableVertexAttribArray(2);
+	glEnableVertexAttribArray(3);
+	glVertexAttribDivisor(0, 1);
+	glVertexAttribDivisor(2, 1);
+	glVertexAttribDivisor(3, 1);
+	glBindVertexArray(0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+	for (i=0; i<HUD_BUFFERS; i++) {
+		hud->fence[i]=0;
+	}
+	for (i=0; i<HUD_GRAPH_FRAMES; i++) {
+		hud->frameTime[i]=0.0f;
+	}
+	hud->next=0;
+	hud->graphPos=0;
+	hud->lastTime=-1.0;
+	hud->quads.reserve(HUD_MAX_QUADS);
+	hud->enabled=true;
+	info("HUD: enabled, toggle with H");
+}
+
+/* Delete the GL objects */
+static void destroyHud(Hud *hud)
+{
+	int i;
+
+	if (!hud->enabled) {
+		return;
+	}
+	for (i=0; i<HUD_BUFFERS; i++) {
+		if (hud->fence[i]) {
+			glDeleteSync(hud->fence[i]);
+		}
+	}
+	gpuMemUntrack(GPU_MEM_BUFFERS, hud->vbo);
+	gpuMemUntrack(GPU_MEM_TEXTURES, hud->atlas);
+	gpuMemUntrack(GPU_MEM_PROGRAMS, hud->program);
+	glDeleteVertexArrays(1, &hud->vao);
+	glDeleteBuffers(1, &hud->vbo);
+	glDeleteTextures(1, &hud->atlas);
+	glDeleteProgram(hud->program);
+	hud->enabled=false;
+}
+
+/* Add a rectangle using the atlas cell at cx, cy */
+static void hudQuad(Hud *hud, float x, float y, float w, float h, int cx, int cy, int cw, int ch, const GLubyte *clr)
+{
+	if (hud->quads.size() >= HUD_MAX_QUADS) {
+		return;
+	}
+	HudQuad q;
+	q.pos[0]=x;
+	q.pos[1]=y;
+	q.pos[2]=w;
+	q.pos[3]=h;
+	q.tex[0]=(GLfloat)(cx * HUD_CELL);
+	q.tex[1]=(GLfloat)(cy * HUD_CELL);
+	q.tex[2]=(GLfloat)cw;
+	q.tex[3]=(GLfloat)ch;
+	memcpy(q.clr, clr, sizeof(q.clr));
+	hud->quads.push_back(q);
+}
+
+/* Add a solid rectangle */
+static void hudRect(Hud *hud, float x, float y, float w, float h, const GLubyte *clr)
+{
+	hudQuad(hud, x, y, w, h, HUD_GLYPHS % HUD_ATLAS_COLUMNS, HUD_GLYPHS / HUD_ATLAS_COLUMNS, HUD_CELL, HUD_CELL, clr);
+}
+
+/* Add a line of text, returns its width in pixels */
+static float hudPrintf(Hud *hud, float x, float y, const GLubyte *clr, const char *format, ...)
+{
+	char text[128];
+	va_list args;
+	int i;
+
+	va_start(args, format);
+	vsnprintf(text, sizeof(text), format, args);
+	va_end(args);
+	for (i=0; text[i]; i++) {
+		int c=(unsigned char)text[i] - 32;
+		if (c > 0 && c < HUD_GLYPHS) {
+			hudQuad(hud, x + (float)(i * HUD_ADVANCE), y, HUD_GLYPH_W * HUD_SCALE, HUD_GLYPH_H * HUD_SCALE,
+				c % HUD_ATLAS_COLUMNS, c / HUD_ATLAS_COLUMNS, HUD_GLYPH_W, HUD_GLYPH_H, clr);
+		}
+	}
+	return (float)(i * HUD_ADVANCE);
+}
+
+/* Build the quads for the current frame, w x h is the window size */
+static void hudBuild(Hud *hud, const CubeApp *app, int w, int h)
+{
+	const float x=HUD_MARGIN + HUD_SCALE * 4;
+	float y=HUD_MARGIN + HUD_SCALE * 4;
+	float width=HUD_GRAPH_FRAMES * HUD_SCALE;
+	float graphHeight=HUD_GRAPH_MAX * HUD_GRAPH_MS;
+	size_t panel;
+	int i;
+
+	if (hud->lastTime >= 0.0) {
+		hud->frameTime[hud->graphPos]=(float)(1000.0 * (app->timeFrame - hud->lastTime));
+		hud->graphPos=(hud->graphPos + 1) % HUD_GRAPH_FRAMES;
+	}
+	hud->lastTime=app->timeFrame;
+
+	/* the panel comes first, so it is behind everything, its size is
+	 * only known at the end */
+	hud->quads.clear();
+	panel=hud->quads.size();
+	hudRect(hud, 0, 0, 0, 0, hudPanel);
+
+	if (app->avg_fps > 0.0) {
+		width=std::max(width, hudPrintf(hud, x, y, hudWhite, "%.2f ms/frame  %.1f fps", app->avg_frametime, app->avg_fps));
+	} else {
+		width=std::max(width, hudPrintf(hud, x, y, hudWhite, "-- ms/frame"));
+	}
+	y += HUD_LINE;
+	width=std::max(width, hudPrintf(hud, x, y, hudWhite, "frame %u  objects %u", app->frame, (unsigned)app->scene.objects.size()));
+	y += HUD_LINE;
+	if (app->target.enabled) {
+		width=std::max(width, hudPrintf(hud, x, y, hudWhite, "render %dx%d (%d%%)", app->target.renderWidth, app->target.renderHeight, app->target.scale));
+	} else {
+		width=std::max(width, hudPrintf(hud, x, y, hudWhite, "render %dx%d", w, h));
+	}
+	y += HUD_LINE;
+	if (app->drawStats.summary[0]) {
+		width=std::max(width, hudPrintf(hud, x, y, hudWhite, "%s", app->drawStats.summary + 1));
+		y += HUD_LINE;
+	}
+
+	/* the frame time graph, oldest frame first, with lines at 60 and 30 fps */
+	y += HUD_SCALE * 2;
+	for (i=0; i<HUD_GRAPH_FRAMES; i++) {
+		float ms=hud->frameTime[(hud->graphPos + i) % HUD_GRAPH_FRAMES];
+		float bar=std::min(ms, HUD_GRAPH_MAX) * HUD_GRAPH_MS;
+		const GLubyte *clr=(ms <= 1000.0f / 59.0f)?hudGood:((ms <= 1000.0f / 29.0f)?hudSlow:hudBad);
+		hudRect(hud, x + (float)(i * HUD_SCALE), y + graphHeight - bar, HUD_SCALE, bar, clr);
+	}
+	hudRect(hud, x, y + graphHeight - 1000.0f / 60.0f * HUD_GRAPH_MS, HUD_GRAPH_FRAMES * HUD_SCALE, 1, hudGrid);
+	hudRect(hud, x, y + graphHeight - 1000.0f / 30.0f * HUD_GRAPH_MS, HUD_GRAPH_FRAMES * HUD_SCALE, 1, hudGrid);
+	y += graphHeight;
+
+	HudQuad& p=hud->quads[panel];
+	p.pos[0]=HUD_MARGIN;
+	p.pos[1]=HUD_MARGIN;
+	p.pos[2]=width + HUD_SCALE * 8;
+	p.pos[3]=y + HUD_SCALE * 4 - HUD_MARGIN;
+}
+
+/* Draw the quads into the currently bound framebuffer of size w x h */
+static void hudDraw(Hud *hud, int w, int h)
+{
+	PROFILE_ZONE("hud");
+	GPU_ZONE("hud");
+	unsigned int slot=hud->next;
+	GLsizei count=(GLsizei)hud->quads.size();
+	GLintptr offset=(GLintptr)(slot * HUD_MAX_QUADS * sizeof(HudQuad));
+	void *ptr;
+
+	/* the fence guarantees the GPU is done with this segment, it is
+	 * HUD_BUFFERS frames old, so this rarely waits */
+	if (hud->fence[slot]) {
+		GLenum res;
+		do {
+			res=glClientWaitSync(hud->fence[slot], GL_SYNC_FLUSH_COMMANDS_BIT, 100000000);
+		} while (res == GL_TIMEOUT_EXPIRED);
+		glDeleteSync(hud->fence[slot]);
+		hud->fence[slot]=0;
+	}
+
+	glBindBuffer(GL_ARRAY_BUFFER, hud->vbo);
+	ptr=glMapBufferRange(GL_ARRAY_BUFFER, offset, count * sizeof(HudQuad),
+		GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+	if (!ptr) {
+		warn("HUD: failed to map buffer %u", hud->vbo);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		return;
+	}
+	memcpy(ptr, hud->quads.data(), count * sizeof(HudQuad));
+	glUnmapBuffer(GL_ARRAY_BUFFER);
+
+	glBindVertexArray(hud->vao);
+	hudSetupAttribs(offset);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glUseProgram(hud->program);
+	glUniform2f(hud->locScale, 2.0f / (float)w, 2.0f / (float)h);
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, hud->atlas);
+
+	glViewport(0, 0, w, h);
+	glDisable(GL_DEPTH_TEST);
+	glEnable(GL_BLEND);
+	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, count);
+	glDisable(GL_BLEND);
+	glEnable(GL_DEPTH_TEST);
+	glBindVertexArray(0);
+
+	hud->fence[slot]=glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	hud->next=(slot + 1) % HUD_BUFFERS;
+}
+
+/****************************************************************************
+ * METRICS EXPORT                                                           *
+ ****************************************************************************/
+
+/* The metrics server thread answers every connection with an HTTP response
+ * in the Prometheus text format, so it can be scraped directly. It listens
+ * on a localhost TCP port, or on a Unix domain socket if the address starts
+ * with "unix:". The render thread never waits for it: once per frame, it
+ * fills the back buffer of a lock-free triple buffer and swaps it with the
+ * middle one, and the server swaps the middle buffer with its front buffer
+ * if a newer one was published. The percentiles are computed by the server
+ * from the frame times in the snapshot. */
+
+#define METRICS_FRESH 4			/* flag in middle: published after the last read */
+#define METRICS_INDEX 3
+#define METRICS_BODY 8192
+
+/* Start measuring the GPU time of a frame, reads back the oldest result */
+static void metricsGpuBegin(MetricsServer *ms)
+{
+	unsigned int i;
+
+	if (!ms->enabled || !ms->gpu) {
+		return;
+	}
+	for (i=0; i<METRICS_QUERIES; i++) {
+		unsigned int q=(ms->next + i) % METRICS_QUERIES;
+		GLint available=0;
+		GLuint64 t[2];
+
+		if (!ms->pending[q]) {
+			continue;
+		}
+		glGetQueryObjectiv(ms->query[q][1], GL_QUERY_RESULT_AVAILABLE, &available);
+		if (!available) {
+			break;
+		}
+		glGetQueryObjectui64v(ms->query[q][0], GL_QUERY_RESULT, &t[0]);
+		glGetQueryObjectui64v(ms->query[q][1], GL_QUERY_RESULT, &t[1]);
+		ms->gpuTime=(double)(t[1] - t[0]) / 1.0e9;
+		ms->pending[q]=false;
+	}
+	glQueryCounter(ms->query[ms->next][0], GL_TIMESTAMP);
+}
+
+/* Stop measuring the GPU time of a frame */
+static void metricsGpuEnd(MetricsServer *ms)
+{
+	if (!ms->enabled || !ms->gpu) {
+		return;
+	}
+	glQueryCounter(ms->query[ms->next][1], GL_TIMESTAMP);
+	ms->pending[ms->next]=true;
+	ms->next=(ms->next + 1) % METRICS_QUERIES;
+}
+
+/* Publish a snapshot of the statistics, call this once per frame from the
+ * render thread */
+static void metricsFrame(MetricsServer *ms, const CubeApp *app)
+{
+	if (!ms->enabled) {
+		return;
+	}
+	if (ms->lastTime >= 0.0) {
+		float dt=(float)(app->timeFrame - ms->lastTime);
+		ms->frameTime[ms->framePos]=dt;
+		ms->framePos=(ms->framePos + 1) % METRICS_FRAMES;
+		ms->frameTimeCount=std::min(ms->frameTimeCount + 1, (unsigned)METRICS_FRAMES);
+		ms->frameTimeSum += dt;
+	}
+	ms->lastTime=app->timeFrame;
+
+	MetricsSnapshot& s=ms->snapshot[ms->back];
+	/* this is called before the frame counter is incremented */
+	s.frames=app->frame + 1;
+	s.frameTimeSum=ms->frameTimeSum;
+	s.frameTimeCount=ms->frameTimeCount;
+	memcpy(s.frameTime, ms->frameTime, sizeof(s.frameTime));
+	s.fps=app->avg_fps;
+	s.gpuTime=ms->gpuTime;
+	s.shaderCompiles=shaderCompiles;
+	s.objects=(unsigned)app->scene.objects.size();
+	gpuMemBytes(s.gpuMemory);
+	s.gpuAvailable=(gpuMem.availableKiB >= 0)?(double)gpuMem.availableKiB * 1024.0:-1.0;
+	ms->back=ms->middle.exchange(ms->back | METRICS_FRESH) & METRICS_INDEX;
+}
+
+#ifndef WIN32
+/* The resident set size of the process, or a negative value if unknown */
+static double metricsResidentBytes(void)
+{
+	long size, pages=-1;
+	FILE *f=fopen("/proc/self/statm", "rt");
+
+	if (f) {
+		if (fscanf(f, "%ld %ld", &size, &pages) != 2) {
+			pages=-1;
+		}
+		fclose(f);
+	}
+	return (pages < 0)?-1.0:(double)pages * (double)sysconf(_SC_PAGESIZE);
+}
+
+/* Format the latest snapshot, returns the length of the text */
+static int metricsFormat(MetricsServer *ms, char *buf, int size)
+{
+	static const double quantiles[]={0.5, 0.9, 0.99};
+	int len=0;
+	size_t i;
+
+	if (ms->middle.load() & METRICS_FRESH) {
+		ms->front=ms->middle.exchange(ms->front) & METRICS_INDEX;
+	}
+	const MetricsSnapshot& s=ms->snapshot[ms->front];
+	std::vector<float> times(s.frameTime, s.frameTime + s.frameTimeCount);
+	std::sort(times.begin(), times.end());
+
+#define METRICS_PRINTF(...) \
+	if (len < size) { \
+		len += mysnprintf(buf + len, size - len, __VA_ARGS__); \
+	}
+
+	METRICS_PRINTF("# HELP hellocube_frames_total Frames rendered.\n# TYPE hellocube_frames_total counter\n");
+	METRICS_PRINTF("hellocube_frames_total %u\n", s.frames);
+	METRICS_PRINTF("# HELP hellocube_frame_time_seconds Time between frames, over the last %d frames.\n", METRICS_FRAMES);
+	METRICS_PRINTF("# TYPE hellocube_frame_time_seconds summary\n");
+	for (i=0; i<sizeof(quantiles)/sizeof(quantiles[0]) && !times.empty(); i++) {
+		size_t idx=std::min((size_t)(quantiles[i] * (double)times.size()), times.size() - 1);
+		METRICS_PRINTF("hellocube_frame_time_seconds{quantile=\"%g\"} %.6f\n", quantiles[i], times[idx]);
+	}
+	METRICS_PRINTF("hellocube_frame_time_seconds_sum %.6f\n", s.frameTimeSum);
+	METRICS_PRINTF("hellocube_frame_time_seconds_count %u\n", (s.frames)?s.frames - 1:0);
+	if (s.fps > 0.0) {
+		METRICS_PRINTF("# HELP hellocube_fps Frames per second, averaged over one second.\n# TYPE hellocube_fps gauge\n");
+		METRICS_PRINTF("hellocube_fps %.2f\n", s.fps);
+	}
+	if (s.gpuTime >= 0.0) {
+		METRICS_PRINTF("# HELP hellocube_gpu_frame_time_seconds GPU time of a recent frame.\n# TYPE hellocube_gpu_frame_time_seconds gauge\n");
+		METRICS_PRINTF("hellocube_gpu_frame_time_seconds %.6f\n", s.gpuTime);
+	}
+	METRICS_PRINTF("# HELP hellocube_shader_compiles_total Shader objects compiled.\n# TYPE hellocube_shader_compiles_total counter\n");
+	METRICS_PRINTF("hellocube_shader_compiles_total %u\n", s.shaderCompiles);
+	METRICS_PRINTF("# HELP hellocube_scene_objects Objects in the scene.\n# TYPE hellocube_scene_objects gauge\n");
+	METRICS_PRINTF("hellocube_scene_objects %u\n", s.objects);
+	METRICS_PRINTF("# HELP hellocube_gpu_memory_bytes GPU memory allocated by the application.\n# TYPE hellocube_gpu_memory_bytes gauge\n");
+	for (i=0; i<GPU_MEM_CATEGORIES; i++) {
+		METRICS_PRINTF("hellocube_gpu_memory_bytes{category=\"%s\"} %llu\n", gpuMemCategoryNames[i], (unsigned long long)s.gpuMemory[i]);
+	}
+	if (s.gpuAvailable >= 0.0) {
+		METRICS_PRINTF("# HELP hellocube_gpu_memory_available_bytes Free video memory reported by the driver.\n# TYPE hellocube_gpu_memory_available_bytes gauge\n");
+		METRICS_PRINTF("hellocube_gpu_memory_available_bytes %.0f\n", s.gpuAvailable);
+	}
+	double rss=metricsResidentBytes();
+	if (rss >= 0.0) {
+		METRICS_PRINTF("# HELP hellocube_resident_memory_bytes Resident memory of the process.\n# TYPE hellocube_resident_memory_bytes gauge\n");
+		METRICS_PRINTF("hellocube_resident_memory_bytes %.0f\n", rss);
+	}
+#undef METRICS_PRINTF
+	return std::min(len, size - 1);
+}
+
+/* Send all of buf, returns false on error */
+static bool metricsSend(int fd, const char *buf, int len)
+{
+#ifdef MSG_NOSIGNAL
+	const int flags=MSG_NOSIGNAL;
+#else
+	const int flags=0;
+#endif
+	while (len > 0) {
+		ssize_t n=send(fd, buf, len, flags);
+		if (n <= 0) {
+			return false;
+		}
+		buf += n;
+		len -= (int)n;
+	}
+	return true;
+}
+
+/* The server thread: answer one connection at a time */
+static void metricsThread(MetricsServer *ms)
+{
+	profilerThreadName("metrics");
+	static char body[METRICS_BODY];
+	char header[256];
+	char request[1024];
+
+	while (!ms->stop) {
+		struct pollfd pfd;
+		pfd.fd=ms->socket;
+		pfd.events=POLLIN;
+		pfd.revents=0;
+		/* wake up regularly to check if we should stop */
+		if (poll(&pfd, 1, 200) <= 0) {
+			continue;
+		}
+		int fd=accept(ms->socket, NULL, NULL);
+		if (fd < 0) {
+			continue;
+		}
+		/* read the request, but don't let a client hold us up */
+		struct timeval tv;
+		tv.tv_sec=0;
+		tv.tv_usec=200000;
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+		if (recv(fd, request, sizeof(request), 0) >= 0) {
+			int len=metricsFormat(ms, body, sizeof(body));
+			int hlen=mysnprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\n"
+				"Content-Type: text/plain; version=0.0.4\r\n"
+				"Content-Length: %d\r\n"
+				"Connection: close\r\n\r\n", len);
+			if (metricsSend(fd, header, hlen)) {
+				metricsSend(fd, body, len);
+			}
+			ms->scrapes++;
+		}
+		close(fd);
+	}
+}
+
+/* Create the listening socket for address, returns -1 on error */
+static int metricsListen(const char *address)
+{
+	int fd;
+
+	if (!strncmp(address, "unix:", 5)) {
+		struct sockaddr_un sa;
+		struct stat st;
+		const char *path=address + 5;
+
+		if (strlen(path) >= sizeof(sa.sun_path)) {
+			warn("metrics: socket path '%s' is too long", path);
+			return -1;
+		}
+		/* remove the stale socket of a previous run, but nothing else */
+		if (!stat(path, &st) && S_ISSOCK(st.st_mode)) {
+			unlink(path);
+		}
+		memset(&sa, 0, sizeof(sa));
+		sa.sun_family=AF_UNIX;
+		strcpy(sa.sun_path, path);
+		fd=socket(AF_UNIX, SOCK_STREAM, 0);
+		if (fd >= 0 && bind(fd, (struct sockaddr*)&sa, sizeof(sa))) {
+			close(fd);
+			fd=-1;
+		}
+	} else {
+		struct sockaddr_in sa;
+		int one=1;
+		long port=strtol(address, NULL, 10);
+
+		if (port <= 0 || port > 65535) {
+			warn("metrics: invalid port '%s'", address);
+			return -1;
+		}
+		memset(&sa, 0, sizeof(sa));
+		sa.sin_family=AF_INET;
+		sa.sin_port=htons((unsigned short)port);
+		sa.sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+		fd=socket(AF_INET, SOCK_STREAM, 0);
+		if (fd >= 0) {
+			setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+			if (bind(fd, (struct sockaddr*)&sa, sizeof(sa))) {
+				close(fd);
+				fd=-1;
+			}
+		}
+	}
+	if (fd < 0) {
+		warn("metrics: failed to bind '%s': %s", address, strerror(errno));
+		return -1;
+	}
+	if (listen(fd, 4)) {
+		warn("metrics: failed to listen on '%s': %s", address, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+#endif
+
+/* Create the queries and start the server thread */
+static void initMetrics(MetricsServer *ms, const AppConfig& cfg)
+{
+	unsigned int i;
+
+	ms->enabled=false;
+	if (!cfg.metricsAddress) {
+		return;
+	}
+#ifdef WIN32
+	warn("metrics: not supported on this platform");
+#else
+	ms->socket=metricsListen(cfg.metricsAddress);
+	if (ms->socket < 0) {
+		return;
+	}
+	memset(ms->snapshot, 0, sizeof(ms->snapshot));
+	for (i=0; i<3; i++) {
+		ms->snapshot[i].gpuTime=-1.0;
+	}
+	ms->back=0;
+	ms->middle=1;
+	ms->front=2;
+	ms->framePos=0;
+	ms->frameTimeCount=0;
+	ms->frameTimeSum=0.0;
+	ms->lastTime=-1.0;
+	ms->gpuTime=-1.0;
+	ms->gpu=(GLAD_GL_VERSION_3_3 || GLAD_GL_ARB_timer_query);
+	if (ms->gpu) {
+		glGenQueries(2 * METRICS_QUERIES, &ms->query[0][0]);
+		for (i=0; i<METRICS_QUERIES; i++) {
+			ms->pending[i]=false;
+		}
+	}
+	ms->next=0;
+	ms->scrapes=0;
+	ms->stop=false;
+	ms->thread=std::thread(metricsThread, ms);
+	ms->enabled=true;
+	info("metrics: serving on '%s'", cfg.metricsAddress);
+#endif
+}
+
+/* Stop the server thread and delete the queries */
+static void destroyMetrics(MetricsServer *ms)
+{
+	if (!ms->enabled) {
+		return;
+	}
+#ifndef WIN32
+	ms->stop=true;
+	ms->thread.join();
+	close(ms->socket);
+#endif
+	if (ms->gpu) {
+		glDeleteQueries(2 * METRICS_QUERIES, &ms->query[0][0]);
+	}
+	info("metrics: %u scrapes", ms->scrapes);
+	ms->enabled=false;
+}
+
+/****************************************************************************
+ * BENCHMARK MODE                                                           *
+ ****************************************************************************/
+
+/* With --bench, the window is hidden and the time between frames is
+ * recorded for all frames after the warm-up. At the end, a summary is
+ * written to the file as "key value" lines, which is what tools/bench
+ * reads. The scenarios, the repetitions and the statistics across runs are
+ * handled by tools/bench, so every run is a fresh process. */
+
+/* Allocate the frame time array */
+static void initBenchmark(Benchmark *b, const AppConfig& cfg)
+{
+	b->enabled=(cfg.benchFile != NULL);
+	if (!b->enabled) {
+		return;
+	}
+	b->warmup=cfg.benchWarmup;
+	b->lastTime=-1.0;
+	b->frameTime.reserve(cfg.frameCount);
+	info("benchmark: %u frames, %u of them warm-up", cfg.frameCount, b->warmup);
+}
+
+/* Record the time of a frame, call this once per frame from the render
+ * thread */
+static void benchFrame(Benchmark *b, const CubeApp *app)
+{
+	if (!b->enabled) {
+		return;
+	}
+	if (app->frame > b->warmup) {
+		b->frameTime.push_back((float)(1000.0 * (app->timeFrame - b->lastTime)));
+	}
+	b->lastTime=app->timeFrame;
+}
+
+/* Write the summary, returns false if there is none or it can't be
+ * written */
+static bool benchWrite(const Benchmark *b, const CubeApp *app, const AppConfig& cfg)
+{
+	if (!b->enabled) {
+		return true;
+	}
+	if (b->frameTime.size() < 2) {
+		warn("benchmark: not enough frames after the warm-up");
+		return false;
+	}
+
+	std::vector<float> t(b->frameTime);
+	size_t n=t.size();
+	double sum=0.0, sq=0.0;
+	size_t i;
+
+	std::sort(t.begin(), t.end());
+	for (i=0; i<n; i++) {
+		sum += t[i];
+	}
+	double mean=sum / (double)n;
+	for (i=0; i<n; i++) {
+		sq += ((double)t[i] - mean) * ((double)t[i] - mean);
+	}
+
+	FILE *f=fopen(cfg.benchFile, "wt");
+	if (!f) {
+		warn("benchmark: failed to open '%s'", cfg.benchFile);
+		return false;
+	}
+	fprintf(f, "frames %u\n", (unsigned)n);
+	fprintf(f, "objects %u\n", (unsigned)app->scene.objects.size());
+	fprintf(f, "mean_ms %.6f\n", mean);
+	fprintf(f, "stddev_ms %.6f\n", sqrt(sq / (double)(n - 1)));
+	fprintf(f, "min_ms %.6f\n", t[0]);
+	fprintf(f, "p50_ms %.6f\n", t[n / 2]);
+	fprintf(f, "p90_ms %.6f\n", t[std::min((size_t)(0.9 * (double)n), n - 1)]);
+	fprintf(f, "p99_ms %.6f\n", t[std::min((size_t)(0.99 * (double)n), n - 1)]);
+	fprintf(f, "max_ms %.6f\n", t[n - 1]);
+	fclose(f);
+	info("benchmark: %.3fms/frame average over %u frames, written to '%s'", mean, (unsigned)n, cfg.benchFile);
+	return true;
+}
+
+/****************************************************************************
+ * FRAME CAPTURE                                                            *
+ ****************************************************************************/
+
+/* Every frame is read back with glReadPixels into one of CAPTURE_SLOTS
+ * PBOs. The slots are only touched again CAPTURE_SLOTS frames later, when
+ * the GPU is long done with the copy, so reading back never stalls. With
+ * ARB_buffer_storage, the PBOs are persistently mapped and the writer
+ * thread reads directly from them; otherwise we have to copy the pixels
+ * on the render thread. Encoding and disk I/O happen on the writer thread.
+ * We write PNG files with uncompressed deflate blocks: they are large, but
+ * cheap to encode, and need no zlib. Alternatively, the frames go into a
+ * raw Y4M video, which video tools understand. */
+
+/* CRC-32 as used by PNG */
+static uint32_t pngCrc(uint32_t crc, const GLubyte *data, size_t len)
+{
+	struct CrcTable {
+		uint32_t t[256];
+		CrcTable() {
+			for (uint32_t n=0; n<256; n++) {
+				uint32_t c=n;
+				for (int k=0; k<8; k++) {
+					c=(c & 1)?(0xedb88320u ^ (c >> 1)):(c >> 1);
+				}
+				t[n]=c;
+			}
+		}
+	};
+	static const CrcTable table;
+
+	crc=~crc;
+	for (size_t i=0; i<len; i++) {
+		crc=table.t[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+	}
+	return ~crc;
+}
+
+/* Append a big-endian 32 bit value */
+static void pngPut32(std::vector<GLubyte>& out, uint32_t v)
+{
+	out.push_back((GLubyte)(v >> 24));
+	out.push_back((GLubyte)(v >> 16));
+	out.push_back((GLubyte)(v >> 8));
+	out.push_back((GLubyte)v);
+}
+
+/* Write a PNG chunk */
+static void pngChunk(FILE *f, const char *type, const std::vector<GLubyte>& data)
+{
+	std::vector<GLubyte> hdr;
+	pngPut32(hdr, (uint32_t)data.size());
+	hdr.insert(hdr.end(), type, type + 4);
+	uint32_t crc=pngCrc(0, &hdr[4], 4);
+	crc=pngCrc(crc, data.data(), data.size());
+	fwrite(hdr.data(), 1, hdr.size(), f);
+	fwrite(data.data(), 1, data.size(), f);
+	hdr.clear();
+	pngPut32(hdr, crc);
+	fwrite(hdr.data(), 1, 4, f);
+}
+
+/* Write an RGB PNG file. The pixels are BGRA, bottom-up, as glReadPixels
+ * delivers them. Returns false on error. */
+static bool pngWrite(const char *name, const GLubyte *bgra, int w, int h)
+{
+	FILE *f=fopen(name, "wb");
+	if (!f) {
+		warn("failed to open '%s'", name);
+		return false;
+	}
+
+	static const GLubyte signature[8]={0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+	fwrite(signature, 1, sizeof(signature), f);
+
+	std::vector<GLubyte> data;
+	pngPut32(data, (uint32_t)w);
+	pngPut32(data, (uint32_t)h);
+	data.push_back(8);	/* bit depth */
+	data.push_back(2);	/* color type RGB */
+	data.push_back(0);	/* compression */
+	data.push_back(0);	/* filter */
+	data.push_back(0);	/* no interlacing */
+	pngChunk(f, "IHDR", data);
+
+	/* the scanlines, each with filter type 0 */
+	std::vector<GLubyte> raw((size_t)h * (3 * (size_t)w + 1));
+	GLubyte *dst=raw.data();
+	for (int y=0; y<h; y++) {
+		const GLubyte *src=bgra + (size_t)(h - 1 - y) * 4 * (size_t)w;
+		*dst++=0;
+		for (int x=0; x<w; x++, src+=4) {
+			*dst++=src[2];
+			*dst++=src[1];
+			*dst++=src[0];
+		}
+	}
+
+	/* zlib stream with stored deflate blocks */
+	uint32_t a=1, b=0;
+	data.clear();
+	data.push_back(0x78);
+	data.push_back(0x01);
+	for (size_t pos=0; pos<raw.size(); ) {
+		size_t len=std::min(raw.size() - pos, (size_t)65535);
+		data.push_back((pos + len == raw.size())?1:0);
+		data.push_back((GLubyte)len);
+		data.push_back((GLubyte)(len >> 8));
+		data.push_back((GLubyte)~len);
+		data.push_back((GLubyte)(~len >> 8));
+		data.insert(data.end(), raw.begin() + pos, raw.begin() + pos + len);
+		for (size_t i=pos; i<pos+len; i++) {
+			a=(a + raw[i]) % 65521;
+			b=(b + a) % 65521;
+		}
+		pos += len;
+	}
+	pngPut32(data, (b << 16) | a);
+	pngChunk(f, "IDAT", data);
+	data.clear();
+	pngChunk(f, "IEND", data);
+
+	bool ok=!ferror(f);
+	if (fclose(f) || !ok) {
+		warn("failed to write '%s'", name);
+		return false;
+	}
+	return true;
+}
+
+/* Read a PNG file into BGRA pixels, bottom-up. Only 8 bit RGB(A) images
+ * with uncompressed deflate blocks, as pngWrite creates them, are
+ * supported. Returns false on error. */
+static bool pngRead(const char *name, std::vector<GLubyte>& bgra, int *w, int *h)
+{
+	std::vector<GLubyte> file, idat;
+	FILE *f=fopen(name, "rb");
+	int channels=0;
+	size_t pos;
+
+	*w=*h=0;
+	if (!f) {
+		return false;
+	}
+	fseek(f, 0, SEEK_END);
+	file.resize((size_t)ftell(f));
+	fseek(f, 0, SEEK_SET);
+	if (fread(file.data(), 1, file.size(), f) != file.size()) {
+		file.clear();
+	}
+	fclose(f);
+	if (file.size() < 8 || memcmp(file.data(), "\x89PNG", 4)) {
+		warn("'%s' is not a PNG file", name);
+		return false;
+	}
+
+	/* collect the chunks we need */
+	for (pos=8; pos + 12 <= file.size(); ) {
+		const GLubyte *c=&file[pos];
+		size_t len=((size_t)c[0] << 24) | ((size_t)c[1] << 16) | ((size_t)c[2] << 8) | c[3];
+		if (pos + 12 + len > file.size()) {
+			break;
+		}
+		if (!memcmp(c + 4, "IHDR", 4) && len >= 13) {
+			*w=(c[8] << 24) | (c[9] << 16) | (c[10] << 8) | c[11];
+			*h=(c[12] << 24) | (c[13] << 16) | (c[14] << 8) | c[15];
+			if (c[16] == 8 && c[17] == 2 && !c[20]) {
+				channels=3;
+			} else if (c[16] == 8 && c[17] == 6 && !c[20]) {
+				channels=4;
+			}
+		} else if (!memcmp(c + 4, "IDAT", 4)) {
+			idat.insert(idat.end(), c + 8, c + 8 + len);
+		}
+		pos += 12 + len;
+	}
+	if (!channels || *w <= 0 || *h <= 0) {
+		warn("'%s': unsupported PNG format", name);
+		return false;
+	}
+
+	/* the zlib stream, consisting of stored blocks only */
+	std::vector<GLubyte> raw;
+	bool last=false;
+	for (pos=2; !last && pos + 5 <= idat.size(); ) {
+		last=idat[pos] & 1;
+		if (idat[pos] & 6) {
+			warn("'%s': compressed PNGs are not supported", name);
+			return false;
+		}
+		size_t len=idat[pos+1] | (idat[pos+2] << 8);
+		pos += 5;
+		if (pos + len > idat.size()) {
+			break;
+		}
+		raw.insert(raw.end(), idat.begin() + pos, idat.begin() + pos + len);
+		pos += len;
+	}
+	size_t stride=(size_t)*w * channels;
+	if (raw.size() < (size_t)*h * (stride + 1)) {
+		warn("'%s': truncated image data", name);
+		return false;
+	}
+
+	/* undo the filters and convert the scanlines */
+	std::vector<GLubyte> prev(stride, 0), line(stride);
+	bgra.resize((size_t)*w * *h * 4);
+	for (int y=0; y<*h; y++) {
+		const GLubyte *src=&raw[(size_t)y * (stride + 1)];
+		for (size_t i=0; i<stride; i++) {
+			int a=(i >= (size_t)channels)?line[i - channels]:0;
+			int b=prev[i];
+			int c=(i >= (size_t)channels)?prev[i - channels]:0;
+			int p=a + b - c;
+			int pa=abs(p - a), pb=abs(p - b), pc=abs(p - c);
+			int pred;
+			switch (src[0]) {
+				case 1: pred=a; break;
+				case 2: pred=b; break;
+				case 3: pred=(a + b) / 2; break;
+				case 4: pred=(pa <= pb && pa <= pc)?a:((pb <= pc)?b:c); break;
+				default: pred=0;
+			}
+			line[i]=(GLubyte)(src[1 + i] + pred);
+		}
+		GLubyte *dst=&bgra[(size_t)(*h - 1 - y) * 4 * (size_t)*w];
+		for (int x=0; x<*w; x++, dst+=4) {
+			dst[0]=line[x * channels + 2];
+			dst[1]=line[x * channels + 1];
+			dst[2]=line[x * channels];
+			dst[3]=(channels == 4)?line[x * channels + 3]:255;
+		}
+		prev.swap(line);
+	}
+	return true;
+}
+
+/* Append a frame to the Y4M video, converted to BT.601 YCbCr 4:2:0 */
+static void y4mWriteFrame(FILE *f, const GLubyte *bgra, int w, int h)
+{
+	int cw=(w + 1) / 2;
+	int ch=(h + 1) / 2;
+	std::vector<GLubyte> yuv((size_t)w * h + 2 * (size_t)cw * ch);
+	GLubyte *py=yuv.data();
+	GLubyte *pu=py + (size_t)w * h;
+	GLubyte *pv=pu + (size_t)cw * ch;
+
+	for (int y=0; y<h; y++) {
+		const GLubyte *src=bgra + (size_t)(h - 1 - y) * 4 * (size_t)w;
+		for (int x=0; x<w; x++, src+=4) {
+			*py++=(GLubyte)(((66 * src[2] + 129 * src[1] + 25 * src[0] + 128) >> 8) + 16);
+		}
+	}
+	for (int y=0; y<ch; y++) {
+		for (int x=0; x<cw; x++) {
+			/* average the 2x2 block, clamped at the borders */
+			int r=0, g=0, b=0;
+			for (int k=0; k<4; k++) {
+				int sx=std::min(2 * x + (k & 1), w - 1);
+				int sy=std::min(2 * y + (k >> 1), h - 1);
+				const GLubyte *src=bgra + ((size_t)(h - 1 - sy) * w + sx) * 4;
+				r += src[2];
+				g += src[1];
+				b += src[0];
+			}
+			r /= 4;
+			g /= 4;
+			b /= 4;
+			*pu++=(GLubyte)(((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128);
+			*pv++=(GLubyte)(((112 * r - 94 * g - 18 * b + 128) >> 8) + 128);
+		}
+	}
+	fputs("FRAME\n", f);
+	fwrite(yuv.data(), 1, yuv.size(), f);
+}
+
+/* The writer thread: encodes and writes the frames in the queue */
+static void captureThread(FrameCapture *fc)
+{
+	std::unique_lock<std::mutex> lock(fc->mutex);
+
+	profilerThreadName("capture writer");
+	while (true) {
+		fc->cond.wait(lock, [fc]{return fc->stop || !fc->queue.empty();});
+		if (fc->queue.empty()) {
+			/* stop, but only after everything is written */
+			break;
+		}
+		CaptureSlot& s=fc->slot[fc->queue.front()];
+		fc->queue.pop_front();
+		lock.unlock();
+
+		const GLubyte *pixels=(s.ptr)?s.ptr:s.copy.data();
+		PROFILE_ZONE("capture write");
+		if (fc->video) {
+			if (s.width == fc->videoWidth && s.height == fc->videoHeight) {
+				y4mWriteFrame(fc->video, pixels, s.width, s.height);
+			} else {
+				warn("capture: frame %u has a different size, skipped", s.frame);
+			}
+		} else {
+			/* the pattern was checked by capturePatternValid() */
+			char name[1024];
+			mysnprintf(name, sizeof(name), fc->file, s.frame);
+			pngWrite(name, pixels, s.width, s.height);
+		}
+
+		lock.lock();
+		s.state=CAPTURE_FREE;
+		fc->written++;
+		fc->cond.notify_all();
+	}
+}
+
+/* Check if a --capture argument is usable: either a .y4m file, or a
+ * printf pattern for the PNG files with exactly one integer conversion
+ * (flags and a field width are allowed) and otherwise only "%%". The
+ * pattern is passed to snprintf, so anything else must be rejected. */
+static bool capturePatternValid(const char *file)
+{
+	size_t len=strlen(file);
+	int conversions=0;
+
+	if (len > 4 && !strcmp(file + len - 4, ".y4m")) {
+		return true;
+	}
+	while (*file) {
+		if (*(file++) != '%') {
+			continue;
+		}
+		if (*file == '%') {
+			file++;
+			continue;
+		}
+		while (*file && strchr("-+ 0#", *file)) {
+			file++;
+		}
+		while (isdigit((unsigned char)*file)) {
+			file++;
+		}
+		if (!*file || !strchr("diu", *file)) {
+			return false;
+		}
+		file++;
+		conversions++;
+	}
+	return conversions == 1;
+}
+
+/* Start capturing, if requested */
+static void initCapture(FrameCapture *fc, const AppConfig& cfg)
+{
+	size_t len;
+	int i;
+
+	fc->enabled=false;
+	if (!cfg.captureFile) {
+		return;
+	}
+	fc->file=cfg.captureFile;
+	fc->video=NULL;
+	fc->videoWidth=fc->videoHeight=0;
+	fc->fps=(cfg.targetFps > 0.0)?(int)(cfg.targetFps + 0.5):60;
+	len=strlen(fc->file);
+	if (len > 4 && !strcmp(fc->file + len - 4, ".y4m")) {
+		fc->video=fopen(fc->file, "wb");
+		if (!fc->video) {
+			warn("capture: failed to open '%s'", fc->file);
+			return;
+		}
+	}
+	for (i=0; i<CAPTURE_SLOTS; i++) {
+		CaptureSlot& s=fc->slot[i];
+		glGenBuffers(1, &s.pbo);
+		s.size=0;
+		s.ptr=NULL;
+		s.fence=0;
+		s.width=s.height=0;
+		s.frame=0;
+		s.state=CAPTURE_FREE;
+	}
+	fc->next=0;
+	fc->frame=0;
+	fc->stalls=0;
+	fc->written=0;
+	fc->stop=false;
+	fc->thread=std::thread(captureThread, fc);
+	fc->enabled=true;
+	info("capture: writing frames to '%s'%s", fc->file,
+		(GLAD_GL_ARB_buffer_storage)?", using persistently mapped PBOs":"");
+}
+
+/* Make sure the slot's PBO can hold size bytes, the slot must be free */
+static void captureSlotResize(CaptureSlot& s, GLsizeiptr size)
+{
+	if (s.size >= size) {
+		return;
+	}
+	if (GLAD_GL_ARB_buffer_storage) {
+		/* the storage is immutable, so we need a new buffer */
+		GLbitfield flags=GL_MAP_READ_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+		if (s.ptr) {
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, s.pbo);
+			glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+			gpuMemUntrack(GPU_MEM_BUFFERS, s.pbo);
+			glDeleteBuffers(1, &s.pbo);
+			glGenBuffers(1, &s.pbo);
+		}
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, s.pbo);
+		glBufferStorage(GL_PIXEL_PACK_BUFFER, size, NULL, flags);
+		s.ptr=(GLubyte*)glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, size, flags);
+	} else {
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, s.pbo);
+		glBufferData(GL_PIXEL_PACK_BUFFER, size, NULL, GL_STREAM_READ);
+		s.copy.resize(size);
+	}
+	s.size=size;
+	gpuMemTrack(GPU_MEM_BUFFERS, s.pbo, (size_t)size);
+}
+
+/* Hand a slot the GPU finished (or will have finished, if wait is set)
+ * to the writer thread. Returns false if the GPU isn't done yet. */
+static bool captureRetire(FrameCapture *fc, CaptureSlot& s, bool wait)
+{
+	GLenum res;
+	do {
+		res=glClientWaitSync(s.fence, (wait)?GL_SYNC_FLUSH_COMMANDS_BIT:0, (wait)?100000000:0);
+	} while (wait && res == GL_TIMEOUT_EXPIRED);
+	if (res == GL_TIMEOUT_EXPIRED) {
+		return false;
+	}
+	glDeleteSync(s.fence);
+	s.fence=0;
+	if (!s.ptr) {
+		GLsizeiptr size=(GLsizeiptr)s.width * s.height * 4;
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, s.pbo);
+		void *ptr=glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, size, GL_MAP_READ_BIT);
+		if (ptr) {
+			memcpy(s.copy.data(), ptr, size);
+			glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+		}
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	}
+	std::lock_guard<std::mutex> lock(fc->mutex);
+	s.state=CAPTURE_WRITING;
+	fc->queue.push_back((unsigned int)(&s - fc->slot));
+	fc->cond.notify_all();
+	return true;
+}
+
+/* Read back the current frame of the window of size w x h. Call this
+ * after the frame is complete, but before the buffer swap. */
+static void captureFrame(FrameCapture *fc, int w, int h)
+{
+	unsigned int i;
+
+	if (!fc->enabled) {
+		return;
+	}
+
+	/* hand the finished frames to the writer, oldest first */
+	for (i=0; i<CAPTURE_SLOTS; i++) {
+		CaptureSlot& s=fc->slot[(fc->next + i) % CAPTURE_SLOTS];
+		if (s.state == CAPTURE_READING && !captureRetire(fc, s, false)) {
+			break;
+		}
+	}
+
+	/* get the slot for this frame */
+	CaptureSlot& s=fc->slot[fc->next];
+	if (s.state == CAPTURE_READING) {
+		fc->stalls++;
+		captureRetire(fc, s, true);
+	}
+	{
+		std::unique_lock<std::mutex> lock(fc->mutex);
+		if (s.state != CAPTURE_FREE) {
+			/* the writer can't keep up */
+			fc->stalls++;
+			fc->cond.wait(lock, [&s]{return s.state == CAPTURE_FREE;});
+		}
+	}
+	if (fc->video && !fc->videoWidth) {
+		fc->videoWidth=w;
+		fc->videoHeight=h;
+		fprintf(fc->video, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C420jpeg\n", w, h, fc->fps);
+	}
+
+	captureSlotResize(s, (GLsizeiptr)w * h * 4);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, s.pbo);
+	glPixelStorei(GL_PACK_ALIGNMENT, 4);
+	glReadBuffer(GL_BACK);
+	/* BGRA is the native layout of most drivers */
+	glReadPixels(0, 0, w, h, GL_BGRA, GL_UNSIGNED_BYTE, BUFFER_OFFSET(0));
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	s.fence=glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	s.width=w;
+	s.height=h;
+	s.frame=fc->frame++;
+	s.state=CAPTURE_READING;
+	fc->next=(fc->next + 1) % CAPTURE_SLOTS;
+}
+
+/* Print the capture statistics since the last call */
+static void captureReport(FrameCapture *fc)
+{
+	if (fc->enabled) {
+		unsigned int written;
+		{
+			std::lock_guard<std::mutex> lock(fc->mutex);
+			written=fc->written;
+			fc->written=0;
+		}
+		info("capture: %u frames captured, %u written, %u stalls", fc->frame, written, fc->stalls);
+		fc->stalls=0;
+	}
+}
+
+/* Write the remaining frames and stop the writer */
+static void destroyCapture(FrameCapture *fc)
+{
+	int i;
+
+	if (!fc->enabled) {
+		return;
+	}
+	for (i=0; i<CAPTURE_SLOTS; i++) {
+		CaptureSlot& s=fc->slot[(fc->next + i) % CAPTURE_SLOTS];
+		if (s.state == CAPTURE_READING) {
+			captureRetire(fc, s, true);
+		}
+	}
+	{
+		std::lock_guard<std::mutex> lock(fc->mutex);
+		fc->stop=true;
+		fc->cond.notify_all();
+	}
+	fc->thread.join();
+	for (i=0; i<CAPTURE_SLOTS; i++) {
+		CaptureSlot& s=fc->slot[i];
+		if (s.ptr) {
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, s.pbo);
+			glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+		}
+		gpuMemUntrack(GPU_MEM_BUFFERS, s.pbo);
+		glDeleteBuffers(1, &s.pbo);
+	}
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	if (fc->video) {
+		fclose(fc->video);
+	}
+	info("capture: %u frames written to '%s'", fc->frame, fc->file);
+	fc->enabled=false;
+}
 
-	/* set up VAO and vertex and element array buffers */
-	glGenVertexArrays(1,&cube->vao);
-	glBindVertexArray(cube->vao);
-	info("Cube: created VAO %u", cube->vao);
+/****************************************************************************
+ * INPUT HANDLING, RECORDING AND REPLAY                                     *
+ ****************************************************************************/
 
-	glGenBuffers(2,cube->vbo);
-	glBindBuffer(GL_ARRAY_BUFFER, cube->vbo[0]);
-	glBufferData(GL_ARRAY_BUFFER, sizeof(cubeGeometry), cubeGeometry, GL_STATIC_DRAW);
-	info("Cube: created VBO %u for %u bytes of vertex data", cube->vbo[0], (unsigned)sizeof(cubeGeometry));
+/* With a fixed time step, the simulation only depends on the frame number
+ * and the input, so we record the keyboard events with the frame in which
+ * they were handled, and replaying them reproduces the run exactly. The
+ * file format is text: a header line, then one "frame key action" line
+ * per event. While replaying, the live input is ignored, except for ESC. */
 
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, cube->vbo[1]);
-	glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(cubeConnectivity), cubeConnectivity, GL_STATIC_DRAW);
-	info("Cube: created VBO %u for %u bytes of element data", cube->vbo[1], (unsigned)sizeof(cubeConnectivity));
+#define INPUT_LOG_HEADER "HelloCube input log 1"
 
-	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), BUFFER_OFFSET(offsetof(Vertex,pos)));
-	glVertexAttribPointer(2, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(Vertex), BUFFER_OFFSET(offsetof(Vertex,clr)));
+/* Handle a key event, live or replayed */
+static void processKey(CubeApp *app, int key, int action)
+{
+	if (action == GLFW_RELEASE) {
+		app->pressedKeys[key] = false;
+	} else {
+		if (!app->pressedKeys[key]) {
+			/* handle certain keys */
+			if (key >= '0' && key <= '9') {
+				/* the shaders are loaded by the render thread, which
+				 * owns the GL context */
+				app->requestedShader=key - '0';
+			} else {
+				switch (key) {
+					case GLFW_KEY_ESCAPE:
+						/* in any window, quits the application */
+						glfwSetWindowShouldClose(app->win,1);
+						break;
+					case GLFW_KEY_SPACE:
+						app->animate=!app->animate;
+						break;
+					case GLFW_KEY_H:
+						app->showHud=!app->showHud;
+						break;
+				}
+			}
+		}
+		app->pressedKeys[key] = true;
+	}
+}
 
-	glEnableVertexAttribArray(0);
-	glEnableVertexAttribArray(2);
+/* Open the record file and load the replay file. Returns false on error. */
+static bool initInputLog(InputLog *il, const AppConfig& cfg)
+{
+	il->record=NULL;
+	il->next=0;
+	il->replaying=false;
+
+	if (cfg.replayFile) {
+		char line[256];
+		FILE *f=fopen(cfg.replayFile, "rt");
+		if (!f) {
+			warn("failed to open input log '%s'", cfg.replayFile);
+			return false;
+		}
+		if (!fgets(line, sizeof(line), f) || strncmp(line, INPUT_LOG_HEADER, strlen(INPUT_LOG_HEADER))) {
+			warn("'%s' is not an input log", cfg.replayFile);
+			fclose(f);
+			return false;
+		}
+		double dt=0.0;
+		sscanf(line + strlen(INPUT_LOG_HEADER), " dt %lf", &dt);
+		if (dt != cfg.fixedDt) {
+			warn("input log '%s' was recorded with --fixed-dt %g, replaying with %g, the run will differ",
+				cfg.replayFile, dt, cfg.fixedDt);
+		}
+		while (fgets(line, sizeof(line), f)) {
+			InputEvent e;
+			if (sscanf(line, "%u %d %d", &e.frame, &e.key, &e.action) == 3 &&
+			    e.key >= 0 && e.key <= GLFW_KEY_LAST) {
+				il->events.push_back(e);
+			}
+		}
+		fclose(f);
+		il->replaying=true;
+		info("replaying %u input events from '%s'", (unsigned)il->events.size(), cfg.replayFile);
+	}
 
-	glBindVertexArray(0);
-	glBindBuffer(GL_ARRAY_BUFFER, 0);
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+	if (cfg.recordFile) {
+		il->record=fopen(cfg.recordFile, "wt");
+		if (!il->record) {
+			warn("failed to create input log '%s'", cfg.recordFile);
+			return false;
+		}
+		fprintf(il->record, INPUT_LOG_HEADER " dt %.17g\n", cfg.fixedDt);
+		info("recording the input to '%s'", cfg.recordFile);
+	}
+	return true;
+}
 
-	cube->model = glm::mat4(1.0f);
-	GL_ERROR_DBG("cube initialization");
+/* Close the record file */
+static void destroyInputLog(InputLog *il)
+{
+	if (il->record) {
+		fclose(il->record);
+		il->record=NULL;
+	}
+	il->events.clear();
 }
 
-/* Destroy all GL objects related to the cube. */
-static void destroyCube(Cube *cube)
+/* Record an event handled in frame "frame" */
+static void inputRecord(InputLog *il, unsigned int frame, int key, int action)
 {
-	glBindVertexArray(0);
-	if (cube->vao) {
-		info("Cube: deleting VAO %u", cube->vao);
-		glDeleteVertexArrays(1,&cube->vao);
-		cube->vao=0;
+	if (il->record) {
+		fprintf(il->record, "%u %d %d\n", frame, key, action);
 	}
-	if (cube->vbo[0] || cube->vbo[1]) {
-		info("Cube: deleting VBOs %u %u", cube->vbo[0], cube->vbo[1]);
-		glDeleteBuffers(2,cube->vbo);
-		cube->vbo[0]=0;
-		cube->vbo[1]=0;
+}
+
+/* Replay the events of the upcoming frame */
+static void inputReplay(CubeApp *app)
+{
+	InputLog *il=&app->input;
+
+	while (il->next < il->events.size() && il->events[il->next].frame <= app->frame) {
+		const InputEvent& e=il->events[il->next++];
+		inputRecord(il, app->frame, e.key, e.action);
+		processKey(app, e.key, e.action);
 	}
 }
 
@@ -672,9 +7252,19 @@ static void destroyCube(Cube *cube)
 static void callback_Resize(GLFWwindow *win, int w, int h)
 {
 	CubeApp *app=(CubeApp*)glfwGetWindowUserPointer(win);
+	int i;
 	info("new framebuffer size: %dx%d pixels",w,h);
 
-	/* store curent size for later use in the main loop */
+	/* the view windows share this callback */
+	for (i=0; i<app->viewCount; i++) {
+		if (app->views[i].win == win) {
+			app->views[i].width=w;
+			app->views[i].height=h;
+			return;
+		}
+	}
+
+	/* store curent size for later use in the render loop */
 	app->width=w;
 	app->height=h;
 
@@ -685,22 +7275,6 @@ static void callback_Resize(GLFWwindow *win, int w, int h)
  * will call this whenever a key is pressed. */
 static void callback_Keyboard(GLFWwindow *win, int key, int scancode, int action, int mods)
 {
-	/* The shaders we load on the number keys. We always load a combination of
-	 * a vertex and a fragment shader. */
-	static const char* shaders[][2]={
-		/* 0 */ {"shaders/minimal.vs.glsl", "shaders/minimal.fs.glsl"},
-		/* 1 */ {"shaders/color.vs.glsl", "shaders/color.fs.glsl"},
-		/* 2 */ {"shaders/cut.vs.glsl", "shaders/cut.fs.glsl"},
-		/* 3 */ {"shaders/wobble.vs.glsl", "shaders/color.fs.glsl"},
-		/* 4 */ {"shaders/experimental.vs.glsl", "shaders/experimental.fs.glsl"},
-		/* placeholders for additional shaders */
-		/* 5 */ {"shaders/yourshader.vs.glsl", "shaders/yourshader.fs.glsl"},
-		/* 6 */ {"shaders/yourshader.vs.glsl", "shaders/yourshader.fs.glsl"},
-		/* 7 */ {"shaders/yourshader.vs.glsl", "shaders/yourshader.fs.glsl"},
-		/* 8 */ {"shaders/yourshader.vs.glsl", "shaders/yourshader.fs.glsl"},
-		/* 9 */ {"shaders/yourshader.vs.glsl", "shaders/yourshader.fs.glsl"}
-	};
-
 	CubeApp *app=(CubeApp*)glfwGetWindowUserPointer(win);
 
 	if (key < 0 || key > GLFW_KEY_LAST) {
@@ -708,23 +7282,150 @@ static void callback_Keyboard(GLFWwindow *win, int key, int scancode, int action
 		return;
 	}
 
-	if (action == GLFW_RELEASE) {
-		app->pressedKeys[key] = false;
-	} else {
-		if (!app->pressedKeys[key]) {
-			/* handle certain keys */
-			if (key >= '0' && key <= '9') {
-				initShaders(app, shaders[key - '0'][0], shaders[key - '0'][1]);
-			} else {
-				switch (key) {
-					case GLFW_KEY_ESCAPE:
-						glfwSetWindowShouldClose(win,1);
-						break;
-				}
+	latencyInput(&app->latency, glfwGetTime());
+
+	if (app->input.replaying && key != GLFW_KEY_ESCAPE) {
+		return;
+	}
+	/* the events are handled before the frame app->frame is rendered */
+	inputRecord(&app->input, app->frame, key, action);
+	processKey(app, key, action);
+}
+
+/* Closing any of the view windows quits the application */
+static void callback_ViewClose(GLFWwindow *win)
+{
+	CubeApp *app=(CubeApp*)glfwGetWindowUserPointer(win);
+	glfwSetWindowShouldClose(app->win,1);
+}
+
+/****************************************************************************
+ * MULTIPLE WINDOWS                                                         *
+ ****************************************************************************/
+
+/* Every window beyond the first is a view window with a context sharing
+ * the buffers, textures and programs of the main context. The main render
+ * loop owns the scene: while it updates the shared objects, it holds the
+ * mutex of the SharedFrame, and then publishes a fence and a copy of the
+ * draw list, so that the view contexts can make their GPU wait for the
+ * updates. The views only hold the mutex to copy the frame, and draw and
+ * swap in their own threads, so the windows don't serialize on the CPU.
+ * Each view has its own program, since uniform values are program state.
+ * The shared objects stay valid while a view draws an older frame: the
+ * main context lets its GPU wait for the views' last frames before it
+ * modifies them, and replaced arena buffers live on as long as a view's
+ * VAO still references them. */
+
+/* Create the view windows. On failure, we just continue with fewer. */
+static void initViewWindows(CubeApp *app, const AppConfig& cfg)
+{
+	GLFWmonitor **monitors=NULL;
+	int monitorCount=0;
+	int i, x, y;
+
+	app->shared.frame=0;
+	app->shared.time=app->timeCur;
+	if (cfg.fullscreen) {
+		monitors=glfwGetMonitors(&monitorCount);
+	}
+	glfwGetWindowPos(app->win, &x, &y);
+
+	for (i=0; i + 1 < cfg.windows && i < MAX_VIEW_WINDOWS; i++) {
+		ViewWindow *v=&app->views[i];
+		GLFWmonitor *monitor=NULL;
+		char title[64];
+		int w=cfg.width;
+		int h=cfg.height;
+
+		/* in fullscreen mode, use one monitor per window, the main
+		 * window is on the primary one */
+		if (i + 1 < monitorCount) {
+			const GLFWvidmode *mode=glfwGetVideoMode(monitors[i + 1]);
+			if (mode) {
+				monitor=monitors[i + 1];
+				w=mode->width;
+				h=mode->height;
 			}
 		}
-		app->pressedKeys[key] = true;
+
+		mysnprintf(title, sizeof(title), APP_TITLE " - view %d", i + 1);
+		v->win=glfwCreateWindow(w, h, title, monitor, app->win);
+		if (!v->win) {
+			warn("failed to create view window %d", i + 1);
+			break;
+		}
+		if (!monitor) {
+			glfwSetWindowPos(v->win, x + (i + 1) * (cfg.width + 16), y);
+		}
+		glfwGetFramebufferSize(v->win, &w, &h);
+		v->width=w;
+		v->height=h;
+		v->vao=0;
+		v->arenaGeneration=0;
+		v->prog.program=0;
+		v->shaderGeneration=0;
+		v->done=0;
+		glfwSetWindowUserPointer(v->win, app);
+		glfwSetFramebufferSizeCallback(v->win, callback_Resize);
+		glfwSetKeyCallback(v->win, callback_Keyboard);
+		glfwSetWindowCloseCallback(v->win, callback_ViewClose);
+		app->viewCount=i + 1;
+	}
+	if (app->viewCount) {
+		info("created %d additional view windows", app->viewCount);
+	}
+}
+
+/* Destroy the view windows, their threads must have finished already */
+static void destroyViewWindows(CubeApp *app)
+{
+	int i;
+
+	for (i=0; i<app->viewCount; i++) {
+		glfwDestroyWindow(app->views[i].win);
+	}
+	app->viewCount=0;
+	if (app->shared.fence) {
+		glDeleteSync(app->shared.fence);
+		app->shared.fence=0;
+	}
+}
+
+/* Make the GPU wait until the view windows finished drawing their last
+ * frame before the main context modifies the shared objects. This doesn't
+ * block the CPU. The caller must hold the mutex. */
+static void sharedFrameWaitViews(CubeApp *app)
+{
+	int i;
+
+	for (i=0; i<app->viewCount; i++) {
+		if (app->views[i].done) {
+			glWaitSync(app->views[i].done, 0, GL_TIMEOUT_IGNORED);
+		}
+	}
+}
+
+/* Called by the main render loop when the shared objects are up to date
+ * for the current frame. The caller must hold the mutex. */
+static void sharedFramePublish(CubeApp *app)
+{
+	SharedFrame *sf=&app->shared;
+
+	if (sf->fence) {
+		/* the view contexts only use it while holding the mutex */
+		glDeleteSync(sf->fence);
 	}
+	sf->fence=glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	/* other contexts can only wait for a fence which was flushed */
+	glFlush();
+	sf->time=app->timeCur;
+	sf->draws=app->draws;
+	sf->arenaGeneration=app->scene.arena.generation;
+	sf->shaderGeneration=app->shaderGeneration;
+	sf->vs=app->shaderVs;
+	sf->fs=app->shaderFs;
+	sf->frame++;
+	sf->cond.notify_all();
 }
 
 /****************************************************************************
@@ -734,7 +7435,7 @@ static void callback_Keyboard(GLFWwindow *win, int key, int scancode, int action
 /* Initialize the Cube Application.
  * This will initialize the app object, create a windows and OpenGL context
  * (via GLFW), initialize the GL function pointers via GLEW and initialize
- * the cube.
+ * the scene.
  * Returns true if successfull or false if an error occured. */
 bool initCubeApplication(CubeApp *app, const AppConfig& cfg)
 {
@@ -751,9 +7452,38 @@ bool initCubeApplication(CubeApp *app, const AppConfig& cfg)
 
 	for (i=0; i<=GLFW_KEY_LAST; i++)
 		app->pressedKeys[i]=app->releasedKeys[i]=false;
+	app->animate=true;
+	app->requestedShader=-1;
+	app->quit=false;
+	app->titleChanged=false;
+	app->simStep=1.0 / ((cfg.simRate > 0.0)?cfg.simRate:120.0);
+	app->renderedRotation=glm::quat(1.0f, 0.0f, 0.0f, 0.0f);
+	profilerInit(cfg.traceFile);
+	if (!initInputLog(&app->input, cfg)) {
+		return false;
+	}
 
-	app->cube.vbo[0]=app->cube.vbo[1]=app->cube.vao=0;
-	app->program=0;
+	app->scene.arena.vbo[0]=app->scene.arena.vbo[1]=app->scene.arena.vao=0;
+	app->streamer.running=false;
+	app->texture.tex=0;
+	app->pixelRing.pbo[0]=0;
+	app->drawExtent=0.0f;
+	app->latency.enabled=false;
+	app->viewCount=0;
+	app->shared.fence=0;
+	app->target.enabled=false;
+	app->target.fbo=app->target.resolveFbo=0;
+	app->resolution.enabled=false;
+	app->perf.backend=PERF_NONE;
+	app->drawStats.enabled=false;
+	app->drawStats.summary[0]=0;
+	app->hud.enabled=false;
+	app->metrics.enabled=false;
+	app->bench.enabled=false;
+	app->showHud=true;
+	app->capture.enabled=false;
+	app->prog.program=0;
+	app->shaderGeneration=0;
 
 	/* initialize GLFW library */
 	info("initializing GLFW");
@@ -797,6 +7527,10 @@ bool initCubeApplication(CubeApp *app, const AppConfig& cfg)
 	if (!cfg.decorated) {
 		glfwWindowHint(GLFW_DECORATED, GL_FALSE);
 	}
+	if (cfg.goldenDir || cfg.benchFile) {
+		/* the tests and benchmarks render offscreen, nobody needs to see it */
+		glfwWindowHint(GLFW_VISIBLE, GL_FALSE);
+	}
 
 	/* create the window and the gl context */
 	info("creating window and OpenGL context");
@@ -826,7 +7560,7 @@ bool initCubeApplication(CubeApp *app, const AppConfig& cfg)
 	/* ask the driver to enable synchronizing the buffer swaps to the
 	 * VBLANK of the display. Depending on the driver and the user's
 	 * setting, this may have no effect. But we can try... */
-	glfwSwapInterval(1);
+	glfwSwapInterval(cfg.swapInterval);
 
 	/* initialize glad,
 	 * this will load all OpenGL function pointers
@@ -841,19 +7575,53 @@ bool initCubeApplication(CubeApp *app, const AppConfig& cfg)
 		warn("failed to load at least GL 3.2 functions via GLAD");
 		return false;
 	}
+#ifdef HELLOCUBE_GLTRACE
+	info("tracing GL calls");
+	gltraceInstall();
+#endif
 
 	app->flags |= APP_HAVE_GL;
 
 	/* initialize the GL context */
 	initGLState(cfg);
-	initCube(&app->cube);
-	if (!initShaders(app,"shaders/color.vs.glsl","shaders/color.fs.glsl")) {
+	initGpuMemory(cfg);
+	profilerInitGL();
+	initScene(&app->scene, cfg);
+	initStreamer(&app->streamer, cfg);
+	if (cfg.deterministic && !streamerFinish(&app->streamer, &app->scene)) {
+		warn("Streamer: mesh files still loading after %.0f seconds, the run will not be reproducible",
+			STREAM_FINISH_TIMEOUT);
+	}
+	initTexture(&app->texture, &app->pixelRing, cfg);
+	initLatency(&app->latency, cfg, monitor);
+	initPacer(&app->pacer, cfg);
+	initFrameQueue(&app->frameQueue, cfg);
+	initRenderTarget(&app->target, cfg);
+	initResolution(&app->resolution, &app->target, cfg);
+	initPerfCounters(&app->perf, cfg);
+	initDrawStats(&app->drawStats, cfg, app->perf);
+	initHud(&app->hud, cfg);
+	initMetrics(&app->metrics, cfg);
+	initBenchmark(&app->bench, cfg);
+	initCapture(&app->capture, cfg);
+	if (!initShaders(app, shaderFiles[cfg.shader][0], shaderFiles[cfg.shader][1])) {
 		warn("something wrong with our shaders...");
 		return false;
 	}
+	gpuMemReport(true);
+	if (!gpuMemWithinBudget()) {
+		warn("the scene does not fit into the GPU memory budget of %u MiB", cfg.gpuBudget);
+		return false;
+	}
+
+	/* initialize the timer and the simulation, the virtual clock starts
+	 * at 0 */
+	app->timeFrame=glfwGetTime();
+	app->timeCur=(cfg.fixedDt > 0.0)?0.0:app->timeFrame;
+	simInit(&app->sim, app->timeCur);
+	handoffInit(&app->handoff, app->sim);
 
-	/* initialize the timer */
-	app->timeCur=glfwGetTime();
+	initViewWindows(app, cfg);
 
 	return true;
 }
@@ -861,39 +7629,103 @@ bool initCubeApplication(CubeApp *app, const AppConfig& cfg)
 /* Clean up: destroy everything the cube app still holds */
 static void destroyCubeApp(CubeApp *app)
 {
+	destroyInputLog(&app->input);
 	if (app->flags & APP_HAVE_GLFW) {
 		if (app->win) {
 			if (app->flags & APP_HAVE_GL) {
-				destroyCube(&app->cube);
+				destroyViewWindows(app);
+				profilerDestroyGL();
+				destroyCapture(&app->capture);
+				destroyMetrics(&app->metrics);
+				destroyHud(&app->hud);
+				destroyDrawStats(&app->drawStats);
+				destroyPerfCounters(&app->perf);
+				destroyResolution(&app->resolution);
+				destroyRenderTarget(&app->target);
+				destroyFrameQueue(&app->frameQueue);
+				destroyLatency(&app->latency);
+				destroyTexture(&app->texture, &app->pixelRing);
+				destroyStreamer(&app->streamer);
+				destroyScene(&app->scene);
 				destroyShaders(app);
+				destroyGpuMemory();
 			}
 			glfwDestroyWindow(app->win);
 		}
 		glfwTerminate();
 	}
+	/* all other threads have finished now */
+	debugFlush(app->frame);
+	profilerWrite();
 }
 
 /****************************************************************************
  * DRAWING FUNCTION                                                         *
  ****************************************************************************/
 
-/* This draws the complete scene for a single eye */
+/* Collect what drawScene() needs from the scene, so that the view windows
+ * can draw a copy of it without holding the lock of the SharedFrame.
+ * Returns the largest ratio of object size to distance from the viewer,
+ * so that textureTargetLevel() doesn't need to walk the objects again. */
+static float sceneBuildDrawList(const Scene& scene, const glm::mat4& view, std::vector<DrawItem>& draws)
+{
+	float extent=0.0f;
+	size_t i;
+
+	draws.resize(scene.objects.size());
+	for (i=0; i<scene.objects.size(); i++) {
+		const SceneObject& obj=scene.objects[i];
+		const Mesh& mesh=scene.meshes[obj.mesh];
+		const glm::mat4& model=scene.graph.world[obj.node];
+		draws[i].model=model;
+		draws[i].indexCount=mesh.indexCount;
+		draws[i].firstIndex=mesh.firstIndex;
+		draws[i].baseVertex=mesh.baseVertex;
+
+		/* only the x axis and the origin of the object are needed */
+		float size=2.0f * glm::length(glm::vec3(view * model[0]));
+		float dist=glm::max(-(view * model[3]).z - 0.5f * size, 0.1f);
+		extent=glm::max(extent, size / dist);
+	}
+	return extent;
+}
+
+/* This draws the complete scene for a single eye, the arena VAO and the
+ * program must belong to the current context. If stats is not NULL, the
+ * draw calls are measured with it. */
 static void
-drawScene(CubeApp *app)
+drawScene(const SceneProgram& prog, GLuint texture, GLuint vao, const std::vector<DrawItem>& draws,
+	const glm::mat4& projection, const glm::mat4& view, double time, DrawStats *stats)
 {
-	/* combine model and view matrices to the modelView matrix our
-	 * shader expects */
-	glm::mat4 modelView = app->view * app->cube.model;
+	PROFILE_ZONE("drawScene");
+	size_t i;
 
 	/* use the program and update the uniforms */
-	glUseProgram(app->program);
-	glUniformMatrix4fv(app->locProjection, 1, GL_FALSE, glm::value_ptr(app->projection));
-	glUniformMatrix4fv(app->locModelView, 1, GL_FALSE, glm::value_ptr(modelView));
-	glUniform1f(app->locTime, (GLfloat)app->timeCur);
-
-	/* draw the cube */
-	glBindVertexArray(app->cube.vao);
-	glDrawElements(GL_TRIANGLES, 6 * 6, GL_UNSIGNED_SHORT, BUFFER_OFFSET(0));
+	glUseProgram(prog.program);
+	glUniformMatrix4fv(prog.locProjection, 1, GL_FALSE, glm::value_ptr(projection));
+	glUniform1f(prog.locTime, (GLfloat)time);
+
+	/* bind the texture, only the textured shaders actually use it */
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, texture);
+
+	/* draw the objects, all meshes live in the same arena, so we
+	 * bind the VAO only once */
+	glBindVertexArray(vao);
+	for (i=0; i<draws.size(); i++) {
+		const DrawItem& d=draws[i];
+		/* combine model and view matrices to the modelView matrix our
+		 * shader expects */
+		glm::mat4 modelView = view * d.model;
+		glUniformMatrix4fv(prog.locModelView, 1, GL_FALSE, glm::value_ptr(modelView));
+		drawStatsBegin(stats, i);
+		glDrawElementsBaseVertex(GL_TRIANGLES, d.indexCount, GL_UNSIGNED_INT,
+			BUFFER_OFFSET(d.firstIndex * sizeof(GLuint)), d.baseVertex);
+		drawStatsEnd(stats, i, draws.size());
+	}
+	if (stats) {
+		drawStatsFrameEnd(stats, draws.size());
+	}
 
 	/* "unbind" the VAO and the program. We do not have to do this.
 	* OpenGL is a state machine. The last binings will stay effective
@@ -917,76 +7749,577 @@ setProjectionAndView(CubeApp *app)
 static void
 displayFunc(CubeApp *app, const AppConfig& cfg)
 {
-	/* rotate the cube */
-	app->cube.model = glm::rotate(app->cube.model, (float)(glm::half_pi<double>() * app->timeDelta), glm::vec3(0.8f, 0.6f, 0.1f));
+	PROFILE_ZONE("displayFunc");
+	profilerCollectGpu();
+	GPU_ZONE("frame");
+
+	perfFrameBegin(&app->perf);
+	drawStatsFrameBegin(&app->drawStats);
+	metricsGpuBegin(&app->metrics);
+
+	{
+		/* the view windows must not copy the frame while we modify
+		 * the scene and the shared GL objects, but they draw their
+		 * copy concurrently with us */
+		std::unique_lock<std::mutex> lock(app->shared.mutex);
+		sharedFrameWaitViews(app);
+
+		/* load the shader selected on the keyboard */
+		int shader=app->requestedShader.exchange(-1);
+		if (shader >= 0) {
+			initShaders(app, shaderFiles[shader][0], shaderFiles[shader][1]);
+		}
 
-	/* set the viewport (might have changed since last iteration) */
-	glViewport(0, 0, app->width, app->height);
+		/* pick up mesh data streamed in the background */
+		streamerUpdate(&app->streamer, &app->scene);
+
+		/* move the scene according to the simulation, the graph then
+		 * updates the world matrices of everything below the root */
+		simApply(app, cfg, app->timeCur);
+		sceneGraphUpdate(&app->scene.graph);
+		setProjectionAndView(app);
+		app->drawExtent=sceneBuildDrawList(app->scene, app->view, app->draws);
+
+		/* the window size might have changed since last iteration,
+		 * with offscreen rendering, we render at a different size */
+		int winWidth=app->width;
+		int winHeight=app->height;
+		int w=winWidth;
+		int h=winHeight;
+		resolutionUpdate(&app->resolution, &app->target);
+		resolutionBegin(&app->resolution);
+		renderTargetBegin(&app->target, &w, &h);
+
+		textureUpdate(&app->texture, &app->pixelRing, app->drawExtent, app->projection, h);
+		if (app->viewCount) {
+			sharedFramePublish(app);
+		}
+		lock.unlock();
 
-	glClearColor(0.3f, 0.3f, 0.3f, 1.0f);
-	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT); /* clear the buffers */
+		/* set the viewport */
+		glViewport(0, 0, w, h);
 
-	setProjectionAndView(app);
-	drawScene(app);
+		glClearColor(0.3f, 0.3f, 0.3f, 1.0f);
+		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT); /* clear the buffers */
+
+		{
+			GPU_ZONE("scene");
+			perfBegin(&app->perf, PERF_PASS_SCENE);
+			drawScene(app->prog, app->texture.tex, app->scene.arena.vao, app->draws,
+				app->projection, app->view, app->timeCur, &app->drawStats);
+			perfEnd(&app->perf, PERF_PASS_SCENE);
+		}
+		{
+			GPU_ZONE("resolve");
+			perfBegin(&app->perf, PERF_PASS_RESOLVE);
+			renderTargetEnd(&app->target, winWidth, winHeight);
+			perfEnd(&app->perf, PERF_PASS_RESOLVE);
+		}
+		resolutionEnd(&app->resolution);
+		perfFrameEnd(&app->perf);
+	}
+
+	/* read back the frame before it is gone */
+	captureFrame(&app->capture, app->width, app->height);
+
+	/* the HUD is not part of the captured frames */
+	if (app->hud.enabled && app->showHud) {
+		int w=app->width;
+		int h=app->height;
+		hudBuild(&app->hud, app, w, h);
+		hudDraw(&app->hud, w, h);
+	}
+	metricsGpuEnd(&app->metrics);
 
 	/* finished with drawing, swap FRONT and BACK buffers to show what we
 	 * have rendered */
-	glfwSwapBuffers(app->win);
+	{
+		PROFILE_ZONE("swap");
+		glfwSwapBuffers(app->win);
+	}
+	frameQueueEnd(&app->frameQueue);
+	pacerFrameEnd(&app->pacer);
+	latencyFrameEnd(&app->latency, app->timeFrame);
 
 	/* In DEBUG builds, we also check for GL errors in the display
 	 * function, to make sure no GL error goes unnoticed. */
 	GL_ERROR_DBG("display function");
 }
 
+/****************************************************************************
+ * GOLDEN IMAGE TESTS                                                       *
+ ****************************************************************************/
+
+/* Instead of running the main loop, render one deterministic frame per
+ * shader slot and compare it to the golden image slot$n.png in the golden
+ * directory. The time is fixed, the simulation runs from time 0, and we
+ * wait until all meshes are loaded and all needed texture levels are
+ * resident, so the frames don't depend on the timing of the run. The
+ * frames are rendered into the offscreen target at the configured window
+ * size, so the window may be hidden, and this works headless on Mesa's
+ * llvmpipe, e.g. via xvfb-run.
+ * Different GPUs and drivers never produce identical images, so the
+ * comparison is perceptual: a pixel only counts as different if its CIE76
+ * color difference to all pixels in the 3x3 neighborhood in the golden
+ * image exceeds the tolerance, which ignores small shifts of the edges.
+ * A test fails if more than GOLDEN_MAX_BAD_FRACTION of the pixels differ.
+ * For failed tests, we write slot$n.actual.png and slot$n.diff.png. */
+
+#define GOLDEN_TIME		1.0	/* the time of the rendered frames */
+#define GOLDEN_SETTLE_TIMEOUT	10.0	/* max. time in seconds to wait for streaming */
+#define GOLDEN_MAX_BAD_FRACTION	0.001	/* max. fraction of different pixels */
+
+/* Convert BGRA pixels to CIE L*a*b* */
+static void goldenToLab(const std::vector<GLubyte>& bgra, std::vector<glm::vec3>& lab)
+{
+	size_t i, n=bgra.size() / 4;
+
+	lab.resize(n);
+	for (i=0; i<n; i++) {
+		glm::vec3 c(bgra[4*i+2], bgra[4*i+1], bgra[4*i]);
+		c /= 255.0f;
+		/* sRGB to linear */
+		for (int k=0; k<3; k++) {
+			c[k]=(c[k] <= 0.04045f)?(c[k] / 12.92f):powf((c[k] + 0.055f) / 1.055f, 2.4f);
+		}
+		/* linear to XYZ, relative to the D65 white point */
+		glm::vec3 xyz(
+			(0.4124f * c.r + 0.3576f * c.g + 0.1805f * c.b) / 0.95047f,
+			(0.2126f * c.r + 0.7152f * c.g + 0.0722f * c.b),
+			(0.0193f * c.r + 0.1192f * c.g + 0.9505f * c.b) / 1.08883f);
+		for (int k=0; k<3; k++) {
+			xyz[k]=(xyz[k] > 0.008856f)?cbrtf(xyz[k]):(7.787f * xyz[k] + 16.0f / 116.0f);
+		}
+		lab[i]=glm::vec3(116.0f * xyz.y - 16.0f, 500.0f * (xyz.x - xyz.y), 200.0f * (xyz.y - xyz.z));
+	}
+}
+
+/* Compare image img to the golden image ref, both of size w x h.
+ * Returns the number of different pixels, and creates the diff image. */
+static size_t goldenCompare(const std::vector<GLubyte>& ref, const std::vector<GLubyte>& img, int w, int h,
+			    double tolerance, std::vector<GLubyte>& diff, double *maxDelta)
+{
+	std::vector<glm::vec3> labRef, labImg;
+	size_t bad=0;
+
+	goldenToLab(ref, labRef);
+	goldenToLab(img, labImg);
+	diff.resize(img.size());
+	*maxDelta=0.0;
+	for (int y=0; y<h; y++) {
+		for (int x=0; x<w; x++) {
+			size_t i=(size_t)y * w + x;
+			float best=1.0e30f;
+			for (int dy=-1; dy<=1; dy++) {
+				for (int dx=-1; dx<=1; dx++) {
+					int sx=x + dx, sy=y + dy;
+					if (sx >= 0 && sx < w && sy >= 0 && sy < h) {
+						best=std::min(best, glm::distance(labImg[i], labRef[(size_t)sy * w + sx]));
+					}
+				}
+			}
+			*maxDelta=std::max(*maxDelta, (double)best);
+			/* different pixels in red on a dimmed version of the image */
+			GLubyte *d=&diff[4*i];
+			if (best > tolerance) {
+				d[0]=0; d[1]=0; d[2]=255;
+				bad++;
+			} else {
+				d[0]=d[1]=d[2]=(GLubyte)(labImg[i].x * 0.5f);
+			}
+			d[3]=255;
+		}
+	}
+	return bad;
+}
+
+/* Read back the current contents of the render target */
+static void goldenReadback(const RenderTarget& rt, std::vector<GLubyte>& pixels)
+{
+	int w=rt.renderWidth;
+	int h=rt.renderHeight;
+
+	pixels.resize((size_t)w * h * 4);
+	if (rt.samples) {
+		glBindFramebuffer(GL_READ_FRAMEBUFFER, rt.fbo);
+		glBindFramebuffer(GL_DRAW_FRAMEBUFFER, rt.resolveFbo);
+		glBlitFramebuffer(0, 0, w, h, 0, 0, w, h, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+	}
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, (rt.samples)?rt.resolveFbo:rt.fbo);
+	glPixelStorei(GL_PACK_ALIGNMENT, 4);
+	glReadPixels(0, 0, w, h, GL_BGRA, GL_UNSIGNED_BYTE, pixels.data());
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+/* Check if a file can be opened for reading */
+static bool fileExists(const char *name)
+{
+	FILE *f=fopen(name, "rb");
+	if (f) {
+		fclose(f);
+		return true;
+	}
+	return false;
+}
+
+/* Render the frame for the golden image test at GOLDEN_TIME */
+static void goldenRender(CubeApp *app, const AppConfig& cfg)
+{
+	int w=cfg.width;
+	int h=cfg.height;
+
+	simInit(&app->sim, 0.0);
+	/* make sure the scene graph is updated */
+	app->renderedRotation=glm::quat(0.0f, 0.0f, 0.0f, 0.0f);
+	app->timeCur=GOLDEN_TIME;
+	app->timeDelta=app->simStep;
+	simApply(app, cfg, GOLDEN_TIME);
+	sceneGraphUpdate(&app->scene.graph);
+	setProjectionAndView(app);
+	sceneBuildDrawList(app->scene, app->view, app->draws);
+
+	renderTargetBegin(&app->target, &w, &h);
+	glViewport(0, 0, w, h);
+	glClearColor(0.3f, 0.3f, 0.3f, 1.0f);
+	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+	drawScene(app->prog, app->texture.tex, app->scene.arena.vao, app->draws, app->projection, app->view, GOLDEN_TIME, NULL);
+}
+
+/* Run the golden image tests, returns true if all of them passed */
+static bool goldenRun(CubeApp *app, const AppConfig& cfg)
+{
+	std::vector<GLubyte> img, ref, diff;
+	int passed=0, failed=0, updated=0;
+	char name[1024];
+	size_t i;
+
+	if (!app->target.enabled) {
+		warn("golden: offscreen rendering is not available");
+		return false;
+	}
+	app->width=cfg.width;
+	app->height=cfg.height;
+
+	/* wait for everything which is streamed in */
+	double deadline=glfwGetTime() + GOLDEN_SETTLE_TIMEOUT;
+	setProjectionAndView(app);
+	app->drawExtent=sceneBuildDrawList(app->scene, app->view, app->draws);
+	do {
+		streamerUpdate(&app->streamer, &app->scene);
+		textureUpdate(&app->texture, &app->pixelRing, app->drawExtent, app->projection,
+			cfg.height * app->target.scale / 100);
+		glFinish();
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	} while ((!streamerDone(&app->streamer) || app->texture.residentBase != app->texture.targetBase)
+		 && glfwGetTime() < deadline);
+	/* an incomplete scene could match an equally incomplete image */
+	if (!streamerDone(&app->streamer) || app->texture.residentBase != app->texture.targetBase) {
+		warn("golden: the scene did not finish streaming within %.0f seconds", GOLDEN_SETTLE_TIMEOUT);
+		return false;
+	}
+	if (app->streamer.failed) {
+		warn("golden: %u mesh files failed to load", app->streamer.failed);
+		return false;
+	}
+
+	for (i=0; i<sizeof(shaderFiles)/sizeof(shaderFiles[0]); i++) {
+		if (!fileExists(shaderFiles[i][0]) || !fileExists(shaderFiles[i][1])) {
+			continue;
+		}
+		if (!initShaders(app, shaderFiles[i][0], shaderFiles[i][1])) {
+			warn("golden: slot %u: FAILED, the shaders don't compile", (unsigned)i);
+			failed++;
+			continue;
+		}
+		goldenRender(app, cfg);
+		goldenReadback(app->target, img);
+		int w=app->target.renderWidth;
+		int h=app->target.renderHeight;
+
+		mysnprintf(name, sizeof(name), "%s/slot%u.png", cfg.goldenDir, (unsigned)i);
+		if (cfg.goldenUpdate) {
+			if (pngWrite(name, img.data(), w, h)) {
+				info("golden: slot %u: wrote '%s'", (unsigned)i, name);
+				updated++;
+			} else {
+				failed++;
+			}
+			continue;
+		}
+
+		int rw, rh;
+		if (!pngRead(name, ref, &rw, &rh)) {
+			warn("golden: slot %u: FAILED, can't read '%s'", (unsigned)i, name);
+			failed++;
+			continue;
+		}
+		if (rw != w || rh != h) {
+			warn("golden: slot %u: FAILED, size %dx%d, but '%s' is %dx%d", (unsigned)i, w, h, name, rw, rh);
+			failed++;
+			continue;
+		}
+		double maxDelta;
+		size_t bad=goldenCompare(ref, img, w, h, cfg.goldenTolerance, diff, &maxDelta);
+		if ((double)bad <= GOLDEN_MAX_BAD_FRACTION * (double)w * (double)h) {
+			info("golden: slot %u: passed, %u pixels differ, max. delta E %.2f", (unsigned)i, (unsigned)bad, maxDelta);
+			passed++;
+		} else {
+			warn("golden: slot %u: FAILED, %u pixels differ, max. delta E %.2f", (unsigned)i, (unsigned)bad, maxDelta);
+			mysnprintf(name, sizeof(name), "%s/slot%u.actual.png", cfg.goldenDir, (unsigned)i);
+			pngWrite(name, img.data(), w, h);
+			mysnprintf(name, sizeof(name), "%s/slot%u.diff.png", cfg.goldenDir, (unsigned)i);
+			pngWrite(name, diff.data(), w, h);
+			failed++;
+		}
+	}
+	info("golden: %d passed, %d failed, %d updated", passed, failed, updated);
+	return (failed == 0);
+}
+
 /****************************************************************************
  * MAIN LOOP                                                                *
  ****************************************************************************/
 
+/* Render a single frame: update the timing and statistics and call the
+ * display function.
+ * Returns false if the requested number of frames has been rendered. */
+static bool renderFrame(CubeApp *app, const AppConfig& cfg)
+{
+	/* update the current time and time delta to last frame. With a
+	 * fixed time step, the time only depends on the frame number. */
+	app->timeFrame=glfwGetTime();
+	latencySample(&app->latency);
+	double now=(cfg.fixedDt > 0.0)?((double)(app->frame + 1) * cfg.fixedDt):app->timeFrame;
+	app->timeDelta = now - app->timeCur;
+	app->timeCur = now;
+
+	/* update FPS estimate at most once every second of real time */
+	double elapsed = app->timeFrame - app->timeStats;
+	if (elapsed >= 1.0) {
+		app->avg_frametime=1000.0 * elapsed/(double)app->statFrames;
+		app->avg_fps=(double)app->statFrames/elapsed;
+		frameQueueReport(&app->frameQueue, app->statFrames);
+		glTraceReport(app->statFrames);
+		app->timeStats=app->timeFrame;
+		app->statFrames=0;
+		char pacing[128];
+		pacerReport(&app->pacer, pacing, sizeof(pacing));
+		info("frame time: %4.2fms/frame (%.1ffps)%s",app->avg_frametime, app->avg_fps, pacing);
+		latencyReport(&app->latency);
+		resolutionReport(&app->resolution, app->target);
+		perfReport(&app->perf);
+		drawStatsReport(&app->drawStats);
+		captureReport(&app->capture);
+		gpuMemReport(false);
+		/* update window title */
+		{
+			std::lock_guard<std::mutex> lock(app->titleMutex);
+			mysnprintf(app->title, sizeof(app->title), APP_TITLE "   /// AVG: %4.2fms/frame (%.1ffps)%s", app->avg_frametime, app->avg_fps, app->drawStats.summary);
+			app->titleChanged=true;
+		}
+	}
+
+	/* call the display function */
+	displayFunc(app, cfg);
+	metricsFrame(&app->metrics, app);
+	benchFrame(&app->bench, app);
+	debugFlush(app->frame);
+	app->frame++;
+	app->statFrames++;
+	return !(cfg.frameCount && app->frame >= cfg.frameCount);
+}
+
+/* Set the window title if the render loop changed it. Main thread only. */
+static void updateWindowTitle(CubeApp *app)
+{
+	std::lock_guard<std::mutex> lock(app->titleMutex);
+	if (app->titleChanged) {
+		glfwSetWindowTitle(app->win, app->title);
+		app->titleChanged=false;
+	}
+}
+
+/* The render thread in threaded mode: it owns the GL context and renders
+ * as fast as the swap interval allows. */
+static void renderThreadFunc(CubeApp *app, const AppConfig *cfg)
+{
+	profilerThreadName("render");
+	glfwMakeContextCurrent(app->win);
+	while (!app->quit) {
+		/* input is handled by the main thread, so pacing here
+		 * delays sampling the latest simulation state */
+		/* don't run too far ahead of the GPU */
+		frameQueueBegin(&app->frameQueue);
+		pacerWait(&app->pacer);
+		latencyPace(&app->latency);
+		if (!renderFrame(app, *cfg)) {
+			app->quit=true;
+			/* wake up the main thread */
+			glfwPostEmptyEvent();
+		}
+	}
+	glfwMakeContextCurrent(NULL);
+}
+
+/* The render thread of a view window: it draws every frame published by
+ * the main render loop, looking at the scene from a different angle, and
+ * swaps its buffers independently. */
+static void viewThreadFunc(CubeApp *app, const AppConfig *cfg, int index)
+{
+	ViewWindow *v=&app->views[index];
+	SharedFrame& sf=app->shared;
+	float angle=glm::two_pi<float>() * (float)(index + 1) / (float)(app->viewCount + 1);
+	unsigned int frame=0;
+	char name[32];
+
+	mysnprintf(name, sizeof(name), "view %d", index + 1);
+	profilerThreadName(name);
+	glfwMakeContextCurrent(v->win);
+	glfwSwapInterval(cfg->swapInterval);
+	initContextState(*cfg);
+	glGenVertexArrays(1, &v->vao);
+
+	std::vector<DrawItem> draws;
+	const char *vs=NULL;
+	const char *fs=NULL;
+	unsigned int shaderGeneration=0;
+	double time=0.0;
+
+	while (true) {
+		{
+			/* only copy the frame while holding the lock */
+			std::unique_lock<std::mutex> lock(sf.mutex);
+			sf.cond.wait(lock, [&]{return app->quit || sf.frame != frame;});
+			if (app->quit) {
+				break;
+			}
+			frame=sf.frame;
+			time=sf.time;
+			draws=sf.draws;
+			vs=sf.vs;
+			fs=sf.fs;
+			shaderGeneration=sf.shaderGeneration;
+
+			/* let the GPU wait for the updates of the main context */
+			glWaitSync(sf.fence, 0, GL_TIMEOUT_IGNORED);
+			if (v->arenaGeneration != sf.arenaGeneration) {
+				/* the buffer names are only valid while the main
+				 * context can't replace them */
+				v->arenaGeneration=sf.arenaGeneration;
+				arenaSetupVAO(&app->scene.arena, v->vao);
+			}
+		}
+
+		if (v->shaderGeneration != shaderGeneration) {
+			v->shaderGeneration=shaderGeneration;
+			sceneProgramCreate(&v->prog, vs, fs);
+		}
+
+		int w=v->width;
+		int h=v->height;
+		glm::mat4 projection=glm::perspective(glm::radians(75.0f), (float)w / (float)h, 0.1f, 10.0f);
+		glm::mat4 view=glm::translate(glm::vec3(0.0f, 0.0f, -4.0f)) * glm::rotate(angle, glm::vec3(0.0f, 1.0f, 0.0f));
+
+		glViewport(0, 0, w, h);
+		glClearColor(0.3f, 0.3f, 0.3f, 1.0f);
+		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+		if (v->prog.program) {
+			drawScene(v->prog, app->texture.tex, v->vao, draws, projection, view, time, NULL);
+		}
+
+		/* tell the main context when the GPU is done with the shared
+		 * objects, the fence must be flushed to be visible there */
+		GLsync done=glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		glFlush();
+		{
+			std::lock_guard<std::mutex> lock(sf.mutex);
+			if (v->done) {
+				glDeleteSync(v->done);
+			}
+			v->done=done;
+		}
+
+		PROFILE_ZONE("swap");
+		glfwSwapBuffers(v->win);
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(sf.mutex);
+		if (v->done) {
+			glDeleteSync(v->done);
+			v->done=0;
+		}
+	}
+	sceneProgramDestroy(&v->prog);
+	glDeleteVertexArrays(1, &v->vao);
+	v->vao=0;
+	glfwMakeContextCurrent(NULL);
+}
+
 /* The main loop of the application. This will call the display function
  *  until the application is closed. This function also keeps timing
- *  statistics. */
+ *  statistics.
+ *  In threaded mode, the main thread only handles the window system
+ *  events, while the simulation and rendering happen in their own
+ *  threads. Hence, a slow buffer swap neither delays the event handling
+ *  nor the simulation. */
 static void mainLoop(CubeApp *app, const AppConfig& cfg)
 {
-	unsigned int frame=0;
-	double start_time=glfwGetTime();
-	double last_time=start_time;
+	app->timeStart=glfwGetTime();
+	app->timeStats=app->timeStart;
+	app->statFrames=0;
 
 	info("entering main loop");
-	while (!glfwWindowShouldClose(app->win)) {
-		/* update the current time and time delta to last frame */
-		double now=glfwGetTime();
-		app->timeDelta = now - app->timeCur;
-		app->timeCur = now;
-
-		/* update FPS estimate at most once every second */
-		double elapsed = app->timeCur - last_time;
-		if (elapsed >= 1.0) {
-			char WinTitle[80];
-			app->avg_frametime=1000.0 * elapsed/(double)frame;
-			app->avg_fps=(double)frame/elapsed;
-			last_time=app->timeCur;
-			frame=0;
-			/* update window title */
-			mysnprintf(WinTitle, sizeof(WinTitle), APP_TITLE "   /// AVG: %4.2fms/frame (%.1ffps)", app->avg_frametime, app->avg_fps);
-			glfwSetWindowTitle(app->win, WinTitle);
-			info("frame time: %4.2fms/frame (%.1ffps)",app->avg_frametime, app->avg_fps);
-		}
-
-		/* call the display function */
-		displayFunc(app, cfg);
-		app->frame++;
-		frame++;
-		if (cfg.frameCount && app->frame >= cfg.frameCount) {
-			break;
+	for (int i=0; i<app->viewCount; i++) {
+		app->views[i].thread=std::thread(viewThreadFunc, app, &cfg, i);
+	}
+	if (cfg.threaded) {
+		info("simulation and rendering in separate threads, %.1f simulation steps per second", 1.0/app->simStep);
+		/* hand the GL context over to the render thread */
+		glfwMakeContextCurrent(NULL);
+		app->simThread=std::thread(simThreadFunc, app);
+		app->renderThread=std::thread(renderThreadFunc, app, &cfg);
+		while (!app->quit && !glfwWindowShouldClose(app->win)) {
+			glfwWaitEventsTimeout(0.1);
+			updateWindowTitle(app);
 		}
-		/* This is needed for GLFW event handling. This function
-		 * will call the registered callback functions to forward
-		 * the events to us. */
-		glfwPollEvents();
+		app->quit=true;
+		app->renderThread.join();
+		app->simThread.join();
+		glfwMakeContextCurrent(app->win);
+	} else {
+		while (!glfwWindowShouldClose(app->win)) {
+			/* don't run too far ahead of the GPU, limit the
+			 * frame rate, and with just-in-time pacing, wait
+			 * before sampling the input, so that it is as fresh
+			 * as possible */
+			frameQueueBegin(&app->frameQueue);
+			pacerWait(&app->pacer);
+			latencyPace(&app->latency);
+			/* This is needed for GLFW event handling. This function
+			 * will call the registered callback functions to forward
+			 * the events to us. */
+			glfwPollEvents();
+			inputReplay(app);
+			if (!renderFrame(app, cfg)) {
+				break;
+			}
+			updateWindowTitle(app);
+		}
+	}
+
+	/* stop the threads of the view windows */
+	{
+		std::lock_guard<std::mutex> lock(app->shared.mutex);
+		app->quit=true;
+		app->shared.cond.notify_all();
+	}
+	for (int i=0; i<app->viewCount; i++) {
+		app->views[i].thread.join();
 	}
 	info("left main loop\n%u frames rendered in %.1fs seconds == %.1ffps",
-		app->frame,(app->timeCur-start_time),
-		(double)app->frame/(app->timeCur-start_time) );
+		app->frame,(app->timeFrame-app->timeStart),
+		(double)app->frame/(app->timeFrame-app->timeStart) );
 }
 
 /****************************************************************************
@@ -1003,6 +8336,24 @@ void parseCommandlineArgs(AppConfig& cfg, int argc, char**argv)
 			cfg.decorated = false;
 		} else if (!std::strcmp(argv[i], "--gl-debug-sync")) {
 			cfg.debugOutputSynchronous = true;
+		} else if (!std::strcmp(argv[i], "--threaded")) {
+			cfg.threaded = true;
+		} else if (!std::strcmp(argv[i], "--latency")) {
+			cfg.latency = true;
+		} else if (!std::strcmp(argv[i], "--jit-pacing")) {
+			cfg.jitPacing = true;
+		} else if (!std::strcmp(argv[i], "--offscreen")) {
+			cfg.offscreen = true;
+		} else if (!std::strcmp(argv[i], "--golden-update")) {
+			cfg.goldenUpdate = true;
+		} else if (!std::strcmp(argv[i], "--counters")) {
+			cfg.counters = true;
+		} else if (!std::strcmp(argv[i], "--draw-stats")) {
+			cfg.drawStats = true;
+		} else if (!std::strcmp(argv[i], "--hud")) {
+			cfg.hud = true;
+		} else if (!std::strcmp(argv[i], "--log-sync")) {
+			cfg.logSync = true;
 		}
 		else if (i + 1 < argc) {
 			if (!std::strcmp(argv[i], "--width")) {
@@ -1017,9 +8368,120 @@ void parseCommandlineArgs(AppConfig& cfg, int argc, char**argv)
 				cfg.frameCount = (unsigned)strtoul(argv[++i], NULL, 10);
 			} else if (!std::strcmp(argv[i], "--gl-debug-level")) {
 				cfg.debugOutputLevel = (DebugOutputLevel)strtoul(argv[++i], NULL, 10);
+			} else if (!std::strcmp(argv[i], "--gl-debug-filter")) {
+				cfg.debugFilter = argv[++i];
+			} else if (!std::strcmp(argv[i], "--grid")) {
+				cfg.gridSize = (unsigned)strtoul(argv[++i], NULL, 10);
+			} else if (!std::strcmp(argv[i], "--sphere")) {
+				cfg.sphereTriangles = (unsigned)strtoul(argv[++i], NULL, 10);
+			} else if (!std::strcmp(argv[i], "--random")) {
+				cfg.randomObjects = (unsigned)strtoul(argv[++i], NULL, 10);
+			} else if (!std::strcmp(argv[i], "--seed")) {
+				cfg.randomSeed = (unsigned)strtoul(argv[++i], NULL, 10);
+			} else if (!std::strcmp(argv[i], "--load-mesh")) {
+				cfg.meshFiles.push_back(argv[++i]);
+			} else if (!std::strcmp(argv[i], "--save-mesh")) {
+				cfg.saveMesh = argv[++i];
+			} else if (!std::strcmp(argv[i], "--texture")) {
+				cfg.textureFile = argv[++i];
+			} else if (!std::strcmp(argv[i], "--sim-rate")) {
+				cfg.simRate = strtod(argv[++i], NULL);
+			} else if (!std::strcmp(argv[i], "--jit-margin")) {
+				cfg.jitMargin = strtod(argv[++i], NULL);
+			} else if (!std::strcmp(argv[i], "--swap-interval")) {
+				cfg.swapInterval = (int)strtol(argv[++i], NULL, 10);
+			} else if (!std::strcmp(argv[i], "--target-fps")) {
+				cfg.targetFps = strtod(argv[++i], NULL);
+			} else if (!std::strcmp(argv[i], "--frames-in-flight")) {
+				cfg.framesInFlight = (int)strtol(argv[++i], NULL, 10);
+			} else if (!std::strcmp(argv[i], "--windows")) {
+				cfg.windows = (int)strtol(argv[++i], NULL, 10);
+			} else if (!std::strcmp(argv[i], "--render-scale")) {
+				cfg.renderScale = (int)strtol(argv[++i], NULL, 10);
+				cfg.offscreen = true;
+			} else if (!std::strcmp(argv[i], "--msaa")) {
+				cfg.samples = (int)strtol(argv[++i], NULL, 10);
+				cfg.offscreen = true;
+			} else if (!std::strcmp(argv[i], "--color-format")) {
+				cfg.colorFormat = argv[++i];
+				cfg.offscreen = true;
+			} else if (!std::strcmp(argv[i], "--depth-format")) {
+				cfg.depthFormat = argv[++i];
+				cfg.offscreen = true;
+			} else if (!std::strcmp(argv[i], "--dynamic-resolution")) {
+				cfg.resolutionBudget = strtod(argv[++i], NULL);
+				cfg.offscreen = true;
+			} else if (!std::strcmp(argv[i], "--max-render-scale")) {
+				cfg.maxRenderScale = (int)strtol(argv[++i], NULL, 10);
+			} else if (!std::strcmp(argv[i], "--counter-filter")) {
+				cfg.counterFilter = argv[++i];
+				cfg.counters = true;
+			} else if (!std::strcmp(argv[i], "--metrics")) {
+				cfg.metricsAddress = argv[++i];
+			} else if (!std::strcmp(argv[i], "--bench")) {
+				cfg.benchFile = argv[++i];
+			} else if (!std::strcmp(argv[i], "--warmup")) {
+				cfg.benchWarmup = (unsigned)strtoul(argv[++i], NULL, 10);
+			} else if (!std::strcmp(argv[i], "--shader")) {
+				cfg.shader = (unsigned)strtoul(argv[++i], NULL, 10);
+			} else if (!std::strcmp(argv[i], "--gpu-budget")) {
+				cfg.gpuBudget = (unsigned)strtoul(argv[++i], NULL, 10);
+			} else if (!std::strcmp(argv[i], "--capture")) {
+				cfg.captureFile = argv[++i];
+			} else if (!std::strcmp(argv[i], "--golden")) {
+				cfg.goldenDir = argv[++i];
+			} else if (!std::strcmp(argv[i], "--golden-tolerance")) {
+				cfg.goldenTolerance = strtod(argv[++i], NULL);
+			} else if (!std::strcmp(argv[i], "--fixed-dt")) {
+				cfg.fixedDt = strtod(argv[++i], NULL);
+			} else if (!std::strcmp(argv[i], "--record-input")) {
+				cfg.recordFile = argv[++i];
+			} else if (!std::strcmp(argv[i], "--replay-input")) {
+				cfg.replayFile = argv[++i];
+			} else if (!std::strcmp(argv[i], "--log-level")) {
+				i++;
+				cfg.logLevel = (!std::strcmp(argv[i], "warn"))?LOG_WARN:LOG_INFO;
+			} else if (!std::strcmp(argv[i], "--trace")) {
+				cfg.traceFile = argv[++i];
 			}
 		}
 	}
+
+	/* the golden image tests render single-threaded into an offscreen
+	 * target of the configured size, and only in the main window */
+	if (cfg.goldenDir) {
+		cfg.offscreen = true;
+		cfg.threaded = false;
+		cfg.windows = 1;
+		cfg.fullscreen = false;
+	}
+
+	/* a benchmark always ends, in a hidden window */
+	if (cfg.benchFile) {
+		if (!cfg.frameCount) {
+			cfg.frameCount = cfg.benchWarmup + 600;
+		}
+		cfg.fullscreen = false;
+	}
+	if (cfg.shader >= sizeof(shaderFiles)/sizeof(shaderFiles[0])) {
+		cfg.shader = 1;
+	}
+	if (cfg.captureFile && !capturePatternValid(cfg.captureFile)) {
+		warn("--capture: '%s' is neither a .y4m file nor a pattern with a single %%d, not capturing", cfg.captureFile);
+		cfg.captureFile = NULL;
+	}
+
+	/* in threaded mode, the simulation runs on the real time, and input
+	 * can't be tied to frames; what is rendered must not depend on how
+	 * fast the GPU or the loader thread are, so the resolution is pinned */
+	if (cfg.fixedDt > 0.0 || cfg.recordFile || cfg.replayFile) {
+		cfg.threaded = false;
+		cfg.deterministic = true;
+		if (cfg.resolutionBudget > 0.0) {
+			warn("--dynamic-resolution is disabled in deterministic runs, using a fixed scale");
+			cfg.resolutionBudget = 0.0;
+		}
+	}
 }
 
 /****************************************************************************
@@ -1030,16 +8492,29 @@ int main (int argc, char **argv)
 {
 	AppConfig cfg;	/* the generic configuration */
 	CubeApp app;	/* the cube application stata stucture */
+	int result=0;
 
 	parseCommandlineArgs(cfg, argc, argv);
+	logInit(cfg);
 
 	if (initCubeApplication(&app, cfg)) {
-		/* initialization succeeded, enter the main loop */
-		mainLoop(&app, cfg);
+		if (cfg.goldenDir) {
+			/* run the tests instead of the main loop */
+			result=(goldenRun(&app, cfg))?0:1;
+		} else {
+			/* initialization succeeded, enter the main loop */
+			mainLoop(&app, cfg);
+			if (!benchWrite(&app.bench, &app, cfg)) {
+				result=1;
+			}
+		}
+	} else if (cfg.goldenDir || cfg.benchFile) {
+		result=1;
 	}
 	/* clean everything up */
 	destroyCubeApp(&app);
+	logShutdown();
 
-	return 0;
+	return result;
 }
 
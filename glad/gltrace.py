@@ -0,0 +1,208 @@
+#!/usr/bin/env python3
+"""Generate the GL call tracing layer from the glad loader.
+
+For every GL function declared in glad/include/glad/gl.h, this creates a
+wrapper which counts the calls and measures the CPU time spent in them,
+and gltraceInstall(), which replaces the function pointers loaded by glad
+with the wrappers. Run it from the repository root whenever the loader is
+regenerated:
+
+    python3 glad/gltrace.py
+
+This writes glad/include/glad/gltrace.h and glad/src/gltrace.c.
+"""
+
+import os
+import re
+import sys
+
+ROOT = os.path.dirname(os.path.abspath(__file__))
+GL_H = os.path.join(ROOT, 'include', 'glad', 'gl.h')
+OUT_H = os.path.join(ROOT, 'include', 'glad', 'gltrace.h')
+OUT_C = os.path.join(ROOT, 'src', 'gltrace.c')
+
+TYPEDEF_RE = re.compile(r'^typedef (.+?) \(GLAD_API_PTR \*(PFNGL\w+PROC)\)\((.*)\);$')
+DECL_RE = re.compile(r'^GLAD_API_CALL (PFNGL\w+PROC) glad_(gl\w+);$')
+
+
+def parse(path):
+    typedefs = {}
+    functions = []
+    with open(path) as f:
+        for line in f:
+            line = line.strip()
+            m = TYPEDEF_RE.match(line)
+            if m:
+                typedefs[m.group(2)] = (m.group(1).strip(), m.group(3).strip())
+                continue
+            m = DECL_RE.match(line)
+            if m:
+                functions.append((m.group(2), m.group(1)))
+    return typedefs, functions
+
+
+def arg_names(params):
+    if params in ('', 'void'):
+        return []
+    names = []
+    for p in params.split(','):
+        p = re.sub(r'\[.*\]', '', p).strip()
+        names.append(re.findall(r'\w+', p)[-1])
+    return names
+
+
+HEADER = '''/* GL call tracing layer, generated by glad/gltrace.py from glad/include/glad/gl.h.
+ * Do not edit. */
+#ifndef GLAD_GLTRACE_H_
+#define GLAD_GLTRACE_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* the counters of a single GL function */
+typedef struct {
+    const char *name;
+    unsigned long long calls;
+    unsigned long long nanoseconds;
+} GLTraceStat;
+
+/* Wrap every GL function pointer loaded by glad with a counting and timing
+ * shim. Call this once, right after gladLoadGL(). */
+void gltraceInstall(void);
+
+/* The number of GL functions, i.e. the size of the array for gltraceSnapshot */
+unsigned int gltraceFunctionCount(void);
+
+/* Copy the counters of all functions into stats, and reset them */
+void gltraceSnapshot(GLTraceStat *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* GLAD_GLTRACE_H_ */
+'''
+
+SOURCE_HEAD = '''/* GL call tracing layer, generated by glad/gltrace.py from glad/include/glad/gl.h.
+ * Do not edit. */
+#include <glad/gl.h>
+#include <glad/gltrace.h>
+
+#ifdef _WIN32
+#include <windows.h>
+static unsigned long long gltrace_now(void)
+{
+    static LARGE_INTEGER freq;
+    LARGE_INTEGER count;
+    if (!freq.QuadPart) {
+        QueryPerformanceFrequency(&freq);
+    }
+    QueryPerformanceCounter(&count);
+    return (unsigned long long)((double)count.QuadPart * 1.0e9 / (double)freq.QuadPart);
+}
+#else
+#include <time.h>
+static unsigned long long gltrace_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + (unsigned long long)ts.tv_nsec;
+}
+#endif
+
+/* GL may be called from several threads */
+#ifdef __GNUC__
+#define GLTRACE_ADD(var, val) __atomic_fetch_add(&(var), (val), __ATOMIC_RELAXED)
+#define GLTRACE_TAKE(var) __atomic_exchange_n(&(var), 0, __ATOMIC_RELAXED)
+#else
+#define GLTRACE_ADD(var, val) ((var) += (val))
+#define GLTRACE_TAKE(var) gltrace_take(&(var))
+static unsigned long long gltrace_take(unsigned long long *var)
+{
+    unsigned long long val = *var;
+    *var = 0;
+    return val;
+}
+#endif
+
+#define GLTRACE_COUNT %(count)d
+
+static const char *gltrace_names[GLTRACE_COUNT] = {
+%(names)s
+};
+
+static unsigned long long gltrace_calls[GLTRACE_COUNT];
+static unsigned long long gltrace_nanoseconds[GLTRACE_COUNT];
+
+static void gltrace_record(unsigned int idx, unsigned long long start)
+{
+    GLTRACE_ADD(gltrace_calls[idx], 1ULL);
+    GLTRACE_ADD(gltrace_nanoseconds[idx], gltrace_now() - start);
+}
+
+'''
+
+SOURCE_TAIL = '''
+void gltraceInstall(void)
+{
+    static int installed = 0;
+    if (installed) {
+        return;
+    }
+    installed = 1;
+%(install)s
+}
+
+unsigned int gltraceFunctionCount(void)
+{
+    return GLTRACE_COUNT;
+}
+
+void gltraceSnapshot(GLTraceStat *stats)
+{
+    unsigned int i;
+    for (i = 0; i < GLTRACE_COUNT; i++) {
+        stats[i].name = gltrace_names[i];
+        stats[i].calls = GLTRACE_TAKE(gltrace_calls[i]);
+        stats[i].nanoseconds = GLTRACE_TAKE(gltrace_nanoseconds[i]);
+    }
+}
+'''
+
+
+def main():
+    typedefs, functions = parse(GL_H)
+    names = []
+    wrappers = []
+    install = []
+    for idx, (name, pfn) in enumerate(functions):
+        if pfn not in typedefs:
+            sys.exit('no typedef for %s' % pfn)
+        ret, params = typedefs[pfn]
+        args = ', '.join(arg_names(params))
+        names.append('    "%s",' % name)
+        call = 'gltrace_next_%s(%s)' % (name, args)
+        if ret == 'void':
+            body = '    %s;\n    gltrace_record(%d, gltrace_start);\n' % (call, idx)
+        else:
+            body = ('    %s gltrace_result = %s;\n    gltrace_record(%d, gltrace_start);\n'
+                    '    return gltrace_result;\n' % (ret, call, idx))
+        wrappers.append('static %s gltrace_next_%s;\n'
+                        'static %s GLAD_API_PTR gltrace_%s(%s)\n{\n'
+                        '    unsigned long long gltrace_start = gltrace_now();\n%s}\n'
+                        % (pfn, name, ret, name, params or 'void', body))
+        install.append('    if (glad_%s) {\n        gltrace_next_%s = glad_%s;\n'
+                       '        glad_%s = gltrace_%s;\n    }' % (name, name, name, name, name))
+
+    with open(OUT_H, 'w') as f:
+        f.write(HEADER)
+    with open(OUT_C, 'w') as f:
+        f.write(SOURCE_HEAD % {'count': len(functions), 'names': '\n'.join(names)})
+        f.write('\n'.join(wrappers))
+        f.write(SOURCE_TAIL % {'install': '\n'.join(install)})
+    print('%d functions' % len(functions))
+
+
+if __name__ == '__main__':
+    main()
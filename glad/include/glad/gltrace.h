@@ -0,0 +1,31 @@
+/* GL call tracing layer, generated by glad/gltrace.py from glad/include/glad/gl.h.
+ * Do not edit. */
+#ifndef GLAD_GLTRACE_H_
+#define GLAD_GLTRACE_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* the counters of a single GL function */
+typedef struct {
+    const char *name;
+    unsigned long long calls;
+    unsigned long long nanoseconds;
+} GLTraceStat;
+
+/* Wrap every GL function pointer loaded by glad with a counting and timing
+ * shim. Call this once, right after gladLoadGL(). */
+void gltraceInstall(void);
+
+/* The number of GL functions, i.e. the size of the array for gltraceSnapshot */
+unsigned int gltraceFunctionCount(void);
+
+/* Copy the counters of all functions into stats, and reset them */
+void gltraceSnapshot(GLTraceStat *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* GLAD_GLTRACE_H_ */
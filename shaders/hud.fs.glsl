@@ -0,0 +1,14 @@
+#version 150 core
+
+uniform sampler2D atlas;
+
+in vec4 v_clr;
+in vec2 v_tex;
+
+out vec4 color;
+
+void main()
+{
+	float coverage = texelFetch(atlas, ivec2(floor(v_tex)), 0).r;
+	color = vec4(v_clr.rgb, v_clr.a * coverage);
+}
@@ -0,0 +1,22 @@
+#version 150 core
+
+/* 2 / viewport size */
+uniform vec2 scale;
+
+/* per instance: rectangles on screen and in the atlas, in pixels, y down */
+in vec4 pos;
+in vec4 tex;
+in vec4 clr;
+
+out vec4 v_clr;
+out vec2 v_tex;
+
+void main()
+{
+	/* the corner of the quad, drawn as a triangle strip of 4 vertices */
+	vec2 corner = vec2(float(gl_VertexID & 1), float(gl_VertexID >> 1));
+	vec2 p = pos.xy + corner * pos.zw;
+	v_clr = clr;
+	v_tex = tex.xy + corner * tex.zw;
+	gl_Position = vec4(p.x * scale.x - 1.0, 1.0 - p.y * scale.y, 0.0, 1.0);
+}
@@ -0,0 +1,13 @@
+#version 150 core
+
+uniform sampler2D diffuse;
+
+in vec4 v_clr;
+in vec2 v_tex;
+
+out vec4 color;
+
+void main()
+{
+	color = v_clr * texture(diffuse, v_tex);
+}
@@ -0,0 +1,18 @@
+#version 150 core
+
+uniform mat4 modelView;
+uniform mat4 projection;
+
+in vec3 pos;
+in vec4 clr;
+in vec2 tex;
+
+out vec4 v_clr;
+out vec2 v_tex;
+
+void main()
+{
+	v_clr = clr;
+	v_tex = tex;
+	gl_Position = projection * modelView * vec4(pos, 1.0);
+}
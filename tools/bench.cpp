@@ -0,0 +1,472 @@
+/* bench: run HelloCube benchmark scenarios and compare the results
+ *
+ * bench run [options] scenarios.txt
+ *	Runs every scenario of the file several times, each in a fresh
+ *	HelloCube process with --bench, and writes the statistics across the
+ *	repetitions to a results file.
+ * bench compare [options] old.tsv new.tsv
+ *	Compares two results files scenario by scenario with Welch's t-test,
+ *	and exits with status 1 if a scenario got significantly slower.
+ *
+ * See tools/scenarios.txt for the format of the scenario file, and the
+ * README for the options. */
+
+#include <string>
+#include <vector>
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/****************************************************************************
+ * DATA STRUCTURES                                                          *
+ ****************************************************************************/
+
+/* One value of an axis of the scenario matrix */
+typedef struct {
+	std::string name;
+	std::string args;
+} AxisValue;
+
+/* A scenario: one combination of the axis values */
+typedef struct {
+	std::string name;
+	std::string args;
+	std::vector<double> mean;	/* mean frame time of each repetition in ms */
+	std::vector<double> p99;	/* 99th percentile of each repetition in ms */
+} Scenario;
+
+/* The statistics of a scenario, as written to the results file */
+typedef struct {
+	std::string name;
+	unsigned int reps;
+	double mean;			/* of the repetition means, in ms */
+	double ci95;			/* half width of the 95% confidence interval */
+	double stddev;			/* of the repetition means */
+	double p99;			/* mean of the 99th percentiles */
+	std::vector<double> samples;	/* the repetition means */
+} Result;
+
+typedef struct {
+	const char *exe;
+	const char *output;
+	const char *runFile;
+	unsigned int reps;
+	unsigned int frames;
+	unsigned int warmup;
+	double threshold;		/* minimum relative change in percent */
+
+	void init() {
+		exe="./HelloCube";
+		output="bench.tsv";
+		runFile="bench-run.txt";
+		reps=5;
+		frames=600;
+		warmup=120;
+		threshold=1.0;
+	}
+} BenchConfig;
+
+/****************************************************************************
+ * STATISTICS                                                               *
+ ****************************************************************************/
+
+/* The 97.5% quantile of Student's t distribution with df degrees of
+ * freedom, for two-sided 95% intervals and tests */
+static double tQuantile(double df)
+{
+	static const double table[]={
+		12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+		2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+		2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042
+	};
+	const double z=1.959964;
+
+	if (df < 1.0) {
+		return table[0];
+	}
+	if (df <= 30.0) {
+		/* rounding down is conservative */
+		return table[(int)df - 1];
+	}
+	/* first terms of the Cornish-Fisher expansion */
+	return z + (z * z * z + z) / (4.0 * df);
+}
+
+static double mean(const std::vector<double>& v)
+{
+	double sum=0.0;
+	size_t i;
+
+	for (i=0; i<v.size(); i++) {
+		sum += v[i];
+	}
+	return (v.empty())?0.0:sum / (double)v.size();
+}
+
+/* sample variance */
+static double variance(const std::vector<double>& v)
+{
+	double m=mean(v);
+	double sq=0.0;
+	size_t i;
+
+	if (v.size() < 2) {
+		return 0.0;
+	}
+	for (i=0; i<v.size(); i++) {
+		sq += (v[i] - m) * (v[i] - m);
+	}
+	return sq / (double)(v.size() - 1);
+}
+
+/****************************************************************************
+ * SCENARIOS                                                                *
+ ****************************************************************************/
+
+static std::string trim(const std::string& s)
+{
+	size_t a=s.find_first_not_of(" \t\r\n");
+	size_t b=s.find_last_not_of(" \t\r\n");
+	return (a == std::string::npos)?std::string():s.substr(a, b - a + 1);
+}
+
+/* Read the scenario file and build all combinations of the axis values.
+ * Every line is either "args <arguments>", which are passed to every run,
+ * or "<axis> <name>=<arguments> | <name>=<arguments> ...". */
+static bool readScenarios(const char *file, std::vector<Scenario>& scenarios)
+{
+	FILE *f=fopen(file, "rt");
+	char buf[1024];
+	std::string common;
+	std::vector< std::vector<AxisValue> > axes;
+	unsigned int line=0;
+	size_t i,j;
+
+	if (!f) {
+		fprintf(stderr, "bench: failed to open '%s'\n", file);
+		return false;
+	}
+	while (fgets(buf, sizeof(buf), f)) {
+		std::string l=trim(buf);
+		line++;
+		if (l.empty() || l[0] == '#') {
+			continue;
+		}
+		size_t sep=l.find_first_of(" \t");
+		std::string axis=l.substr(0, sep);
+		std::string rest=(sep == std::string::npos)?std::string():trim(l.substr(sep));
+		if (axis == "args") {
+			common += " " + rest;
+			continue;
+		}
+
+		std::vector<AxisValue> values;
+		size_t pos=0;
+		while (pos <= rest.size()) {
+			size_t end=rest.find('|', pos);
+			if (end == std::string::npos) {
+				end=rest.size();
+			}
+			std::string v=trim(rest.substr(pos, end - pos));
+			size_t eq=v.find('=');
+			if (eq == std::string::npos || eq == 0) {
+				fprintf(stderr, "bench: %s:%u: expected name=arguments in axis '%s'\n", file, line, axis.c_str());
+				fclose(f);
+				return false;
+			}
+			AxisValue av={trim(v.substr(0, eq)), trim(v.substr(eq + 1))};
+			values.push_back(av);
+			pos=end + 1;
+		}
+		axes.push_back(values);
+	}
+	fclose(f);
+
+	/* the cartesian product, the first axis varies slowest */
+	Scenario s;
+	s.args=common;
+	scenarios.clear();
+	scenarios.push_back(s);
+	for (i=0; i<axes.size(); i++) {
+		std::vector<Scenario> next;
+		for (j=0; j<scenarios.size(); j++) {
+			for (size_t k=0; k<axes[i].size(); k++) {
+				Scenario c=scenarios[j];
+				c.name += ((c.name.empty())?"":"/") + axes[i][k].name;
+				c.args += " " + axes[i][k].args;
+				next.push_back(c);
+			}
+		}
+		scenarios.swap(next);
+	}
+	if (axes.empty()) {
+		scenarios[0].name="default";
+	}
+	return true;
+}
+
+/* Run a scenario once and add the summary of the run to it */
+static bool runScenario(Scenario& s, const BenchConfig& cfg)
+{
+	char cmd[4096];
+	char key[64];
+	double value, m=-1.0, p99=-1.0;
+	FILE *f;
+	int res;
+
+	remove(cfg.runFile);
+	snprintf(cmd, sizeof(cmd), "\"%s\" --log-level warn %s --frameCount %u --warmup %u --bench \"%s\"",
+		cfg.exe, s.args.c_str(), cfg.warmup + cfg.frames, cfg.warmup, cfg.runFile);
+	res=system(cmd);
+	if (res != 0) {
+		fprintf(stderr, "bench: '%s' failed with status %d\n", cmd, res);
+		return false;
+	}
+	f=fopen(cfg.runFile, "rt");
+	if (!f) {
+		fprintf(stderr, "bench: no summary from '%s'\n", cmd);
+		return false;
+	}
+	while (fscanf(f, "%63s %lf", key, &value) == 2) {
+		if (!strcmp(key, "mean_ms")) {
+			m=value;
+		} else if (!strcmp(key, "p99_ms")) {
+			p99=value;
+		}
+	}
+	fclose(f);
+	remove(cfg.runFile);
+	if (m < 0.0 || p99 < 0.0) {
+		fprintf(stderr, "bench: incomplete summary from '%s'\n", cmd);
+		return false;
+	}
+	s.mean.push_back(m);
+	s.p99.push_back(p99);
+	return true;
+}
+
+/****************************************************************************
+ * RESULTS FILES                                                            *
+ ****************************************************************************/
+
+/* The results are tab-separated: scenario, repetitions, mean, confidence
+ * interval, standard deviation, p99 (all in ms), and the comma-separated
+ * repetition means the compare command uses. */
+static bool writeResults(const char *file, const std::vector<Scenario>& scenarios)
+{
+	FILE *f=fopen(file, "wt");
+	size_t i,j;
+
+	if (!f) {
+		fprintf(stderr, "bench: failed to open '%s'\n", file);
+		return false;
+	}
+	fprintf(f, "# scenario\treps\tmean_ms\tci95_ms\tstddev_ms\tp99_ms\tsamples_ms\n");
+	for (i=0; i<scenarios.size(); i++) {
+		const Scenario& s=scenarios[i];
+		double sd=sqrt(variance(s.mean));
+		double ci=(s.mean.size() > 1)?tQuantile((double)(s.mean.size() - 1)) * sd / sqrt((double)s.mean.size()):0.0;
+		fprintf(f, "%s\t%u\t%.6f\t%.6f\t%.6f\t%.6f\t", s.name.c_str(), (unsigned)s.mean.size(),
+			mean(s.mean), ci, sd, mean(s.p99));
+		for (j=0; j<s.mean.size(); j++) {
+			fprintf(f, "%s%.6f", (j)?",":"", s.mean[j]);
+		}
+		fprintf(f, "\n");
+	}
+	fclose(f);
+	return true;
+}
+
+static bool readResults(const char *file, std::vector<Result>& results)
+{
+	FILE *f=fopen(file, "rt");
+	char buf[8192];
+	char name[1024], samples[4096];
+
+	if (!f) {
+		fprintf(stderr, "bench: failed to open '%s'\n", file);
+		return false;
+	}
+	results.clear();
+	while (fgets(buf, sizeof(buf), f)) {
+		Result r;
+		if (buf[0] == '#') {
+			continue;
+		}
+		samples[0]=0;
+		if (sscanf(buf, "%1023[^\t]\t%u\t%lf\t%lf\t%lf\t%lf\t%4095s", name, &r.reps,
+			&r.mean, &r.ci95, &r.stddev, &r.p99, samples) < 6) {
+			continue;
+		}
+		r.name=name;
+		for (char *p=strtok(samples, ","); p; p=strtok(NULL, ",")) {
+			r.samples.push_back(strtod(p, NULL));
+		}
+		results.push_back(r);
+	}
+	fclose(f);
+	return true;
+}
+
+/****************************************************************************
+ * COMMANDS                                                                 *
+ ****************************************************************************/
+
+static int benchRun(const BenchConfig& cfg, const char *file)
+{
+	std::vector<Scenario> scenarios;
+	unsigned int rep;
+	size_t i;
+
+	if (!readScenarios(file, scenarios)) {
+		return 2;
+	}
+	printf("%u scenarios, %u repetitions of %u frames after %u frames warm-up\n",
+		(unsigned)scenarios.size(), cfg.reps, cfg.frames, cfg.warmup);
+
+	/* the repetitions are interleaved, so that slow drifts like the GPU
+	 * heating up affect all scenarios alike */
+	for (rep=0; rep<cfg.reps; rep++) {
+		for (i=0; i<scenarios.size(); i++) {
+			Scenario& s=scenarios[i];
+			if (!runScenario(s, cfg)) {
+				return 2;
+			}
+			printf("[%u/%u] %-40s %8.3fms\n", rep + 1, cfg.reps, s.name.c_str(), s.mean.back());
+			fflush(stdout);
+		}
+	}
+	if (!writeResults(cfg.output, scenarios)) {
+		return 2;
+	}
+
+	printf("\n%-40s %10s %10s %10s\n", "scenario", "mean", "+/-95%", "p99");
+	for (i=0; i<scenarios.size(); i++) {
+		const Scenario& s=scenarios[i];
+		double n=(double)s.mean.size();
+		double ci=(n > 1.0)?tQuantile(n - 1.0) * sqrt(variance(s.mean) / n):0.0;
+		printf("%-40s %8.3fms %8.3fms %8.3fms\n", s.name.c_str(), mean(s.mean), ci, mean(s.p99));
+	}
+	printf("results written to '%s'\n", cfg.output);
+	return 0;
+}
+
+static int benchCompare(const BenchConfig& cfg, const char *oldFile, const char *newFile)
+{
+	std::vector<Result> a,b;
+	unsigned int regressions=0;
+	size_t i,j;
+
+	if (!readResults(oldFile, a) || !readResults(newFile, b)) {
+		return 2;
+	}
+	printf("%-40s %10s %10s %8s %8s  %s\n", "scenario", "old", "new", "change", "t", "verdict");
+	for (i=0; i<b.size(); i++) {
+		const Result& n=b[i];
+		const Result *o=NULL;
+		for (j=0; j<a.size(); j++) {
+			if (a[j].name == n.name) {
+				o=&a[j];
+				break;
+			}
+		}
+		if (!o) {
+			printf("%-40s %10s %8.3fms %8s %8s  %s\n", n.name.c_str(), "-", n.mean, "", "", "new");
+			continue;
+		}
+
+		double change=100.0 * (n.mean - o->mean) / o->mean;
+		const char *verdict="same";
+		double t=0.0;
+		if (o->samples.size() < 2 || n.samples.size() < 2) {
+			verdict="too few samples";
+		} else {
+			/* Welch's t-test, the variances may differ */
+			double va=variance(o->samples) / (double)o->samples.size();
+			double vb=variance(n.samples) / (double)n.samples.size();
+			bool significant;
+			if (va + vb > 0.0) {
+				double df=(va + vb) * (va + vb) /
+					(va * va / (double)(o->samples.size() - 1) + vb * vb / (double)(n.samples.size() - 1));
+				t=(n.mean - o->mean) / sqrt(va + vb);
+				significant=(fabs(t) > tQuantile(df));
+			} else {
+				significant=(n.mean != o->mean);
+			}
+			if (significant && fabs(change) >= cfg.threshold) {
+				if (change > 0.0) {
+					verdict="REGRESSION";
+					regressions++;
+				} else {
+					verdict="improvement";
+				}
+			}
+		}
+		printf("%-40s %8.3fms %8.3fms %+7.2f%% %8.2f  %s\n", n.name.c_str(), o->mean, n.mean, change, t, verdict);
+	}
+	printf("%u significant regressions\n", regressions);
+	return (regressions)?1:0;
+}
+
+/****************************************************************************
+ * PROGRAM ENTRY POINT                                                      *
+ ****************************************************************************/
+
+static void usage()
+{
+	fprintf(stderr,
+		"usage: bench run [--exe $path] [--reps $n] [--frames $n] [--warmup $n] [--output $file] scenarios.txt\n"
+		"       bench compare [--threshold $percent] old.tsv new.tsv\n");
+}
+
+int main(int argc, char **argv)
+{
+	BenchConfig cfg;
+	std::vector<const char*> files;
+	int i;
+
+	cfg.init();
+	if (argc < 2) {
+		usage();
+		return 2;
+	}
+	for (i=2; i<argc; i++) {
+		if (argv[i][0] != '-' || argv[i][1] != '-') {
+			files.push_back(argv[i]);
+		} else if (i + 1 < argc) {
+			if (!strcmp(argv[i], "--exe")) {
+				cfg.exe=argv[++i];
+			} else if (!strcmp(argv[i], "--reps")) {
+				cfg.reps=(unsigned)strtoul(argv[++i], NULL, 10);
+			} else if (!strcmp(argv[i], "--frames")) {
+				cfg.frames=(unsigned)strtoul(argv[++i], NULL, 10);
+			} else if (!strcmp(argv[i], "--warmup")) {
+				cfg.warmup=(unsigned)strtoul(argv[++i], NULL, 10);
+			} else if (!strcmp(argv[i], "--output")) {
+				cfg.output=argv[++i];
+			} else if (!strcmp(argv[i], "--threshold")) {
+				cfg.threshold=strtod(argv[++i], NULL);
+			} else {
+				fprintf(stderr, "bench: unknown option '%s'\n", argv[i]);
+				return 2;
+			}
+		} else {
+			fprintf(stderr, "bench: option '%s' needs a value\n", argv[i]);
+			return 2;
+		}
+	}
+
+	if (!strcmp(argv[1], "run") && files.size() == 1) {
+		if (cfg.reps < 1 || cfg.frames < 2) {
+			fprintf(stderr, "bench: need at least one repetition of two frames\n");
+			return 2;
+		}
+		return benchRun(cfg, files[0]);
+	} else if (!strcmp(argv[1], "compare") && files.size() == 2) {
+		return benchCompare(cfg, files[0], files[1]);
+	}
+	usage();
+	return 2;
+}